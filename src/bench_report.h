@@ -0,0 +1,132 @@
+
+// Results file shared by the benchmarks (serial_bench, simprpc_bench) and
+// read by simprpc_compare, plus an allocation counter.
+//
+// Schema, version 1:
+//
+//   {"schema":"simprpc-bench/1","bench":"rpc","config":{"mode":"open",...},
+//    "trials":[{"all":{"calls_per_sec":1000,"p99_us":250,...},"echo":{...}},...]}
+//
+// Every trial maps a case (a method, an encoded type, "all") to its metrics.
+// The name of a metric tells which way is better: *_per_sec higher, *_us,
+// *_ns and allocs_per_* lower. Other metrics (counts) are only reported.
+// Cases and metrics may be added, existing names keep their meaning; a
+// change of meaning bumps the version.
+//
+// Include this from one file of a program only, it replaces operator new.
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+
+#include "common/types.h"
+
+namespace simprpc{
+
+const char BENCH_SCHEMA[] = "simprpc-bench/1";
+
+// metric name -> value, case name -> metrics
+typedef std::map<std::string, double> BenchMetrics;
+typedef std::map<std::string, BenchMetrics> BenchTrial;
+
+namespace bench{
+
+// heap allocations of the whole process since it started
+inline std::atomic<uint64>& allocations() {
+  static std::atomic<uint64> n(0);
+  return n;
+}
+
+inline std::string quote(const std::string& s) {
+  std::string q("\"");
+  for(char c : s) {
+    if(c == '"' || c == '\\')
+      q += '\\';
+    if(static_cast<unsigned char>(c) >= 0x20)
+      q += c;
+  }
+  return q + "\"";
+}
+
+inline std::string number(double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.6g", v);
+  return buf;
+}
+
+// config values are JSON already: quote() strings, number() numbers
+inline std::string report(const std::string& name, const std::vector<std::pair<std::string, std::string> >& config,
+                          const std::vector<BenchTrial>& trials) {
+  std::string js = "{\"schema\":" + quote(BENCH_SCHEMA) + ",\"bench\":" + quote(name) + ",\"config\":{";
+  for(size_t i = 0; i < config.size(); i++)
+    js += (i ? "," : "") + quote(config[i].first) + ":" + config[i].second;
+  js += "},\n\"trials\":[";
+  for(size_t t = 0; t < trials.size(); t++) {
+    js += t ? ",\n{" : "\n{";
+    bool firstCase = true;
+    for(auto &c : trials[t]) {
+      js += (firstCase ? "" : ",") + quote(c.first) + ":{";
+      firstCase = false;
+      bool first = true;
+      for(auto &m : c.second) {
+        js += (first ? "" : ",") + quote(m.first) + ":" + number(m.second);
+        first = false;
+      }
+      js += "}";
+    }
+    js += "}";
+  }
+  js += "\n]}\n";
+  return js;
+}
+
+// path "-" is stdout
+inline bool writeReport(const std::string& path, const std::string& js) {
+  if(path == "-")
+    return fwrite(js.data(), 1, js.size(), stdout) == js.size();
+  FILE* f = fopen(path.c_str(), "w");
+  if(f == nullptr)
+    return false;
+  bool ok = fwrite(js.data(), 1, js.size(), f) == js.size();
+  return fclose(f) == 0 && ok;
+}
+
+}
+
+}
+
+// count every allocation, the rest is plain malloc/free. Not inlined, so the
+// compiler does not pair a new expression with free().
+__attribute__((noinline)) void* operator new(size_t n) {
+  simprpc::bench::allocations().fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(n ? n : 1);
+  if(p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void* operator new[](size_t n) {
+  return operator new(n);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
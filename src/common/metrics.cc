@@ -0,0 +1,209 @@
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+#include "metrics.h"
+
+using namespace simprpc;
+
+static std::atomic<size_t> next_stripe(0);
+static thread_local size_t my_stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % metrics::STRIPES;
+
+size_t metrics::stripe() {
+  return my_stripe;
+}
+
+uint64 metrics::nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+uint64 Counter::value() const {
+  uint64 v = 0;
+  for(auto &c : _cells)
+    v += c.v.load(std::memory_order_relaxed);
+  return v;
+}
+
+
+Histogram::Stripe::Stripe(): count(0), sum(0), max(0) {
+  for(auto &b : buckets)
+    b.store(0, std::memory_order_relaxed);
+}
+
+int Histogram::bucketOf(uint64 us) {
+  if(us < uint64(SUB_BUCKETS))
+    return int(us);
+  int e = 63 - __builtin_clzl(us);
+  if(e >= MAX_EXP)
+    return BUCKETS - 1;
+  int sub = int(us >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+  return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64 Histogram::upperBound(int i) {
+  if(i < SUB_BUCKETS)
+    return uint64(i);
+  int e = i / SUB_BUCKETS + SUB_BITS - 1;
+  uint64 width = uint64(1) << (e - SUB_BITS);
+  return (uint64(SUB_BUCKETS + i % SUB_BUCKETS) << (e - SUB_BITS)) + width - 1;
+}
+
+void Histogram::record(uint64 us) {
+  Stripe &s = _stripes[metrics::stripe()];
+  s.buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+  s.count.fetch_add(1, std::memory_order_relaxed);
+  s.sum.fetch_add(us, std::memory_order_relaxed);
+  uint64 m = s.max.load(std::memory_order_relaxed);
+  while(us > m && !s.max.compare_exchange_weak(m, us, std::memory_order_relaxed))
+    ;
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snap;
+  snap.count = snap.sum = snap.max = 0;
+  snap.buckets.assign(BUCKETS, 0);
+  for(auto &s : _stripes) {
+    for(int i = 0; i < BUCKETS; i++)
+      snap.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+    snap.count += s.count.load(std::memory_order_relaxed);
+    snap.sum += s.sum.load(std::memory_order_relaxed);
+    snap.max = std::max<uint64>(snap.max, s.max.load(std::memory_order_relaxed));
+  }
+  return snap;
+}
+
+uint64 Histogram::Snapshot::quantile(double q) const {
+  uint64 total = 0;
+  for(auto b : buckets)
+    total += b;
+  if(total == 0)
+    return 0;
+  uint64 rank = uint64(q * total + 0.5);
+  if(rank == 0)
+    rank = 1;
+  uint64 seen = 0;
+  for(int i = 0; i < BUCKETS; i++) {
+    seen += buckets[i];
+    if(seen >= rank)
+      return std::min(upperBound(i), max);
+  }
+  return max;
+}
+
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& labels) {
+  std::lock_guard<std::mutex> lock(_lock);
+  std::unique_ptr<Counter> &p = _counters[Key(name, labels)];
+  if(!p)
+    p.reset(new Counter());
+  return *p;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& labels) {
+  std::lock_guard<std::mutex> lock(_lock);
+  std::unique_ptr<Gauge> &p = _gauges[Key(name, labels)];
+  if(!p)
+    p.reset(new Gauge());
+  return *p;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& labels, std::function<int64()> sample) {
+  std::lock_guard<std::mutex> lock(_lock);
+  std::unique_ptr<Gauge> &p = _gauges[Key(name, labels)];
+  p.reset(new Gauge(std::move(sample)));
+  return *p;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& labels) {
+  std::lock_guard<std::mutex> lock(_lock);
+  std::unique_ptr<Histogram> &p = _histograms[Key(name, labels)];
+  if(!p)
+    p.reset(new Histogram());
+  return *p;
+}
+
+// name{labels}, extra is one more label
+static std::string series(const std::string& name, const std::string& labels,
+                          const std::string& extra = std::string()) {
+  std::string s(name);
+  if(labels.empty() && extra.empty())
+    return s;
+  s += '{';
+  s += labels;
+  if(!labels.empty() && !extra.empty())
+    s += ',';
+  s += extra;
+  s += '}';
+  return s;
+}
+
+static std::string number(double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.9g", v);
+  return buf;
+}
+
+void MetricsRegistry::values(std::vector<std::pair<std::string, double> >& out) const {
+  std::lock_guard<std::mutex> lock(_lock);
+  for(auto &c : _counters)
+    out.push_back(std::make_pair(series(c.first.first, c.first.second), double(c.second->value())));
+  for(auto &g : _gauges)
+    out.push_back(std::make_pair(series(g.first.first, g.first.second), double(g.second->value())));
+  for(auto &h : _histograms) {
+    Histogram::Snapshot snap = h.second->snapshot();
+    const std::string &name = h.first.first, &labels = h.first.second;
+    out.push_back(std::make_pair(series(name + "_count", labels), double(snap.count)));
+    out.push_back(std::make_pair(series(name + "_sum", labels), snap.sum / 1e6));
+    out.push_back(std::make_pair(series(name + "_max", labels), snap.max / 1e6));
+    out.push_back(std::make_pair(series(name + "_p50", labels), snap.quantile(0.5) / 1e6));
+    out.push_back(std::make_pair(series(name + "_p90", labels), snap.quantile(0.9) / 1e6));
+    out.push_back(std::make_pair(series(name + "_p99", labels), snap.quantile(0.99) / 1e6));
+  }
+}
+
+void MetricsRegistry::prometheus(std::string& out) const {
+  std::lock_guard<std::mutex> lock(_lock);
+  // the maps are sorted by name, series of one metric are adjacent
+  std::string last;
+  for(auto &c : _counters) {
+    if(c.first.first != last)
+      out += "# TYPE " + c.first.first + " counter\n";
+    last = c.first.first;
+    out += series(c.first.first, c.first.second) + " " + number(double(c.second->value())) + "\n";
+  }
+  for(auto &g : _gauges) {
+    if(g.first.first != last)
+      out += "# TYPE " + g.first.first + " gauge\n";
+    last = g.first.first;
+    out += series(g.first.first, g.first.second) + " " + number(double(g.second->value())) + "\n";
+  }
+  for(auto &h : _histograms) {
+    const std::string &name = h.first.first, &labels = h.first.second;
+    if(name != last)
+      out += "# TYPE " + name + " histogram\n";
+    last = name;
+    Histogram::Snapshot snap = h.second->snapshot();
+    // one bucket per power of two is plenty for dashboards, stop at the
+    // highest one in use
+    int top = 0;
+    for(int i = 0; i < Histogram::BUCKETS; i++) {
+      if(snap.buckets[i] > 0)
+        top = i;
+    }
+    uint64 cumulative = 0;
+    for(int i = 0; i < Histogram::BUCKETS; i++) {
+      cumulative += snap.buckets[i];
+      if(i % Histogram::SUB_BUCKETS != Histogram::SUB_BUCKETS - 1)
+        continue;
+      double le = Histogram::upperBound(i) / 1e6;
+      out += series(name + "_bucket", labels, "le=\"" + number(le) + "\"") + " " + number(double(cumulative)) + "\n";
+      if(i >= top)
+        break;
+    }
+    out += series(name + "_bucket", labels, "le=\"+Inf\"") + " " + number(double(snap.count)) + "\n";
+    out += series(name + "_sum", labels) + " " + number(snap.sum / 1e6) + "\n";
+    out += series(name + "_count", labels) + " " + number(double(snap.count)) + "\n";
+  }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <utility>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Counters, gauges and latency histograms for the hot path.
+
+  Counters and histograms are striped: every thread writes the stripe its
+  slot maps to with relaxed atomics, so recording never takes a lock and
+  threads rarely share a cache line. Readers add the stripes up, a value
+  read while others record is a consistent lower bound, not a snapshot.
+*/
+namespace metrics{
+
+const size_t STRIPES = 8;
+
+// stripe of the calling thread
+size_t stripe();
+
+// monotonic clock in microseconds, for timing what is recorded
+uint64 nowUs();
+
+}
+
+class Counter{
+public:
+  Counter() { }
+  Counter(const Counter&) = delete;
+  Counter& operator=(const Counter&) = delete;
+
+  void add(uint64 n = 1) { _cells[metrics::stripe()].v.fetch_add(n, std::memory_order_relaxed); }
+  uint64 value() const;
+
+private:
+  // one cache line each, stripes of different threads do not share one
+  struct Cell{
+    std::atomic<uint64> v;
+    char pad[64 - sizeof(std::atomic<uint64>)];
+    Cell(): v(0) { }
+  };
+  Cell _cells[metrics::STRIPES];
+};
+
+// last value of something, or sampled from a function when read
+class Gauge{
+public:
+  Gauge(): _v(0) { }
+  explicit Gauge(std::function<int64()> sample): _v(0), _sample(std::move(sample)) { }
+  Gauge(const Gauge&) = delete;
+  Gauge& operator=(const Gauge&) = delete;
+
+  void set(int64 v) { _v.store(v, std::memory_order_relaxed); }
+  void add(int64 d) { _v.fetch_add(d, std::memory_order_relaxed); }
+  int64 value() const { return _sample ? _sample() : _v.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64> _v;
+  std::function<int64()> _sample;
+};
+
+/*
+  Log-linear histogram of microsecond values: every power of two is split
+  into SUB_BUCKETS equal buckets, so the error of a quantile stays below
+  1/SUB_BUCKETS of its value from 1us up to about 19 hours.
+*/
+class Histogram{
+public:
+  static const int SUB_BITS = 3;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int MAX_EXP = 36;    // larger values count in the last bucket
+  static const int BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB_BUCKETS;
+
+  struct Snapshot{
+    uint64 count;
+    uint64 sum;
+    uint64 max;
+    std::vector<uint64> buckets;
+
+    // smallest upper bound below which a fraction q of the values fall
+    uint64 quantile(double q) const;
+  };
+
+  Histogram() { }
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void record(uint64 us);
+  Snapshot snapshot() const;
+
+  static int bucketOf(uint64 us);
+  // largest value counted in bucket i
+  static uint64 upperBound(int i);
+
+private:
+  struct Stripe{
+    std::atomic<uint64> count;
+    std::atomic<uint64> sum;
+    std::atomic<uint64> max;
+    std::atomic<uint64> buckets[BUCKETS];
+    char pad[64];
+    Stripe();
+  };
+  Stripe _stripes[metrics::STRIPES];
+};
+
+/*
+  Named metrics of a server. Lookups take a lock and are meant to be done
+  once, the returned metric stays at the same address as long as the
+  registry lives. labels is the Prometheus label set without braces, e.g.
+  method="echo".
+*/
+class MetricsRegistry{
+public:
+  MetricsRegistry() { }
+  MetricsRegistry(const MetricsRegistry&) = delete;
+  MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+  Counter& counter(const std::string& name, const std::string& labels = std::string());
+  Gauge& gauge(const std::string& name, const std::string& labels = std::string());
+  // gauge read from sample(), which must stay callable while the registry lives
+  Gauge& gauge(const std::string& name, const std::string& labels, std::function<int64()> sample);
+  Histogram& histogram(const std::string& name, const std::string& labels = std::string());
+
+  // flat (name{labels}, value) list, histograms give _count and _sum, _max,
+  // _p50, _p90 and _p99 in seconds
+  void values(std::vector<std::pair<std::string, double> >& out) const;
+
+  // Prometheus text exposition format
+  void prometheus(std::string& out) const;
+
+private:
+  typedef std::pair<std::string, std::string> Key;  // name, labels
+
+  mutable std::mutex _lock;
+  std::map<Key, std::unique_ptr<Counter> > _counters;
+  std::map<Key, std::unique_ptr<Gauge> > _gauges;
+  std::map<Key, std::unique_ptr<Histogram> > _histograms;
+};
+
+}
@@ -0,0 +1,85 @@
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "rcu.h"
+
+using namespace simprpc;
+
+// One record per thread that ever read, kept in a list walked by writers.
+// Records of exited threads are reused, never freed.
+struct Rcu::Reader{
+  std::atomic<uint64> period;   // grace period seen on entry, 0 outside
+  std::atomic<bool> used;
+  int nesting;                  // only touched by the owning thread
+  Reader* next;
+
+  Reader(): period(0), used(true), nesting(0), next(nullptr) { }
+};
+
+static std::atomic<Rcu::Reader*> readers(nullptr);
+static std::atomic<uint64> grace_period(1);
+static std::mutex writer_lock;
+
+// gives the record back when its thread exits
+struct ReaderHandle{
+  Rcu::Reader* r;
+  ReaderHandle(): r(nullptr) { }
+  ~ReaderHandle() {
+    if(r != nullptr)
+      r->used.store(false, std::memory_order_release);
+  }
+};
+
+static thread_local ReaderHandle self;
+
+Rcu::Reader* Rcu::_self() {
+  if(self.r != nullptr)
+    return self.r;
+  for(Reader* p = readers.load(std::memory_order_acquire); p != nullptr; p = p->next) {
+    bool expected = false;
+    if(!p->used.load(std::memory_order_relaxed) && p->used.compare_exchange_strong(expected, true)) {
+      self.r = p;
+      return p;
+    }
+  }
+  Reader* p = new Reader();
+  Reader* head = readers.load(std::memory_order_relaxed);
+  do {
+    p->next = head;
+  } while(!readers.compare_exchange_weak(head, p, std::memory_order_release, std::memory_order_relaxed));
+  self.r = p;
+  return p;
+}
+
+void Rcu::_enter() {
+  Reader* r = _self();
+  if(r->nesting++ > 0)
+    return;
+  // store and fence: either the writer sees us active, or our following
+  // loads see what it published before starting the grace period. Without
+  // the fence an acquire load could still be ordered before the store.
+  r->period.store(grace_period.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Rcu::_exit() {
+  Reader* r = self.r;
+  if(--r->nesting == 0)
+    r->period.store(0, std::memory_order_release);
+}
+
+void Rcu::synchronize() {
+  std::lock_guard<std::mutex> lock(writer_lock);
+  uint64 gp = grace_period.fetch_add(1, std::memory_order_seq_cst) + 1;
+  // readers which entered after the increment carry gp and may keep going,
+  // only older ones are waited for
+  for(Reader* p = readers.load(std::memory_order_acquire); p != nullptr; p = p->next) {
+    while(1) {
+      uint64 v = p->period.load(std::memory_order_seq_cst);
+      if(v == 0 || v >= gp)
+        break;
+      std::this_thread::yield();
+    }
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Read-copy-update for data read on every request and rarely changed.
+
+  Readers wrap their accesses in a ReadGuard, which costs a store and a
+  fence on a per-thread word and never blocks. A writer publishes a new
+  version through an atomic pointer, then calls synchronize() to wait until
+  every read section started before the publication has ended. After that
+  nobody can still see the old version and it may be freed.
+
+  Read sections nest. synchronize() must not be called from inside one of
+  the calling thread, it would wait for itself.
+*/
+class Rcu{
+public:
+  class ReadGuard{
+  public:
+    ReadGuard() { Rcu::_enter(); }
+    ~ReadGuard() { Rcu::_exit(); }
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+  };
+
+  // wait for all pre-existing read sections, one writer at a time
+  static void synchronize();
+
+  struct Reader;    // per-thread state, defined in rcu.cc
+
+private:
+  static Reader* _self();
+  static void _enter();
+  static void _exit();
+};
+
+}
@@ -4,29 +4,95 @@
 
 
 void ThreadPool::ThreadWorker::operator()() {
-  std::function<void()> func; // 定义基础函数类func
-  bool dequeued; // 是否正在取出队列中元素
+  Task task;
 
-  while (!m_pool->m_shutdown){
+  while (1){
     {
     // 为线程环境加锁，互访问工作线程的休眠和唤醒
     std::unique_lock<std::mutex> lock(m_pool->m_conditional_mutex);
 
-    // 如果任务队列为空，阻塞当前线程
-    if (m_pool->m_queue.empty())
-    {
-        m_pool->m_conditional_lock.wait(lock); // 等待条件变量通知，开启线程
+    // 如果任务队列为空，阻塞当前线程. The queues are checked under the same
+    // lock submit() takes, so no wake up is lost in between.
+    while (!m_pool->m_shutdown && !m_pool->pick(task))
+        m_pool->m_conditional_lock.wait(lock);
+    if (m_pool->m_shutdown)
+        break;
+    } // use braceket to release lock
+    task.func();
+    task.func = nullptr;
+  }
+}
+
+void ThreadPool::enqueue(int prio, std::function<void()>&& func) {
+  if(prio < 0 || prio >= PRIO_CLASSES)
+    prio = PRIO_NORMAL;
+  {
+    std::lock_guard<std::mutex> lock(m_conditional_mutex);
+    m_queues[prio].push_back(Task{std::move(func), Clock::now()});
+    m_counters[prio].submitted++;
+    m_pending.fetch_add(1, std::memory_order_relaxed);
+  }
+  m_conditional_lock.notify_one();
+}
+
+bool ThreadPool::pick(Task &task) {
+  Clock::time_point now = Clock::now();
+  int chosen = -1;
+  for(int i = 0; i < PRIO_CLASSES; i++) {
+    if(m_queues[i].empty())
+      continue;
+    if(chosen < 0)
+      chosen = i;
+    // the oldest task of a lower class waited too long, let it pass
+    else if(m_aging_us > 0 && now - m_queues[i].front().enqueued > std::chrono::microseconds(m_aging_us)) {
+      chosen = i;
+      break;
     }
+  }
+  if(chosen < 0)
+    return false;
 
-    // 取出任务队列中的元素
-    dequeued = m_pool->m_queue.dequeue(func);
-    } // use braceket to release lock
-    // 如果成功取出，执行工作函数
-    if (dequeued)
-        func();
+  task = std::move(m_queues[chosen].front());
+  m_queues[chosen].pop_front();
+  m_pending.fetch_sub(1, std::memory_order_relaxed);
+  uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(now - task.enqueued).count();
+  ClassCounters &c = m_counters[chosen];
+  c.executed++;
+  c.wait_us += wait;
+  if(wait > c.max_wait_us)
+    c.max_wait_us = wait;
+  if(m_wait_observer)
+    m_wait_observer(chosen, wait);
+  return true;
+}
+
+uint64_t ThreadPool::oldestWaitUs() {
+  Clock::time_point now = Clock::now();
+  uint64_t oldest = 0;
+  std::lock_guard<std::mutex> lock(m_conditional_mutex);
+  for(int i = 0; i < PRIO_CLASSES; i++) {
+    if(m_queues[i].empty())
+      continue;
+    uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(now - m_queues[i].front().enqueued).count();
+    if(wait > oldest)
+      oldest = wait;
   }
+  return oldest;
 }
 
+ThreadPool::ClassStats ThreadPool::stats(int prio) {
+  ClassStats st = {0, 0, 0, 0, 0};
+  if(prio < 0 || prio >= PRIO_CLASSES)
+    return st;
+  std::lock_guard<std::mutex> lock(m_conditional_mutex);
+  const ClassCounters &c = m_counters[prio];
+  st.submitted = c.submitted;
+  st.executed = c.executed;
+  st.queued = m_queues[prio].size();
+  st.avg_wait_us = c.executed ? double(c.wait_us) / c.executed : 0;
+  st.max_wait_us = c.max_wait_us;
+  return st;
+}
 
 void ThreadPool::init() {
   for(size_t i = 0; i < m_threads.size(); i++)
@@ -34,7 +100,10 @@ void ThreadPool::init() {
 }
 
 void ThreadPool::shutdown() {
-  m_shutdown = true;
+  {
+    std::lock_guard<std::mutex> lock(m_conditional_mutex);
+    m_shutdown = true;
+  }
   m_conditional_lock.notify_all(); // 通知，唤醒所有工作线程
 
   for (size_t i = 0; i < m_threads.size(); ++i){
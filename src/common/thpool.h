@@ -9,6 +9,10 @@
 #include <thread>
 #include <utility>
 #include <vector>
+#include <deque>
+#include <cstdint>
+#include <chrono>
+#include <atomic>
 
 // Thread safe implementation of a Queue using a std::queue
 template <typename T>
@@ -62,6 +66,10 @@ public:
 
 class ThreadPool
 {
+public:
+    // Priority classes, strict order between them except for aged tasks
+    enum { PRIO_HIGH, PRIO_NORMAL, PRIO_LOW, PRIO_CLASSES };
+
 private:
     class ThreadWorker // 内置线程工作类
     {
@@ -80,7 +88,18 @@ private:
 
     bool m_shutdown; // 线程池是否关闭
 
-    SafeQueue<std::function<void()>> m_queue; // 执行函数安全队列，即任务队列
+    typedef std::chrono::steady_clock Clock;
+
+    struct Task
+    {
+        std::function<void()> func;
+        Clock::time_point enqueued;
+    };
+
+    // one FIFO per priority class, guarded by m_conditional_mutex
+    std::deque<Task> m_queues[PRIO_CLASSES];
+
+    uint32_t m_aging_us; // a task waiting longer than this is served before higher classes
 
     std::vector<std::thread> m_threads; // 工作线程队列
 
@@ -88,10 +107,33 @@ private:
 
     std::condition_variable m_conditional_lock; // 线程环境锁，可以让线程处于休眠或者唤醒状态
 
+    struct ClassCounters
+    {
+        uint64_t submitted, executed, wait_us, max_wait_us;
+        ClassCounters(): submitted(0), executed(0), wait_us(0), max_wait_us(0) { }
+    };
+    ClassCounters m_counters[PRIO_CLASSES];
+    std::atomic<size_t> m_pending; // tasks waiting in all classes
+    std::function<void(int, uint64_t)> m_wait_observer;
+
+    void enqueue(int prio, std::function<void()>&& func);
+    // pop the next task to run, called with m_conditional_mutex held
+    bool pick(Task &task);
+
 public:
+    // queueing figures of one priority class since the pool started
+    struct ClassStats
+    {
+        uint64_t submitted;
+        uint64_t executed;
+        size_t queued;          // waiting right now
+        double avg_wait_us;     // time between submit and start of execution
+        uint64_t max_wait_us;
+    };
+
     // 线程池构造函数
     ThreadPool(const int n_threads = 4)
-        : m_shutdown(false), m_threads(std::vector<std::thread>(n_threads)) { }
+        : m_shutdown(false), m_aging_us(100000), m_threads(std::vector<std::thread>(n_threads)), m_pending(0) { }
 
     ThreadPool(const ThreadPool &) = delete;
 
@@ -105,9 +147,35 @@ public:
     // Waits until threads finish their current task and shutdowns the pool
     void shutdown();
 
+    // Bound the time a lower class task can be starved by higher ones, 0
+    // makes the classes strictly ordered
+    void setAging(uint32_t ms) { std::lock_guard<std::mutex> lock(m_conditional_mutex); m_aging_us = ms * 1000; }
+
+    ClassStats stats(int prio);
+
+    // number of tasks waiting for a thread, lock free
+    size_t pending() const { return m_pending.load(std::memory_order_relaxed); }
+
+    // how long the oldest waiting task has been queued, 0 if none
+    uint64_t oldestWaitUs();
+
+    // Called with the priority class and the time in microseconds every task
+    // waited in the queue, when a thread takes it. Runs under the pool lock,
+    // keep it short.
+    void setWaitObserver(std::function<void(int, uint64_t)> observer) {
+        std::lock_guard<std::mutex> lock(m_conditional_mutex);
+        m_wait_observer = std::move(observer);
+    }
+
     // Submit a function to be executed asynchronously by the pool
     template <typename F, typename... Args>
     auto submit(F &&f, Args &&...args) -> std::future<decltype(f(args...))>{
+        return submitPriority(PRIO_NORMAL, std::forward<F>(f), std::forward<Args>(args)...);
+    }
+
+    // same as submit() in the given priority class
+    template <typename F, typename... Args>
+    auto submitPriority(int prio, F &&f, Args &&...args) -> std::future<decltype(f(args...))>{
         // Create a function with bounded parameter ready to execute
         std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...); // 连接函数和参数定义，特殊函数类型，避免左右值
 
@@ -118,10 +186,8 @@ public:
         {
             (*task_ptr)();
         }; 
-        // 队列通用安全封包函数，并压入安全队列
-        m_queue.enqueue(warpper_func);
-        // 唤醒一个等待中的线程
-        m_conditional_lock.notify_one();
+        // 压入对应优先级的队列并唤醒一个等待中的线程
+        enqueue(prio, std::move(warpper_func));
         // 返回先前注册的任务指针
         return task_ptr->get_future();
     }
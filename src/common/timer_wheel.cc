@@ -0,0 +1,161 @@
+#include <time.h>
+
+#include "timer_wheel.h"
+
+namespace simprpc{
+
+uint64 TimerWheel::nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+TimerWheel::TimerWheel(uint32 tick_ms): _tick(tick_ms ? tick_ms : 1), _start(nowMs()), _current(0), _count(0) {
+  for(int l = 0; l < LEVELS; l++)
+    for(int i = 0; i < SLOTS; i++)
+      _wheels[l][i]._prev = _wheels[l][i]._next = &_wheels[l][i];
+}
+
+TimerWheel::~TimerWheel() {
+  for(int l = 0; l < LEVELS; l++) {
+    for(int i = 0; i < SLOTS; i++) {
+      Timer* head = &_wheels[l][i];
+      while(head->_next != head) {
+        Timer* t = head->_next;
+        _unlink(t);
+        if(t->_owned)
+          delete t;
+      }
+    }
+  }
+}
+
+void TimerWheel::_unlink(Timer* t) {
+  t->_prev->_next = t->_next;
+  t->_next->_prev = t->_prev;
+  t->_prev = t->_next = nullptr;
+}
+
+void TimerWheel::_append(Timer* head, Timer* t) {
+  t->_prev = head->_prev;
+  t->_next = head;
+  head->_prev->_next = t;
+  head->_prev = t;
+}
+
+// hash timer into the wheel whose range covers its distance to current tick
+void TimerWheel::_link(Timer* t) {
+  uint64 diff = t->_expire > _current ? t->_expire - _current : 0;
+  const int top = SLOT_BITS * (LEVELS - 1);
+  if(diff >= (uint64(1) << (SLOT_BITS * LEVELS))) {
+    // beyond the last wheel: park it in the slot cascaded last, it is hashed
+    // again from there with its expiry unchanged
+    size_t idx = ((_current >> top) + SLOTS - 1) & SLOT_MASK;
+    _append(&_wheels[LEVELS - 1][idx], t);
+    return;
+  }
+  int level = 0;
+  while(level < LEVELS - 1 && diff >= (uint64(1) << (SLOT_BITS * (level + 1))))
+    level++;
+  size_t idx = (t->_expire >> (SLOT_BITS * level)) & SLOT_MASK;
+  _append(&_wheels[level][idx], t);
+}
+
+void TimerWheel::add(Timer* t, uint64 timeout_ms) {
+  if(t->pending())
+    cancel(t);
+  // round up so a timer never fires early, relative to the real clock
+  uint64 now = nowMs() - _start;
+  t->_expire = (now + timeout_ms + _tick - 1) / _tick;
+  if(t->_expire <= _current)
+    t->_expire = _current + 1;
+  _link(t);
+  _count++;
+}
+
+void TimerWheel::cancel(Timer* t) {
+  if(!t->pending())
+    return;
+  _unlink(t);
+  _count--;
+}
+
+void TimerWheel::schedule(uint64 timeout_ms, const std::function<void()>& cb) {
+  Timer* t = new Timer();
+  t->callback = cb;
+  t->_owned = true;
+  add(t, timeout_ms);
+}
+
+// move every timer of a coarse slot down to the finer wheels
+void TimerWheel::_cascade(int level) {
+  size_t idx = (_current >> (SLOT_BITS * level)) & SLOT_MASK;
+  Timer* head = &_wheels[level][idx];
+  while(head->_next != head) {
+    Timer* t = head->_next;
+    _unlink(t);
+    _link(t);
+  }
+}
+
+void TimerWheel::_step() {
+  _current++;
+  for(int l = 1; l < LEVELS; l++) {
+    if((_current & ((uint64(1) << (SLOT_BITS * l)) - 1)) != 0)
+      break;
+    _cascade(l);
+  }
+  Timer* head = &_wheels[0][_current & SLOT_MASK];
+  Timer expired;
+  if(head->_next == head)
+    return;
+  // detach the slot first, callbacks may add or cancel timers freely
+  expired._next = head->_next;
+  expired._prev = head->_prev;
+  expired._next->_prev = &expired;
+  expired._prev->_next = &expired;
+  head->_prev = head->_next = head;
+
+  while(expired._next != &expired) {
+    Timer* t = expired._next;
+    _unlink(t);
+    _count--;
+    // the callback may destroy the node, keep a copy
+    std::function<void()> cb = t->callback;
+    bool owned = t->_owned;
+    if(cb)
+      cb();
+    if(owned)
+      delete t;
+  }
+}
+
+void TimerWheel::advance() {
+  uint64 target = (nowMs() - _start) / _tick;
+  if(_count == 0) {
+    _current = target;
+    return;
+  }
+  while(_current < target && _count > 0)
+    _step();
+  if(_count == 0)
+    _current = target;
+}
+
+int TimerWheel::nextTimeout() const {
+  if(_count == 0)
+    return -1;
+  uint64 ticks = SLOTS - (_current & SLOT_MASK);   // next cascade
+  for(uint64 i = 1; i < ticks; i++) {
+    const Timer* head = &_wheels[0][(_current + i) & SLOT_MASK];
+    if(head->_next != head) {
+      ticks = i;
+      break;
+    }
+  }
+  uint64 due = (_current + ticks) * _tick;
+  uint64 now = nowMs() - _start;
+  return due > now ? int(due - now) : 0;
+}
+
+}
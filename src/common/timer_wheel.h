@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Hierarchical hashed timer wheel.
+
+  Time is divided into ticks of a fixed length. Timers expiring within the next
+  64 ticks are hashed into the first wheel, later ones into coarser wheels which
+  are cascaded down whenever the finer wheel wraps around. Adding, re-arming and
+  canceling a timer are O(1), expiring a tick only touches the timers that fall
+  into it.
+
+  The wheel is not thread safe, it is meant to be owned and driven by a single
+  event loop thread which calls advance() after each poll and uses nextTimeout()
+  as the poll timeout.
+*/
+class TimerWheel{
+public:
+  // Intrusive timer node, the owner keeps it alive while it is pending and
+  // must cancel() it before destroying it.
+  struct Timer{
+    std::function<void()> callback;
+
+    Timer(): _prev(nullptr), _next(nullptr), _expire(0), _owned(false) { }
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    bool pending() const { return _prev != nullptr; }
+
+  private:
+    friend class TimerWheel;
+    Timer* _prev;
+    Timer* _next;
+    uint64 _expire;   // absolute tick
+    bool _owned;      // allocated by schedule()
+  };
+
+  TimerWheel(uint32 tick_ms = 10);
+  ~TimerWheel();
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // arm timer to fire after timeout_ms, re-arm it if already pending
+  void add(Timer* t, uint64 timeout_ms);
+
+  // disarm a pending timer, no-op otherwise
+  void cancel(Timer* t);
+
+  // fire-and-forget timer, the node is owned and released by the wheel
+  void schedule(uint64 timeout_ms, const std::function<void()>& cb);
+
+  // run every timer expired by now
+  void advance();
+
+  // milliseconds until the next tick that has work, -1 if nothing is pending
+  int nextTimeout() const;
+
+  size_t size() const { return _count; }
+
+  // monotonic clock in milliseconds
+  static uint64 nowMs();
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const uint64 SLOT_MASK = SLOTS - 1;
+
+  const uint32 _tick;
+  uint64 _start;    // clock value of tick 0
+  uint64 _current;  // last processed tick
+  size_t _count;    // pending timers
+
+  Timer _wheels[LEVELS][SLOTS];   // sentinels of circular lists
+
+  void _link(Timer* t);
+  static void _unlink(Timer* t);
+  static void _append(Timer* head, Timer* t);
+  void _cascade(int level);
+  void _step();
+};
+
+}
@@ -0,0 +1,163 @@
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+
+using namespace simprpc;
+
+// Ring of the spans finished by one thread. Buffers are never freed, spans
+// of exited threads can still be dumped.
+struct Tracer::Buffer{
+  std::mutex lock;      // only contended while dumping
+  std::vector<Span*> spans;
+  size_t next;
+  int tid;
+  Buffer* link;
+
+  Buffer(int t): spans(BUFFER_SPANS, nullptr), next(0), tid(t), link(nullptr) { }
+};
+
+static std::atomic<uint32> sampling(0);
+static std::atomic<Tracer::Buffer*> buffers(nullptr);
+static std::atomic<int> next_tid(1);
+
+// clock readings taken when tracing was enabled, to convert ticks to time
+static std::atomic<uint64> base_ticks(0);
+static std::atomic<int64> base_ns(0);
+
+static int64 steadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64 Tracer::now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return uint64(steadyNs());
+#endif
+}
+
+void Tracer::setSampling(uint32 n) {
+  if(n > 0 && sampling.load() == 0) {
+    base_ns.store(steadyNs());
+    base_ticks.store(now());
+  }
+  sampling.store(n);
+}
+
+bool Tracer::enabled() {
+  return sampling.load(std::memory_order_relaxed) > 0;
+}
+
+Tracer::Span* Tracer::sample() {
+  static thread_local uint32 seen = 0;
+  uint32 n = sampling.load(std::memory_order_relaxed);
+  if(n == 0 || ++seen < n)
+    return nullptr;
+  seen = 0;
+  return new Span();
+}
+
+static Tracer::Buffer* myBuffer() {
+  static thread_local Tracer::Buffer* self = nullptr;
+  if(self != nullptr)
+    return self;
+  self = new Tracer::Buffer(next_tid.fetch_add(1));
+  Tracer::Buffer* head = buffers.load(std::memory_order_relaxed);
+  do {
+    self->link = head;
+  } while(!buffers.compare_exchange_weak(head, self, std::memory_order_release, std::memory_order_relaxed));
+  return self;
+}
+
+void Tracer::finish(Span* span) {
+  if(span == nullptr)
+    return;
+  Buffer* b = myBuffer();
+  std::lock_guard<std::mutex> lock(b->lock);
+  delete b->spans[b->next];
+  b->spans[b->next] = span;
+  b->next = (b->next + 1) % BUFFER_SPANS;
+}
+
+// names of the stages, each one is the time since the previous stage reached
+static const char* stage_names[Tracer::STAGES] = {
+  "frame", "ready_queue", "pool_queue", "parse", "execute", "encode", "send_wait", "send"
+};
+
+static void event(std::string& out, const char* name, double ts, double dur, int tid, const Tracer::Span* span) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"cat\":\"rpc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+           "\"tid\":%d,\"args\":{\"id\":%d,\"method\":\"", out.empty() ? "" : ",\n", name, ts, dur, tid, span->id);
+  out += buf;
+  // method names come from clients, keep the JSON valid
+  for(char c : span->method) {
+    if(c == '"' || c == '\\')
+      out += '\\';
+    if(static_cast<unsigned char>(c) >= 0x20)
+      out += c;
+  }
+  out += "\"}}";
+}
+
+void Tracer::dump(std::string& out, bool clear) {
+  // ticks per microsecond over the whole time tracing ran
+  double elapsed_us = (steadyNs() - base_ns.load()) / 1e3;
+  uint64 t0 = base_ticks.load();
+  double per_us = elapsed_us > 0 ? (now() - t0) / elapsed_us : 1;
+  if(per_us <= 0)
+    per_us = 1;
+
+  std::string events;
+  for(Buffer* b = buffers.load(std::memory_order_acquire); b != nullptr; b = b->link) {
+    std::lock_guard<std::mutex> lock(b->lock);
+    for(auto &span : b->spans) {
+      if(span == nullptr)
+        continue;
+      int first = -1, last = -1;
+      for(int i = 0; i < STAGES; i++) {
+        if(span->at[i] == 0 || span->at[i] < t0)
+          continue;
+        if(first < 0)
+          first = i;
+        last = i;
+      }
+      if(first >= 0 && last > first) {
+        double start = (span->at[first] - t0) / per_us;
+        event(events, "request", start, (span->at[last] - span->at[first]) / per_us, b->tid, span);
+        int prev = first;
+        for(int i = first + 1; i <= last; i++) {
+          if(span->at[i] < span->at[prev])
+            continue;   // not reached
+          event(events, stage_names[i], (span->at[prev] - t0) / per_us,
+                (span->at[i] - span->at[prev]) / per_us, b->tid, span);
+          prev = i;
+        }
+      }
+      if(clear) {
+        delete span;
+        span = nullptr;
+      }
+    }
+  }
+  out += "{\"traceEvents\":[\n";
+  out += events;
+  out += "\n]}\n";
+}
+
+bool Tracer::dumpFile(const char* path, bool clear) {
+  std::string json;
+  dump(json, clear);
+  FILE* f = fopen(path, "w");
+  if(f == nullptr)
+    return false;
+  bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+  return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Sampled tracing of the stages a request goes through.
+
+  One request in every n gets a Span, which is stamped with the cycle
+  counter at each stage as it moves between threads and is stored in a ring
+  buffer of the thread that finishes it. dump() turns the stored spans into
+  Chrome trace JSON (chrome://tracing, Perfetto): one event per request with
+  one nested event per stage. Requests that are not sampled only pay for a
+  null check at every stage.
+*/
+class Tracer{
+public:
+  enum Stage { FRAME, ENQUEUED, DEQUEUED, PARSED, EXECUTED, ENCODED, SEND_START, SEND_END, STAGES };
+
+  struct Span{
+    uint64 at[STAGES];    // now() at every stage reached, 0 for the others
+    int id;
+    std::string method;
+
+    Span(): id(-1) {
+      for(int i = 0; i < STAGES; i++)
+        at[i] = 0;
+    }
+  };
+
+  // spans kept per thread, older ones are dropped
+  static const size_t BUFFER_SPANS = 4096;
+
+  // trace one request in every n, 0 disables tracing (default)
+  static void setSampling(uint32 n);
+  static bool enabled();
+
+  // a new span if the calling thread's next request is to be traced, else
+  // nullptr. The caller must finish() or discard() it.
+  static Span* sample();
+
+  // cycle counter where there is a cheap one, steady clock otherwise
+  static uint64 now();
+
+  static void mark(Span* span, Stage stage) {
+    if(span != nullptr)
+      span->at[stage] = now();
+  }
+
+  // store span in the calling thread's buffer, it is owned there
+  static void finish(Span* span);
+  static void discard(Span* span) { delete span; }
+
+  // Chrome trace JSON of all stored spans, which are dropped if clear
+  static void dump(std::string& out, bool clear = true);
+  static bool dumpFile(const char* path, bool clear = true);
+
+  struct Buffer;    // per-thread ring, defined in trace.cc
+};
+
+}
@@ -6,4 +6,5 @@ typedef unsigned char  uchar;
 typedef unsigned char uint8;
 typedef unsigned short uint16;
 typedef unsigned int  uint32;
-typedef unsigned long uint64;
\ No newline at end of file
+typedef unsigned long uint64;
+typedef long          int64;
\ No newline at end of file
@@ -0,0 +1,97 @@
+// Example of rpc/coro.h, needs -std=c++20 (make coro_example). The server
+// method is a coroutine calling echo twice on the same server and adding
+// the results, a client coroutine awaits it.
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+
+#include "rpc/rpc.h"
+#include "rpc/rpcclient.h"
+#include "rpc/coro.h"
+
+
+using namespace simprpc;
+using std::vector;
+using std::cout;
+
+static const char* ADDRESS = "unix:/tmp/simprpc_coro.sock";
+
+static vector<XmlElement> one(const XmlElement& ele) {
+  vector<XmlElement> v;
+  v.push_back(ele);
+  return v;
+}
+
+class EchoMethod : public RPCMethod {
+public:
+  EchoMethod(): RPCMethod("echo") { }
+
+  void execute(const std::vector<XmlElement> &params, std::vector<XmlElement> &results) override {
+    for(auto &param : params)
+      results.push_back(param);
+  }
+};
+
+// add(a, b) returns a + b, fetched from echo after a short sleep. Neither
+// the sleep nor the calls hold a worker.
+class AddMethod : public CoroRPCMethod {
+public:
+  AddMethod(): CoroRPCMethod("add"), downstream(nullptr) { }
+
+  Task<vector<XmlElement> > handle(vector<XmlElement> params) override {
+    if(params.size() != 2 || !params[0].istype(TypeInt) || !params[1].istype(TypeInt))
+      throw std::runtime_error("add takes two ints");
+    // both requests are sent before either is awaited
+    CallAwaiter a = downstream->call("echo", one(params[0]));
+    CallAwaiter b = downstream->call("echo", one(params[1]));
+    co_await sleepFor(10);
+    CallResult ra = co_await a;
+    CallResult rb = co_await b;
+    if(!ra || !rb)
+      throw std::runtime_error("echo failed");
+    int sum = *((int*)ra.values[0].getdata()) + *((int*)rb.values[0].getdata());
+    co_return one(XmlElement(sum));
+  }
+
+  RPCClient* downstream;    // set before the first call
+};
+
+Task<bool> check(RPCClient& client) {
+  vector<XmlElement> params;
+  params.emplace_back(2);
+  params.emplace_back(3);
+  CallResult r = co_await client.call("add", params, 5000);
+  co_return r && r.values.size() == 1 && *((int*)r.values[0].getdata()) == 5;
+}
+
+Task<void> drive(RPCClient& client, std::promise<bool>& done) {
+  done.set_value(co_await check(client));
+}
+
+int main() {
+  // the server runs until the process exits, its methods are never freed
+  EchoMethod* echo = new EchoMethod;
+  AddMethod* add = new AddMethod;
+  std::thread([echo, add] {
+    RPCServer server(ADDRESS, 0, 2);
+    server.registMethod(echo);
+    server.registMethod(add);
+    server.start();
+  }).detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  RPCClient downstream(ADDRESS, 0);
+  add->downstream = &downstream;
+  RPCClient client(ADDRESS, 0);
+
+  std::promise<bool> done;
+  std::future<bool> passed = done.get_future();
+  spawn(drive(client, done));
+  bool ok = passed.get();
+  cout << (ok ? "Coro OK!\n" : "Coro failed!\n");
+  return ok ? 0 : 1;
+}
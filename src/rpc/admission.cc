@@ -0,0 +1,65 @@
+#include <chrono>
+#include <limits>
+
+#include "admission.h"
+
+using namespace simprpc;
+
+static uint64 nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AdmissionControl::AdmissionControl(): _target_us(0), _interval_us(100000), _windowEnd(0),
+  _windowMin(std::numeric_limits<uint64>::max()), _overloaded(false), _rejected(0) { }
+
+void AdmissionControl::configure(uint32 target_ms, uint32 interval_ms) {
+  _target_us = uint64(target_ms) * 1000;
+  _interval_us = uint64(interval_ms > 0 ? interval_ms : 1) * 1000;
+  _windowEnd = 0;
+  _windowMin = std::numeric_limits<uint64>::max();
+  _overloaded.store(false, std::memory_order_relaxed);
+}
+
+void AdmissionControl::observe(uint64 wait_us) {
+  if(!enabled())
+    return;
+  // a request served within the target means the queue drains again
+  if(wait_us < _target_us)
+    _overloaded.store(false, std::memory_order_relaxed);
+
+  uint64 now = nowUs();
+  // first request or the last window ended long ago, the queue was idle
+  // in between and the old samples say nothing
+  if(_windowEnd == 0 || now >= _windowEnd + _interval_us) {
+    _windowEnd = now + _interval_us;
+    _windowMin = wait_us;
+    return;
+  }
+  if(wait_us < _windowMin)
+    _windowMin = wait_us;
+  if(now < _windowEnd)
+    return;
+  if(_windowMin >= _target_us)
+    _overloaded.store(true, std::memory_order_relaxed);
+  _windowEnd = now + _interval_us;
+  _windowMin = std::numeric_limits<uint64>::max();
+}
+
+bool AdmissionControl::admit(size_t queued, uint64 oldest_wait_us) {
+  if(!enabled())
+    return true;
+  // nothing is standing in an empty queue, whatever the last waits were
+  if(queued == 0) {
+    if(overloaded())
+      _overloaded.store(false, std::memory_order_relaxed);
+    return true;
+  }
+  // the workers took nothing for a whole interval, observe() can not tell
+  if(!overloaded() && oldest_wait_us >= _target_us + _interval_us)
+    _overloaded.store(true, std::memory_order_relaxed);
+  if(!overloaded())
+    return true;
+  _rejected.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Admission control of the server work queue, after CoDel.
+
+  Workers report how long every request waited before it was picked. If even
+  the shortest of these waits stayed above the target for a whole interval,
+  the queue is no longer absorbing a burst but standing, and new requests are
+  refused until a request gets through within the target again or the queue
+  has drained. Refused requests cost the server one fault response, those
+  already queued still run.
+
+  Waits are only reported when a worker is free to take a request. When all
+  of them are stuck in slow calls the oldest queued request tells instead:
+  once it has waited longer than target plus interval, nothing got through
+  within the target for a whole interval either.
+*/
+class AdmissionControl{
+public:
+  AdmissionControl();
+  AdmissionControl(const AdmissionControl&) = delete;
+  AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+  // target_ms 0 disables admission control (default)
+  void configure(uint32 target_ms, uint32 interval_ms);
+  bool enabled() const { return _target_us != 0; }
+
+  // a worker took a request which waited wait_us, calls are serialized
+  void observe(uint64 wait_us);
+
+  // whether a new request may be queued, queued is the current queue length
+  // and oldest_wait_us how long its oldest request has been waiting
+  bool admit(size_t queued, uint64 oldest_wait_us);
+
+  bool overloaded() const { return _overloaded.load(std::memory_order_relaxed); }
+  uint64 rejected() const { return _rejected.load(std::memory_order_relaxed); }
+
+private:
+  uint64 _target_us;
+  uint64 _interval_us;
+
+  // touched by observe() only
+  uint64 _windowEnd;
+  uint64 _windowMin;
+
+  std::atomic<bool> _overloaded;
+  std::atomic<uint64> _rejected;
+};
+
+}
@@ -0,0 +1,40 @@
+#include "bulkhead.h"
+
+using namespace simprpc;
+
+bool Bulkhead::enter(Call&& call) {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    if(_running >= _maxRunning) {
+      if(_queue.size() >= _maxQueued) {
+        _rejected++;
+        return false;
+      }
+      _admitted++;
+      _queue.push_back(std::move(call));
+      return true;
+    }
+    _admitted++;
+    _running++;
+  }
+  call();
+  return true;
+}
+
+bool Bulkhead::leave(Call& next) {
+  std::lock_guard<std::mutex> lock(_lock);
+  if(_queue.empty()) {
+    _running--;
+    return false;
+  }
+  // the slot passes to the next call, _running stays
+  next = std::move(_queue.front());
+  _queue.pop_front();
+  return true;
+}
+
+Bulkhead::Stats Bulkhead::stats() {
+  std::lock_guard<std::mutex> lock(_lock);
+  Stats st = {_admitted, _rejected, _running, _queue.size()};
+  return st;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <cstddef>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Concurrency limit of one method. At most maxRunning of its calls hold a
+  worker at a time, further ones wait here, outside of the worker pool, up to
+  maxQueued of them. The rest is refused, so a method stuck on a slow
+  dependency only ever takes its share of the workers.
+*/
+class Bulkhead{
+public:
+  typedef std::function<void()> Call;
+
+  struct Stats{
+    uint64 admitted;
+    uint64 rejected;
+    size_t running;
+    size_t queued;
+  };
+
+  Bulkhead(size_t maxRunning, size_t maxQueued): _maxRunning(maxRunning), _maxQueued(maxQueued),
+    _running(0), _admitted(0), _rejected(0) { }
+  Bulkhead(const Bulkhead&) = delete;
+  Bulkhead& operator=(const Bulkhead&) = delete;
+
+  // Start call right away if a slot is free, else queue it. false if the
+  // queue is full too, call is then dropped without being run.
+  bool enter(Call&& call);
+
+  // A started call is done. Its slot goes to the oldest queued call, which
+  // is returned in next for the caller to start, true if there was one.
+  bool leave(Call& next);
+
+  Stats stats();
+
+private:
+  const size_t _maxRunning;
+  const size_t _maxQueued;
+
+  std::mutex _lock;
+  size_t _running;
+  std::deque<Call> _queue;
+  uint64 _admitted;
+  uint64 _rejected;
+};
+
+}
@@ -0,0 +1,25 @@
+#include "call_context.h"
+#include "timer_wheel.h"
+
+using namespace simprpc;
+
+static thread_local uint64 current_deadline = 0;
+
+int64 CallContext::remainingMs() {
+  return remainingMs(current_deadline);
+}
+
+int64 CallContext::remainingMs(uint64 deadline) {
+  if(deadline == 0)
+    return -1;
+  uint64 now = TimerWheel::nowMs();
+  return now >= deadline ? 0 : int64(deadline - now);
+}
+
+CallContext::Scope::Scope(uint64 deadline): _saved(current_deadline) {
+  current_deadline = deadline;
+}
+
+CallContext::Scope::~Scope() {
+  current_deadline = _saved;
+}
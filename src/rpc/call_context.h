@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Information about the request the calling thread is executing, for use by
+  RPCMethod::execute() implementations.
+*/
+class CallContext{
+public:
+  // milliseconds left before the caller gives up on this request, -1 if it
+  // set no deadline. 0 means the answer will not be read anymore.
+  static int64 remainingMs();
+
+  // the same for a given deadline, 0 meaning none
+  static int64 remainingMs(uint64 deadline);
+
+  // set by the server around a call, deadline is absolute in TimerWheel::nowMs()
+  // time, 0 for none
+  class Scope{
+  public:
+    Scope(uint64 deadline);
+    ~Scope();
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  private:
+    uint64 _saved;    // calls may nest when inline methods call each other
+  };
+};
+
+}
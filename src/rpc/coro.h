@@ -0,0 +1,306 @@
+#pragma once
+
+// C++20 coroutine support, the library itself stays C++11 and this header is
+// empty for older standards.
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+
+#include "rpc_method.h"
+#include "rpcclient.h"
+
+namespace simprpc{
+
+/*
+  Lazily started coroutine returning T. co_await on it runs it and resumes
+  the awaiting coroutine with its value, on the thread that completed the
+  last operation it waited for. Exceptions are passed on to the awaiter.
+*/
+template <typename T>
+class Task;
+
+namespace detail{
+
+struct PromiseBase{
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // jump straight back into the awaiter, no stack grows on long chains
+  struct Final{
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      std::coroutine_handle<> next = h.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept { }
+  };
+  Final final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase{
+  std::optional<T> value;
+  Task<T> get_return_object();
+  void return_value(T v) { value.emplace(std::move(v)); }
+  T result() {
+    if(error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <>
+struct Promise<void> : PromiseBase{
+  Task<void> get_return_object();
+  void return_void() { }
+  void result() {
+    if(error)
+      std::rethrow_exception(error);
+  }
+};
+
+}
+
+template <typename T = void>
+class Task{
+public:
+  typedef detail::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  explicit Task(Handle h): _h(h) { }
+  Task(Task&& t) noexcept: _h(std::exchange(t._h, nullptr)) { }
+  Task& operator=(Task&& t) noexcept {
+    if(this != &t) {
+      if(_h)
+        _h.destroy();
+      _h = std::exchange(t._h, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() {
+    if(_h)
+      _h.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    _h.promise().continuation = awaiter;
+    return _h;
+  }
+  T await_resume() { return _h.promise().result(); }
+
+private:
+  Handle _h;
+};
+
+namespace detail{
+
+template <typename T>
+inline Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+// fire and forget coroutine frame, freed when it returns
+struct Detached{
+  struct promise_type{
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+}
+
+// Run task to completion without awaiting it, exceptions terminate.
+inline detail::Detached spawn(Task<void> task) {
+  co_await task;
+}
+
+
+// Result of an awaited RPCClient::call(), ok as execute() returns it.
+struct CallResult{
+  bool ok;
+  std::vector<XmlElement> values;
+
+  explicit operator bool() const { return ok; }
+};
+
+/*
+  Awaitable of RPCClient::call(). The request is already sent when it is
+  created, awaiting it suspends until the response arrived (or resumes right
+  away if it did) and continues on the thread that received it.
+*/
+struct CallAwaiter{
+  struct State{
+    std::mutex lock;
+    bool ready = false;
+    CallResult result{false, {}};
+    std::coroutine_handle<> waiter;
+  };
+
+  std::shared_ptr<State> state;
+
+  bool await_ready() {
+    std::lock_guard<std::mutex> lk(state->lock);
+    return state->ready;
+  }
+  bool await_suspend(std::coroutine_handle<> h) {
+    std::lock_guard<std::mutex> lk(state->lock);
+    if(state->ready)
+      return false;
+    state->waiter = h;
+    return true;
+  }
+  CallResult await_resume() { return std::move(state->result); }
+};
+
+inline CallAwaiter RPCClient::call(const std::string& funcName, const std::vector<XmlElement>& params,
+                                   uint32 timeout_ms) {
+  auto state = std::make_shared<CallAwaiter::State>();
+  executeAsync(funcName, params, [state](bool ok, std::vector<XmlElement>& ret) {
+    std::coroutine_handle<> waiter;
+    {
+      std::lock_guard<std::mutex> lk(state->lock);
+      state->result.ok = ok;
+      state->result.values.swap(ret);
+      state->ready = true;
+      waiter = std::exchange(state->waiter, nullptr);
+    }
+    if(waiter)
+      waiter.resume();
+  }, timeout_ms);
+  return CallAwaiter{state};
+}
+
+
+/*
+  One thread shared by all sleepFor() awaiters, resuming them when their time
+  is up. Coroutines continue on it, so they should hand long work elsewhere.
+*/
+class CoroTimer{
+public:
+  static CoroTimer& instance() {
+    static CoroTimer timer;
+    return timer;
+  }
+
+  void schedule(uint32 ms, std::coroutine_handle<> h) {
+    {
+      std::lock_guard<std::mutex> lk(_lock);
+      _due.emplace(Clock::now() + std::chrono::milliseconds(ms), h);
+    }
+    _cv.notify_one();
+  }
+
+  ~CoroTimer() {
+    {
+      std::lock_guard<std::mutex> lk(_lock);
+      _stop = true;
+    }
+    _cv.notify_one();
+    _thread.join();
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  std::mutex _lock;
+  std::condition_variable _cv;
+  std::multimap<Clock::time_point, std::coroutine_handle<> > _due;
+  bool _stop = false;
+  std::thread _thread;
+
+  CoroTimer(): _thread([this] { run(); }) { }
+
+  void run() {
+    std::unique_lock<std::mutex> lk(_lock);
+    while(!_stop) {
+      if(_due.empty()) {
+        _cv.wait(lk);
+        continue;
+      }
+      auto first = _due.begin();
+      if(Clock::now() < first->first) {
+        _cv.wait_until(lk, first->first);
+        continue;
+      }
+      std::coroutine_handle<> h = first->second;
+      _due.erase(first);
+      lk.unlock();
+      h.resume();
+      lk.lock();
+    }
+  }
+};
+
+struct SleepAwaiter{
+  uint32 ms;
+  bool await_ready() const noexcept { return ms == 0; }
+  void await_suspend(std::coroutine_handle<> h) { CoroTimer::instance().schedule(ms, h); }
+  void await_resume() const noexcept { }
+};
+
+// co_await sleepFor(ms) suspends the coroutine without blocking a thread
+inline SleepAwaiter sleepFor(uint32 ms) { return SleepAwaiter{ms}; }
+
+
+/*
+  Method written as a coroutine. handle() may co_await client calls, timers
+  or other tasks, the worker that started it is released at the first
+  suspension and the response is sent when the task returns. An exception
+  escaping handle() is answered with a fault carrying its message.
+*/
+class CoroRPCMethod : public AsyncRPCMethod{
+public:
+  CoroRPCMethod(const std::string&s, Policy policy = POOL, size_t threads = 1): AsyncRPCMethod(s, policy, threads) { }
+  CoroRPCMethod(const char* s, Policy policy = POOL, size_t threads = 1): AsyncRPCMethod(s, policy, threads) { }
+
+  // params are copied into the coroutine frame, they outlive the request
+  virtual Task<std::vector<XmlElement> > handle(std::vector<XmlElement> params) = 0;
+
+  void executeAsync(const std::vector<XmlElement>& params, ResponderPtr responder) override {
+    run(handle(params), std::move(responder));
+  }
+
+private:
+  static detail::Detached run(Task<std::vector<XmlElement> > task, ResponderPtr responder) {
+    try {
+      std::vector<XmlElement> result = co_await task;
+      responder->finish(result);
+    }
+    catch(const std::exception& e) {
+      responder->fail(e.what());
+    }
+    catch(...) {
+      responder->fail();
+    }
+  }
+};
+
+}
+
+#endif
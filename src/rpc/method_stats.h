@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+
+#include "metrics.h"
+
+namespace simprpc{
+
+// Metrics of one method, registered by the server under method="<name>".
+// Times are in microseconds, queue wait is 0 for INLINE calls.
+struct MethodStats{
+  Counter& calls;
+  Counter& errors;      // answered with a fault: timeout, busy, overloaded
+  Counter& busy;        // of them refused by the bulkhead of the method
+  Counter& cacheHits;   // of the ResultCache, if the method has one
+  Counter& cacheMisses;
+  Counter& cacheEvictions;
+  Histogram& queueWait;
+  Histogram& execTime;
+  Histogram& decodeTime;
+  Histogram& encodeTime;
+
+  MethodStats(MetricsRegistry& registry, const std::string& method):
+    calls(registry.counter("simprpc_calls_total", label(method))),
+    errors(registry.counter("simprpc_errors_total", label(method))),
+    busy(registry.counter("simprpc_busy_total", label(method))),
+    cacheHits(registry.counter("simprpc_cache_hits_total", label(method))),
+    cacheMisses(registry.counter("simprpc_cache_misses_total", label(method))),
+    cacheEvictions(registry.counter("simprpc_cache_evictions_total", label(method))),
+    queueWait(registry.histogram("simprpc_queue_wait_seconds", label(method))),
+    execTime(registry.histogram("simprpc_execute_seconds", label(method))),
+    decodeTime(registry.histogram("simprpc_decode_seconds", label(method))),
+    encodeTime(registry.histogram("simprpc_encode_seconds", label(method))) { }
+
+  // label values escape backslash, double quote and newline
+  static std::string label(const std::string& method) {
+    std::string l("method=\"");
+    for(char c : method) {
+      if(c == '\\' || c == '"')
+        l += '\\';
+      if(c == '\n')
+        l += "\\n";
+      else
+        l += c;
+    }
+    return l + "\"";
+  }
+};
+
+}
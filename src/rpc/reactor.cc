@@ -0,0 +1,278 @@
+#include <iostream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "rpcserver.h"
+#include "rpc_connection.h"
+
+using namespace simprpc;
+
+
+static int set_nonblock(int fd) {
+  int old = fcntl(fd, F_GETFL);
+  if(fcntl(fd, F_SETFL, old | O_NONBLOCK) < 0) {
+    std::cout << "set non-block failed.\n";
+    exit(EXIT_FAILURE);
+  }
+  return old;
+}
+
+
+/* ========= Reactor ========= */
+
+Reactor* Reactor::create(Backend backend, RPCServer* server, int listenfd) {
+  if(backend == URING) {
+    UringReactor* r = new UringReactor(server, listenfd);
+    if(r->init())
+      return r;
+    std::cout << "io_uring not available, falling back to epoll.\n";
+    delete r;
+  }
+  return new EpollReactor(server, listenfd);
+}
+
+RPCConnection* Reactor::findConnection(int fd) const {
+  return _server->_connectionManager.find(fd);
+}
+
+RPCConnection* Reactor::accepted(int connfd) {
+  bool ret = _server->_connectionManager.add(connfd, _server);
+  if(ret == false){
+    std::cout << "Error creating connection, already existed.\n";
+    close(connfd);
+    return nullptr;
+  }
+  std::cout << "New connection established.\n";
+  RPCConnection* pc = findConnection(connfd);
+  pc->setReactor(this);
+  touched(pc, connfd);
+  return pc;
+}
+
+void Reactor::disarm(const RPCConnection::RequestState& req) {
+  std::lock_guard<std::mutex> lock(_disarmLock);
+  _disarmed.push_back(req);
+}
+
+void Reactor::runTimers() {
+  std::vector<RPCConnection::RequestState> done;
+  {
+    std::lock_guard<std::mutex> lock(_disarmLock);
+    done.swap(_disarmed);
+  }
+  for(auto &req : done) {
+    _timers.cancel(&req->timer);
+    req->timer.callback = nullptr;    // the node's reference of its state
+  }
+  _timers.advance();
+}
+
+void Reactor::dispatch(RPCConnection* pc) {
+  _server->_dispatch(pc, this, &_timers);
+}
+
+bool Reactor::closeConnection(int fd) {
+  RPCConnection *pc = findConnection(fd);
+  if(pc != nullptr) {
+    _timers.cancel(&pc->idleTimer);
+    _timers.cancel(&pc->frameTimer);
+  }
+  unwatch(fd);
+  return _server->_connectionManager.close(fd);
+}
+
+// called after every read, pushes the idle deadline forward and watches
+// the first byte of an incomplete request
+void Reactor::touched(RPCConnection* pc, int fd) {
+  if(pc == nullptr)
+    return;
+  if(pc->isShm()) {   // timed out by its ShmReactor
+    _timers.cancel(&pc->idleTimer);
+    _timers.cancel(&pc->frameTimer);
+    return;
+  }
+  if(_server->_idleTimeout > 0) {
+    if(!pc->idleTimer.callback)
+      pc->idleTimer.callback = [this, fd] { onIdle(fd); };
+    _timers.add(&pc->idleTimer, _server->_idleTimeout);
+  }
+  if(_server->_frameTimeout > 0) {
+    if(!pc->hasPartialFrame())
+      _timers.cancel(&pc->frameTimer);
+    else if(!pc->frameTimer.pending()) {
+      if(!pc->frameTimer.callback)
+        pc->frameTimer.callback = [this, fd] { onFrameTimeout(fd); };
+      _timers.add(&pc->frameTimer, _server->_frameTimeout);
+    }
+  }
+}
+
+void Reactor::onIdle(int fd) {
+  RPCConnection *pc = findConnection(fd);
+  if(pc == nullptr)
+    return;
+  if(!pc->idle()) {   // a request is still running, check again later
+    _timers.add(&pc->idleTimer, _server->_idleTimeout);
+    return;
+  }
+  std::cout << "Closing idle connection " << fd << std::endl;
+  closeConnection(fd);
+}
+
+void Reactor::onFrameTimeout(int fd) {
+  std::cout << "Closing connection " << fd << ": incomplete request timed out.\n";
+  closeConnection(fd);
+}
+
+
+/* ========= EpollReactor ========= */
+
+EpollReactor::EpollReactor(RPCServer* server, int listenfd): Reactor(server, listenfd) {
+  _epfd = epoll_create(5);
+  epoll_event ev;
+  ev.data.fd = _listenfd;
+  ev.events = EPOLLIN | EPOLLET;
+  epoll_ctl(_epfd, EPOLL_CTL_ADD, _listenfd, &ev);
+  set_nonblock(_listenfd);
+}
+
+EpollReactor::~EpollReactor() {
+  close(_epfd);
+}
+
+void EpollReactor::unwatch(int fd) {
+  epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void EpollReactor::run() {
+  // using vector to dynamically handle ready events  
+  std::vector<epoll_event> read_evs(20);  
+
+  while(1) {
+    int ret = epoll_wait(_epfd, &read_evs.front(), read_evs.size(), _timers.nextTimeout());
+    if(ret < 0) {
+      if(errno == EINTR)
+        continue;
+      std::cout << "error epoll_wait. errno: " << errno << "\n";
+      break;
+    }
+    if(ret == int(read_evs.size()))
+      read_evs.resize(read_evs.size() * 2);
+    for(int i = 0; i < ret; i++) {
+      int sockfd = read_evs[i].data.fd;
+      if(read_evs[i].events & EPOLLRDHUP) {
+        std::cout << "Try closing a connection...";
+        // free a connection
+        if(closeConnection(sockfd) == false){
+          std::cout << "Error connection not found.\n";
+          close(sockfd);
+        }
+        else std::cout << "OK\n";
+      }
+      else if(read_evs[i].events & EPOLLIN)
+        _inEvents(sockfd);
+    }
+    runTimers();
+  }
+}
+
+void EpollReactor::_inEvents(int fd) {
+  if(fd == _listenfd) {
+    while(1){
+      struct sockaddr_storage caddr;
+      socklen_t clen = sizeof(caddr);
+
+      int connfd = accept(_listenfd, (struct sockaddr*)&caddr, &clen);
+      if(connfd < 0) {
+        if(errno != EAGAIN && errno == EINTR)
+          std::cout << "Error accepting client, errno:" << errno << std::endl;
+        break;
+      }
+      if(accepted(connfd) == nullptr)
+        continue;
+      
+      // register epoll event
+      struct epoll_event ev;
+      ev.data.fd = connfd;
+      ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+      epoll_ctl(_epfd, EPOLL_CTL_ADD, connfd, &ev);
+      set_nonblock(connfd);
+    }
+  }
+  else{ // data from client
+    RPCConnection *pc = findConnection(fd);
+    if(pc == nullptr) {
+      std::cout << "Error: receive data but connection not found.\n";
+      exit(EXIT_FAILURE);
+    }
+    while(1) {
+      int n = pc->recvXml();
+      if(n < 0) {
+        if(errno != EAGAIN && errno != EINTR)
+          std::cout << "Error reading from " << fd << "errno: " << errno << std::endl;
+        break;
+      }
+      if(n == 0)  // receive a complete xml 
+        dispatch(pc);
+    }
+    touched(pc, fd);
+  }
+}
+
+
+/* ========= ShmReactor ========= */
+
+ShmReactor::ShmReactor(RPCServer* server, RPCConnection* pc): Reactor(server, -1), _pc(pc) {
+  _idleTimer.callback = [this] { _onIdle(); };
+  _frameTimer.callback = [this] {
+    std::cout << "Closing connection " << _pc->fd() << ": incomplete request timed out.\n";
+    _pc->terminateConnection();
+  };
+}
+
+ShmReactor::~ShmReactor() {
+  // the requests are done, drop the deadline timers they handed back
+  runTimers();
+}
+
+void ShmReactor::run() {
+  _touched();
+  int n;
+  while((n = _pc->recvShm(_timers.nextTimeout())) >= 0) {
+    if(n > 0) {
+      dispatch(_pc);
+      _touched();
+    }
+    runTimers();
+  }
+  _timers.cancel(&_idleTimer);
+  _timers.cancel(&_frameTimer);
+}
+
+void ShmReactor::_touched() {
+  if(_server->_idleTimeout > 0)
+    _timers.add(&_idleTimer, _server->_idleTimeout);
+  if(_server->_frameTimeout > 0) {
+    if(!_pc->hasPartialFrame())
+      _timers.cancel(&_frameTimer);
+    else if(!_frameTimer.pending())
+      _timers.add(&_frameTimer, _server->_frameTimeout);
+  }
+}
+
+void ShmReactor::_onIdle() {
+  // the connection table and this loop hold pc
+  if(!_pc->idle(2)) {
+    _timers.add(&_idleTimer, _server->_idleTimeout);
+    return;
+  }
+  std::cout << "Closing idle connection " << _pc->fd() << std::endl;
+  _pc->terminateConnection();
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "timer_wheel.h"
+#include "rpc_connection.h"
+
+namespace simprpc{
+
+class RPCServer;
+
+/*
+  Event loop of the server. A reactor accepts clients on the listening socket,
+  reads their requests and hands complete ones to RPCServer for execution.
+  Backends differ in how they wait for and perform the IO, the bookkeeping
+  around it (connection table, timers, dispatch) is shared here.
+
+  Everything except send() runs on the thread calling run().
+*/
+class Reactor{
+public:
+  enum Backend { EPOLL, URING };
+
+  // create a reactor of the wanted backend, falling back to epoll if the
+  // kernel does not support it
+  static Reactor* create(Backend backend, RPCServer* server, int listenfd);
+
+  virtual ~Reactor() { }
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+
+  virtual void run() = 0;
+
+  // Queue a response of pc to be written by the loop. Returns false if the
+  // backend does not write responses itself, the caller then sends directly.
+  // Called from worker threads.
+  virtual bool send(RPCConnection* pc, const std::string& xml) { return false; }
+
+  // A worker started the request, its deadline timer is cancelled by the
+  // loop on its next round. Called from worker threads.
+  void disarm(const RPCConnection::RequestState& req);
+
+protected:
+  Reactor(RPCServer* server, int listenfd): _server(server), _listenfd(listenfd) { }
+
+  RPCServer* _server;
+  int _listenfd;
+  TimerWheel _timers;
+
+  RPCConnection* findConnection(int fd) const;
+
+  // register a new client socket, nullptr if it is rejected
+  RPCConnection* accepted(int connfd);
+
+  // hand the complete requests buffered in pc to the server
+  void dispatch(RPCConnection* pc);
+
+  // bytes were read for pc, push its idle deadline and watch partial requests
+  void touched(RPCConnection* pc, int fd);
+
+  // drop connection fd from the loop and the connection table
+  bool closeConnection(int fd);
+
+  // cancel the timers handed back by disarm() and run the expired ones,
+  // once per round of the loop
+  void runTimers();
+
+  // remove fd from the backend's watch set, if it has one
+  virtual void unwatch(int fd) { }
+
+private:
+  std::mutex _disarmLock;
+  std::vector<RPCConnection::RequestState> _disarmed;
+
+  void onIdle(int fd);
+  void onFrameTimeout(int fd);
+};
+
+
+// Edge triggered epoll loop, workers write responses themselves.
+class EpollReactor : public Reactor{
+public:
+  EpollReactor(RPCServer* server, int listenfd);
+  ~EpollReactor();
+
+  void run() override;
+
+protected:
+  void unwatch(int fd) override;
+
+private:
+  int _epfd;
+
+  void _inEvents(int fd); // execute method actually happens in _inEvents
+};
+
+
+// Loop of one shared memory connection, on a thread of its own since waiting
+// on the ring is a futex and not a fd the other loops could poll. Requests
+// are dispatched from it as from any loop, INLINE methods run right here,
+// and its wheel holds their deadlines and the connection's idle and partial
+// request timeouts. Owned by the connection, see RPCConnection::setShmLoop().
+class ShmReactor : public Reactor{
+public:
+  ShmReactor(RPCServer* server, RPCConnection* pc);
+  ~ShmReactor();
+
+  // returns once the channel is closed
+  void run() override;
+
+private:
+  RPCConnection* _pc;
+  // not the connection's own timers, those belong to the loop of its socket
+  TimerWheel::Timer _idleTimer;
+  TimerWheel::Timer _frameTimer;
+
+  void _touched();
+  void _onIdle();
+};
+
+}
@@ -0,0 +1,33 @@
+#include "responder.h"
+#include "rpc_connection.h"
+#include "call_context.h"
+
+using namespace simprpc;
+
+Responder::Responder(RPCConnection* pc, int id, uint64 deadline): _pc(pc), _id(id), _deadline(deadline),
+  _done(false) {
+  _pc->ref();
+}
+
+Responder::~Responder() {
+  fail("abandoned");
+  _pc->unref();
+}
+
+bool Responder::finish(const std::vector<XmlElement>& result) {
+  if(_done.exchange(true, std::memory_order_acq_rel))
+    return false;
+  _pc->sendResult(_id, result);
+  return true;
+}
+
+bool Responder::fail(const std::string& reason) {
+  if(_done.exchange(true, std::memory_order_acq_rel))
+    return false;
+  _pc->generateErrorResponse(_id, reason);
+  return true;
+}
+
+int64 Responder::remainingMs() const {
+  return CallContext::remainingMs(_deadline);
+}
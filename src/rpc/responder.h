@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+#include "../serialization/serialization.h"
+#include "types.h"
+
+namespace simprpc{
+
+class RPCConnection;
+
+/*
+  Completion of one call of an AsyncRPCMethod. The method keeps it as long as
+  the work is pending and finishes it from whatever thread the result shows
+  up on, the response is then encoded and sent on the request's connection.
+
+  Only the first finish() or fail() is sent. If the last reference is dropped
+  without either, the client gets a fault instead of waiting forever.
+*/
+class Responder{
+public:
+  // holds a reference of pc until destroyed
+  Responder(RPCConnection* pc, int id, uint64 deadline);
+  ~Responder();
+  Responder(const Responder&) = delete;
+  Responder& operator=(const Responder&) = delete;
+
+  // send result as the response, false if the call was already answered
+  bool finish(const std::vector<XmlElement>& result);
+
+  // send a fault with an optional reason, same return value
+  bool fail(const std::string& reason = std::string());
+
+  bool done() const { return _done.load(std::memory_order_acquire); }
+
+  // same as CallContext::remainingMs() for this call, from any thread
+  int64 remainingMs() const;
+
+private:
+  RPCConnection* _pc;
+  const int _id;
+  const uint64 _deadline;
+  std::atomic<bool> _done;
+};
+
+typedef std::shared_ptr<Responder> ResponderPtr;
+
+}
@@ -0,0 +1,87 @@
+#include <iterator>
+
+#include "result_cache.h"
+#include "timer_wheel.h"
+
+using namespace simprpc;
+
+ResultCache::ResultCache(uint32 ttl_ms, size_t budget_bytes, size_t nshards): _ttl(ttl_ms), _nshards(1) {
+  while(_nshards < nshards)
+    _nshards <<= 1;
+  _shardBudget = budget_bytes / _nshards;
+  _shards.reset(new Shard[_nshards]);
+}
+
+void ResultCache::_erase(Shard& s, LruList::iterator it) {
+  s.bytes -= _cost(*it);
+  s.index.erase(it->key);
+  s.lru.erase(it);
+}
+
+bool ResultCache::get(const std::string& key, std::string& value) {
+  Shard& s = _shardOf(key);
+  std::lock_guard<std::mutex> lock(s.lock);
+  auto it = s.index.find(key);
+  if(it == s.index.end()) {
+    s.misses++;
+    return false;
+  }
+  LruList::iterator e = it->second;
+  if(e->expire != 0 && TimerWheel::nowMs() >= e->expire) {
+    _erase(s, e);
+    s.expirations++;
+    s.misses++;
+    return false;
+  }
+  s.lru.splice(s.lru.begin(), s.lru, e);
+  value = e->value;
+  s.hits++;
+  return true;
+}
+
+size_t ResultCache::put(const std::string& key, const std::string& value) {
+  Entry entry{key, value, _ttl > 0 ? TimerWheel::nowMs() + _ttl : 0};
+  size_t cost = _cost(entry);
+  if(cost > _shardBudget)
+    return 0;
+
+  Shard& s = _shardOf(key);
+  std::lock_guard<std::mutex> lock(s.lock);
+  auto it = s.index.find(key);
+  if(it != s.index.end())   // raced with another miss of the same key
+    _erase(s, it->second);
+  size_t evicted = 0;
+  while(!s.lru.empty() && s.bytes + cost > _shardBudget) {
+    _erase(s, std::prev(s.lru.end()));
+    evicted++;
+  }
+  s.evictions += evicted;
+  s.lru.push_front(std::move(entry));
+  s.index[key] = s.lru.begin();
+  s.bytes += cost;
+  return evicted;
+}
+
+void ResultCache::clear() {
+  for(size_t i = 0; i < _nshards; i++) {
+    std::lock_guard<std::mutex> lock(_shards[i].lock);
+    _shards[i].lru.clear();
+    _shards[i].index.clear();
+    _shards[i].bytes = 0;
+  }
+}
+
+ResultCache::Stats ResultCache::stats() const {
+  Stats st = {0, 0, 0, 0, 0, 0};
+  for(size_t i = 0; i < _nshards; i++) {
+    const Shard& s = _shards[i];
+    std::lock_guard<std::mutex> lock(s.lock);
+    st.hits += s.hits;
+    st.misses += s.misses;
+    st.evictions += s.evictions;
+    st.expirations += s.expirations;
+    st.entries += s.lru.size();
+    st.bytes += s.bytes;
+  }
+  return st;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <cstddef>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Cache of encoded responses of an idempotent method, keyed by the encoded
+  parameters of the request.
+
+  Keys are spread over independently locked shards, each an LRU list with a
+  hash index and its own share of the memory budget. Entries older than the
+  TTL are dropped when they are looked up, the least recently used ones when
+  a shard goes over budget.
+*/
+class ResultCache{
+public:
+  struct Stats{
+    uint64 hits;
+    uint64 misses;
+    uint64 evictions;     // dropped to stay within the budget
+    uint64 expirations;   // dropped because the TTL passed
+    size_t entries;
+    size_t bytes;
+  };
+
+  // ttl_ms 0 keeps entries until they are evicted
+  ResultCache(uint32 ttl_ms, size_t budget_bytes, size_t nshards = 16);
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // copy the cached value of key into value, false on miss
+  bool get(const std::string& key, std::string& value);
+  // returns the number of entries evicted to make room
+  size_t put(const std::string& key, const std::string& value);
+  void clear();
+
+  Stats stats() const;
+
+private:
+  struct Entry{
+    std::string key;
+    std::string value;
+    uint64 expire;    // ms, 0 never
+  };
+  typedef std::list<Entry> LruList;
+
+  struct Shard{
+    mutable std::mutex lock;
+    LruList lru;      // most recently used first
+    std::unordered_map<std::string, LruList::iterator> index;
+    size_t bytes;
+    uint64 hits, misses, evictions, expirations;
+
+    Shard(): bytes(0), hits(0), misses(0), evictions(0), expirations(0) { }
+  };
+
+  uint32 _ttl;
+  size_t _shardBudget;
+  size_t _nshards;    // power of 2
+  std::unique_ptr<Shard[]> _shards;
+
+  Shard& _shardOf(const std::string& key) { return _shards[std::hash<std::string>()(key) & (_nshards - 1)]; }
+  void _erase(Shard& s, LruList::iterator it);
+  // the key is held twice, by the entry and by the index
+  static size_t _cost(const Entry& e) { return 2 * e.key.size() + e.value.size() + sizeof(Entry) + 64; }
+};
+
+}
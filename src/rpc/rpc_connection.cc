@@ -2,9 +2,16 @@
 #include <iostream>
 #include <unistd.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <mutex>
+#include <algorithm>
 
 #include "rpc.h"
+#include "shm_channel.h"
+#include "reactor.h"
+#include "rcu.h"
+#include "call_context.h"
 #include "../serialization/serialization.h"
 #include "assert.h"
 
@@ -19,17 +26,44 @@ const std::string RPCConnection::PARAMS_TAG("<params>");
 const std::string RPCConnection::PARAMS_ETAG("</params>");
 const std::string RPCConnection::FNAME_TAG("<fname>");  // function nmae tag
 const std::string RPCConnection::FNAME_ETAG("</fname>");
+const std::string RPCConnection::TIMEOUT_TAG("<timeout>");
+const std::string RPCConnection::TIMEOUT_ETAG("</timeout>");
 const std::string RPCConnection::FAULT_TAG("<fault>");
 const std::string RPCConnection::FAULT_ETAG("</fault>");
+const std::string RPCConnection::STREAM_TAG("<stream>");
+const std::string RPCConnection::STREAM_ETAG("</stream>");
+const std::string RPCConnection::END_TAG("<end>");
+const std::string RPCConnection::END_ETAG("</end>");
+const std::string RPCConnection::WINDOW_TAG("<window>");
+const std::string RPCConnection::WINDOW_ETAG("</window>");
+const int RPCConnection::STREAM_CREDIT;
+const std::string RPCConnection::BATCH_TAG("<batch>");
+const std::string RPCConnection::BATCH_ETAG("</batch>");
+const std::string RPCConnection::CALL_TAG("<call>");
+const std::string RPCConnection::CALL_ETAG("</call>");
+const std::string RPCConnection::ONEWAY_TAG("<oneway>");
+const std::string RPCConnection::ONEWAY_ETAG("</oneway>");
+const std::string RPCConnection::SHM_HELLO("<XML><shm></shm></XML>");
+const std::string RPCConnection::METHODS_CALL("system.methods");
+const std::string RPCConnection::STATS_CALL("system.stats");
 
 RPCConnection::~RPCConnection() {
-  terminateConnection();  // close connfd
+  delete _shmLoop;
+  delete _shm.load();
+  if(_passedFd >= 0)
+    ::close(_passedFd);
+  ::close(_connfd);
 }
 
 void RPCConnection::terminateConnection(){
-  ::close(_connfd);
-  _connfd = -1;
-  _sending = false;
+  // keep the fd number reserved until destruction, otherwise a new client
+  // may get the same fd while some worker is still sending to this one
+  if(!_closed.exchange(true)) {
+    ::shutdown(_connfd, SHUT_RDWR);
+    ShmChannel* shm = _shm.load(std::memory_order_acquire);
+    if(shm != nullptr)
+      shm->close();
+  }
 }
 
 
@@ -42,7 +76,20 @@ int RPCConnection::recvXml(){
   const int BufferSize = 4096;
   char buf[BufferSize];
   memset(buf, 0, BufferSize);
-  int len = read(_connfd, buf, BufferSize - 1);
+
+  // use recvmsg to pick up a memfd a local client may pass with SHM_HELLO
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = BufferSize - 1;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  int len = recvmsg(_connfd, &msg, MSG_CMSG_CLOEXEC);
   if(len < 0)
     return -1;
   if(len == 0) {
@@ -50,30 +97,120 @@ int RPCConnection::recvXml(){
     terminateConnection();
     return -1;
   }
-  buf[len] = 0;
+  struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+  if(cm != nullptr && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+    if(_passedFd >= 0)
+      ::close(_passedFd);
+    memcpy(&_passedFd, CMSG_DATA(cm), sizeof(int));
+  }
+  return splitXml(buf, len);
+}
+
+int RPCConnection::recvShm(int timeout_ms) {
+  ShmChannel* shm = _shm.load(std::memory_order_acquire);
+  const char* first;
+  const char* second;
+  size_t firstLen, secondLen;
+  int len = shm->peek(first, firstLen, second, secondLen, timeout_ms);
+  if(len <= 0)
+    return len;
+  // requests are cut straight out of the ring, only one that is incomplete
+  // or wraps around its end goes through _inbuf
+  _p_server->bytesIn().add(len);
+  _split(first, firstLen);
+  _split(second, secondLen);
+  shm->consume(len);
+  return len;
+}
 
+int RPCConnection::splitXml(const char* buf, int len) {
+  _p_server->bytesIn().add(len);
+  return _split(buf, len) ? 0 : len;
+}
+
+bool RPCConnection::_split(const char* buf, size_t len) {
   // since maybe many request got received at the same time, we nned to 
   // seperate different xml
-  _inbuf += buf;
+  const size_t tag = XML_END.size();
+  uint64 now = Tracer::enabled() ? Tracer::now() : 0;
+  bool ready = false;
   size_t pos = 0;
-  size_t idx;
-  while((idx = _inbuf.find(XML_END, pos)) != std::string::npos) {
+  if(!_inbuf.empty() && len > 0) {
+    // finish the buffered request first, its end may straddle both parts
+    size_t keep = std::min(_inbuf.size(), tag - 1);
+    std::string seam = _inbuf.substr(_inbuf.size() - keep);
+    seam.append(buf, std::min(len, tag - 1));
+    size_t idx = seam.find(XML_END);
+    if(idx != std::string::npos)
+      pos = idx + tag - keep;
+    else {
+      const char* end = static_cast<const char*>(memmem(buf, len, XML_END.data(), tag));
+      if(end == nullptr) {
+        _inbuf.append(buf, len);
+        return false;
+      }
+      pos = end - buf + tag;
+    }
+    _inbuf.append(buf, pos);
     _readyLock.lock();
-    _readyQueue.push(_inbuf.substr(pos, idx + XML_END.size() - pos));
+    _readyQueue.push(std::make_pair(std::move(_inbuf), now));
     _readyLock.unlock();
-    pos = idx + XML_END.size();
+    _inbuf.clear();
+    ready = true;
   }
+  const char* end;
+  while((end = static_cast<const char*>(memmem(buf + pos, len - pos, XML_END.data(), tag))) != nullptr) {
+    size_t next = end - buf + tag;
+    _readyLock.lock();
+    _readyQueue.push(std::make_pair(std::string(buf + pos, next - pos), now));
+    _readyLock.unlock();
+    pos = next;
+    ready = true;
+  }
+  _inbuf.append(buf + pos, len - pos);
+  return ready;
+}
 
-
-  if(pos > 0) { // find an end
-    _inbuf = _inbuf.substr(pos);
-    return 0; // have already finish reading a xml request
+bool RPCConnection::attachShm() {
+  if(_passedFd < 0 || isShm()) {
+    std::cout << "Error: shared memory requested without a segment.\n";
+    return false;
   }
-  return len;
+  ShmChannel* shm = ShmChannel::attach(_passedFd);
+  _passedFd = -1;   // owned by the channel, even on failure
+  if(shm == nullptr)
+    return false;
+  // acknowledge on the socket before responses start going to the ring
+  if(sendXml(SHM_HELLO) < 0) {
+    delete shm;
+    return false;
+  }
+  _shm.store(shm, std::memory_order_release);
+  return true;
 }
 
+int RPCConnection::sendXml(const std::string& xml, Tracer::Span* span) {
+  _p_server->bytesOut().add(xml.size());
+  // a response handed to the event loop is finished once queued there,
+  // otherwise sending starts when the connection is ours (stamped below)
+  Tracer::mark(span, Tracer::SEND_START);
+  // one load for the whole send, the channel may get attached meanwhile
+  ShmChannel* shm = _shm.load(std::memory_order_acquire);
+  if(shm == nullptr && _reactor != nullptr && _reactor->send(this, xml)) {
+    Tracer::mark(span, Tracer::SEND_END);
+    return 0;
+  }
+
+  if(shm != nullptr) {
+    // the ring takes a single writer, a full one holds the lock until the
+    // client made room
+    std::lock_guard<std::mutex> lock(_shmLock);
+    Tracer::mark(span, Tracer::SEND_START);
+    bool ok = shm->write(xml.c_str(), xml.size()) == int(xml.size());
+    Tracer::mark(span, Tracer::SEND_END);
+    return ok ? 0 : -1;
+  }
 
-int RPCConnection::sendXml(const std::string& xml) {
   const char *p = xml.c_str();
   size_t offset = 0;
   size_t len = xml.size();
@@ -87,12 +224,24 @@ int RPCConnection::sendXml(const std::string& xml) {
   // set _sending to be true for this worker is about to send xml
   _sending = true;
   lock.unlock();  // avoid other threads spin on locking
+  Tracer::mark(span, Tracer::SEND_START);
 
   while(offset < len) {
-    int n = write(_connfd, p + offset, len - offset);
+    // MSG_NOSIGNAL: the connection may have been shut down by the event loop
+    int n = ::send(_connfd, p + offset, len - offset, MSG_NOSIGNAL);
     if(n < 0) {
-      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the socket buffer is full, sleep until the client reads. This is
+        // what holds a stream back on the epoll backend. Closing does not
+        // signal, check it now and then.
+        if(!isValid())
+          break;
+        struct pollfd pfd;
+        pfd.fd = _connfd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, 100);
         continue;
+      }
       std::cout << "Error in sending response.\n";
       break;
     }
@@ -100,6 +249,7 @@ int RPCConnection::sendXml(const std::string& xml) {
   }
 
   bool flag = offset == len;
+  Tracer::mark(span, Tracer::SEND_END);
   std::cout << "Finish sending response...";
   if(flag)
     std::cout << "OK\n";
@@ -113,34 +263,98 @@ int RPCConnection::sendXml(const std::string& xml) {
   return flag ? 0 : -1;
 }
 
+void RPCConnection::outputQueued(size_t n) {
+  std::lock_guard<std::mutex> lock(_outlock);
+  _outBytes += n;
+}
+
+void RPCConnection::outputWritten(size_t n) {
+  std::lock_guard<std::mutex> lock(_outlock);
+  _outBytes -= n;
+  _drained.notify_all();
+}
+
+bool RPCConnection::waitOutput(size_t limit) {
+  std::unique_lock<std::mutex> lock(_outlock);
+  // closing does not signal, check it now and then
+  while(_outBytes > limit && isValid())
+    _drained.wait_for(lock, std::chrono::milliseconds(100));
+  return isValid();
+}
+
 void RPCConnection::errorHandler(const char* msg, int id){
   std::cout << msg << std::endl;
   generateErrorResponse(id);
 }
 
-void RPCConnection::generateErrorResponse(int id) {
+void RPCConnection::generateErrorResponse(int id, const std::string& reason) {
   std::string errxml(XML_START);
   errxml += ID_TAG;
   XmlElement ele(id);
   errxml += ele.encode();
   errxml += ID_ETAG;
-  errxml += FAULT_TAG + FAULT_ETAG + XML_END;
+  errxml += FAULT_TAG;
+  if(!reason.empty())
+    errxml += XmlElement(reason).encode();
+  errxml += FAULT_ETAG + XML_END;
 
   sendXml(errxml);
 }
 
-void RPCConnection::parse(const std::string& xml, request& req) {
+int RPCConnection::peekID(const std::string& xml) {
+  size_t offset = xml.find(ID_TAG);
+  if(offset == std::string::npos)
+    return -1;
+  offset += ID_TAG.size();
+  XmlElement id;
+  if(!id.decode(xml, &offset) || !id.istype(TypeInt))
+    return -1;
+  return *((int*)id.getdata());
+}
+
+XmlElement RPCConnection::peekMethod(const std::string& xml) {
+  XmlElement name;
+  size_t offset = xml.find(FNAME_TAG);
+  if(offset == std::string::npos)
+    return name;
+  offset += FNAME_TAG.size();
+  if(!name.decode(xml, &offset))
+    name.settype(TypeNone);
+  return name;
+}
+
+int RPCConnection::peekTimeout(const std::string& xml) {
+  // only look right behind fname, a missing tag must not cost a full scan
+  size_t offset = xml.find(FNAME_ETAG);
+  if(offset == std::string::npos)
+    return -1;
+  offset += FNAME_ETAG.size();
+  if(xml.compare(offset, TIMEOUT_TAG.size(), TIMEOUT_TAG) != 0)
+    return -1;
+  offset += TIMEOUT_TAG.size();
+  XmlElement timeout;
+  if(!timeout.decode(xml, &offset) || !timeout.istype(TypeInt))
+    return -1;
+  return std::max(*((int*)timeout.getdata()), 0);
+}
+
+bool RPCConnection::parse(const std::string& xml, request& req, bool reply) {
+    auto fail = [this, &req, reply](const char* msg) {
+      if(reply)
+        errorHandler(msg, req.id);
+      else
+        std::cout << msg << std::endl;
+      return false;
+    };
     size_t offset = 0;
     if(!XmlUtil::nextTagIs(XML_START.c_str(), xml, &offset)){
-      errorHandler("Error invalid xml format: header not found.", req.id);
-      return;
+      return fail("Error invalid xml format: header not found.");
     }
 
     XmlUtil::getNextTag(xml, &offset);
     std::string tag = XmlUtil::getNextTag(xml, &offset);
     if(!(tag == ID_TAG)) {
-      errorHandler("Invalid xml format: id tag not found.\n", req.id);
-      return;
+      return fail("Invalid xml format: id tag not found.\n");
     }
 
     // get request id
@@ -149,21 +363,36 @@ void RPCConnection::parse(const std::string& xml, request& req) {
     XmlUtil::toTagEnd(xml, &offset, ID_ETAG.c_str());
     req.id = *((int*)id.getdata());
 
-    if(!((tag = XmlUtil::getNextTag(xml, &offset)) == FNAME_TAG)) {
-      errorHandler("Error invalid xml format: fname not found.", req.id);
-      return;
+    tag = XmlUtil::getNextTag(xml, &offset);
+    if(tag == ONEWAY_TAG) {
+      XmlUtil::toTagEnd(xml, &offset, ONEWAY_ETAG.c_str());
+      tag = XmlUtil::getNextTag(xml, &offset);
+    }
+    if(!(tag == FNAME_TAG)) {
+      return fail("Error invalid xml format: fname not found.");
     }
 
     // get request function name
     XmlElement func_name;
     func_name.decode(xml, &offset);
     XmlUtil::toTagEnd(xml, &offset, FNAME_ETAG.c_str());
-    req.fun_name = *((std::string*)func_name.getdata());
+    if(func_name.istype(TypeInt))   // id published by METHODS_CALL
+      req.fun_id = *((int*)func_name.getdata());
+    else if(func_name.istype(TypeString))
+      req.fun_name = *((std::string*)func_name.getdata());
+
+    tag = XmlUtil::getNextTag(xml, &offset);
+    if(tag == TIMEOUT_TAG) {
+      XmlElement timeout;
+      if(timeout.decode(xml, &offset) && timeout.istype(TypeInt))
+        req.timeout = *((int*)timeout.getdata());
+      XmlUtil::toTagEnd(xml, &offset, TIMEOUT_ETAG.c_str());
+      tag = XmlUtil::getNextTag(xml, &offset);
+    }
 
     // get request parameters
-    if((tag = XmlUtil::getNextTag(xml, &offset)) != PARAMS_TAG) {
-      errorHandler("Invalid xml format: params tag not found.\n", req.id);
-      return;
+    if(tag != PARAMS_TAG) {
+      return fail("Invalid xml format: params tag not found.\n");
     }
       
     XmlElement ele;
@@ -171,43 +400,432 @@ void RPCConnection::parse(const std::string& xml, request& req) {
       req.params.emplace_back(std::move(ele));
     }
     if((tag = XmlUtil::getNextTag(xml, &offset)) != PARAMS_ETAG) {
-      errorHandler("Invalid xml format: params end not found.\n", req.id);
-      return;
+      return fail("Invalid xml format: params end not found.\n");
     }
 
     if((tag = XmlUtil::getNextTag(xml, &offset)) != XML_END)
-      errorHandler("Error invalid xml format: xml end not found.", req.id);
+      return fail("Error invalid xml format: xml end not found.");
+    return true;
+}
+
+// start of a response to request id, the result follows
+std::string RPCConnection::responseHead(int id) {
+  std::string head(XML_START);
+  head += ID_TAG;
+  head += XmlElement(id).encode();
+  head += ID_ETAG;
+  return head;
+}
+
+std::string RPCConnection::responseBody(const std::vector<XmlElement>& result) {
+  std::string body(PARAMS_TAG);
+  for(auto &ele : result)
+    body += ele.encode();
+  body += PARAMS_ETAG;
+  body += XML_END;
+  return body;
+}
+
+void RPCConnection::sendResult(int id, const std::vector<XmlElement>& result) {
+  sendXml(responseHead(id) + responseBody(result));
+}
+
+int RPCConnection::sendChunk(int id, const std::vector<XmlElement>& chunk) {
+  return sendXml(chunkFrame(id, chunk));
+}
+
+std::string RPCConnection::chunkFrame(int id, const std::vector<XmlElement>& chunk) {
+  std::string xml = responseHead(id);
+  xml += STREAM_TAG;
+  xml += PARAMS_TAG;
+  for(auto &ele : chunk)
+    xml += ele.encode();
+  xml += PARAMS_ETAG;
+  xml += STREAM_ETAG;
+  xml += XML_END;
+  return xml;
+}
+
+std::string RPCConnection::windowFrame(int id, int n) {
+  std::string xml = responseHead(id);
+  xml += WINDOW_TAG;
+  xml += XmlElement(n).encode();
+  xml += WINDOW_ETAG;
+  xml += XML_END;
+  return xml;
+}
+
+std::string RPCConnection::endFrame(int id) {
+  return responseHead(id) + END_TAG + END_ETAG + XML_END;
+}
+
+void RPCConnection::sendWindow(int id, int n) {
+  sendXml(windowFrame(id, n));
+}
+
+bool RPCConnection::decodeChunk(const std::string& xml, std::vector<XmlElement>& chunk) {
+  size_t offset = xml.find(STREAM_TAG);
+  if(offset == std::string::npos)
+    return false;
+  offset += STREAM_TAG.size();
+  if(XmlUtil::getNextTag(xml, &offset) != PARAMS_TAG)
+    return false;
+  XmlElement ele;
+  while(ele.decode(xml, &offset))
+    chunk.emplace_back(std::move(ele));
+  return true;
+}
+
+std::shared_ptr<StreamChannel> RPCConnection::openStream(int id) {
+  std::shared_ptr<StreamChannel> channel = std::make_shared<StreamChannel>(STREAM_CREDIT);
+  std::lock_guard<std::mutex> lock(_streamLock);
+  _streams[id] = channel;
+  return channel;
+}
+
+std::shared_ptr<StreamChannel> RPCConnection::findStream(int id) {
+  std::lock_guard<std::mutex> lock(_streamLock);
+  auto it = _streams.find(id);
+  return it != _streams.end() ? it->second : nullptr;
+}
+
+void RPCConnection::closeStream(int id) {
+  std::lock_guard<std::mutex> lock(_streamLock);
+  _streams.erase(id);
+}
+
+bool RPCConnection::deliverStreamFrame(const std::string& xml) {
+  // the frame kind is given by the tag right behind the id
+  size_t offset = xml.find(ID_ETAG);
+  if(offset == std::string::npos)
+    return false;
+  offset += ID_ETAG.size();
+  bool data = xml.compare(offset, STREAM_TAG.size(), STREAM_TAG) == 0;
+  bool end = !data && xml.compare(offset, END_TAG.size(), END_TAG) == 0;
+  bool window = !data && !end && xml.compare(offset, WINDOW_TAG.size(), WINDOW_TAG) == 0;
+  if(!data && !end && !window)
+    return false;
+
+  std::shared_ptr<StreamChannel> channel = findStream(peekID(xml));
+  if(!channel)
+    return true;    // the session is over, nobody reads it anymore
+  std::lock_guard<std::mutex> lock(channel->lock);
+  if(data) {
+    if(channel->inbox.size() >= size_t(STREAM_CREDIT)) {
+      std::cout << "Error: client stream exceeds its window, closing connection.\n";
+      terminateConnection();
+      return true;
+    }
+    channel->inbox.push_back(xml);
+  }
+  else if(end)
+    channel->ended = true;
+  else {
+    offset += WINDOW_TAG.size();
+    XmlElement n;
+    if(n.decode(xml, &offset) && n.istype(TypeInt))
+      channel->sendCredit += *((int*)n.getdata());
+  }
+  channel->cv.notify_all();
+  return true;
+}
+
+bool RPCConnection::isBatch(const std::string& xml) {
+  size_t offset = xml.find(ID_ETAG);
+  return offset != std::string::npos && xml.compare(offset + ID_ETAG.size(), BATCH_TAG.size(), BATCH_TAG) == 0;
+}
+
+bool RPCConnection::isOneWay(const std::string& xml) {
+  size_t offset = xml.find(ID_ETAG);
+  return offset != std::string::npos && xml.compare(offset + ID_ETAG.size(), ONEWAY_TAG.size(), ONEWAY_TAG) == 0;
+}
+
+bool RPCConnection::splitBatch(const std::string& xml, std::vector<std::string>& entries, int& timeout) {
+  timeout = -1;
+  size_t offset = xml.find(BATCH_TAG);
+  if(offset == std::string::npos)
+    return false;
+  offset += BATCH_TAG.size();
+  if(xml.compare(offset, TIMEOUT_TAG.size(), TIMEOUT_TAG) == 0) {
+    offset += TIMEOUT_TAG.size();
+    XmlElement t;
+    if(!t.decode(xml, &offset) || !t.istype(TypeInt))
+      return false;
+    timeout = std::max(*((int*)t.getdata()), 0);
+    offset = xml.find(TIMEOUT_ETAG, offset);
+    if(offset == std::string::npos)
+      return false;
+    offset += TIMEOUT_ETAG.size();
+  }
+  // strings are escaped, a tag can not show up inside a parameter
+  while(xml.compare(offset, CALL_TAG.size(), CALL_TAG) == 0) {
+    offset += CALL_TAG.size();
+    size_t end = xml.find(CALL_ETAG, offset);
+    if(end == std::string::npos)
+      return false;
+    entries.push_back(xml.substr(offset, end - offset));
+    offset = end + CALL_ETAG.size();
+  }
+  return xml.compare(offset, BATCH_ETAG.size(), BATCH_ETAG) == 0;
+}
+
+std::string RPCConnection::faultBody(const std::string& reason) {
+  std::string body(FAULT_TAG);
+  if(!reason.empty())
+    body += XmlElement(reason).encode();
+  body += FAULT_ETAG;
+  return body;
+}
+
+std::string RPCConnection::batchFrame(int id, const std::vector<std::string>& bodies) {
+  std::string xml = responseHead(id);
+  xml += BATCH_TAG;
+  for(auto &body : bodies)
+    xml += body;
+  xml += BATCH_ETAG;
+  xml += XML_END;
+  return xml;
+}
+
+void RPCConnection::executeEntry(const std::string& entry, RPCMethod* func, std::string& out, uint64 deadline,
+                                 uint64 enqueued) {
+  if(func == nullptr) {
+    out = faultBody("method not found");
+    return;
+  }
+  MethodStats* stats = func->stats();
+  if(stats != nullptr) {
+    stats->calls.add();
+    if(enqueued != 0)
+      stats->queueWait.record(metrics::nowUs() - enqueued);
+  }
+  if(deadline != 0 && TimerWheel::nowMs() >= deadline) {
+    if(stats != nullptr)
+      stats->errors.add();
+    out = faultBody("timeout");
+    return;
+  }
+  CallContext::Scope context(deadline);
+
+  // their response is not a single value available when the call returns
+  if(func->async() != nullptr || func->streaming() != nullptr || func->bidi() != nullptr) {
+    out = faultBody("method can not be batched");
+    return;
+  }
+  size_t offset = entry.find(PARAMS_TAG);
+  if(offset == std::string::npos) {
+    out = faultBody("invalid entry");
+    return;
+  }
 
+  // same key and value as for a single call of the method
+  ResultCache* cache = func->cache();
+  std::string key, body;
+  if(cache != nullptr) {
+    key = entry.substr(offset) + XML_END;
+    bool hit = cache->get(key, body);
+    if(stats != nullptr)
+      (hit ? stats->cacheHits : stats->cacheMisses).add();
+    if(hit) {
+      out = body.substr(0, body.size() - XML_END.size());
+      return;
+    }
+  }
+
+  std::vector<XmlElement> params, result;
+  uint64 t0 = metrics::nowUs();
+  offset += PARAMS_TAG.size();
+  XmlElement ele;
+  while(ele.decode(entry, &offset))
+    params.emplace_back(std::move(ele));
+  uint64 t1 = metrics::nowUs();
+  func->execute(params, result);
+  uint64 t2 = metrics::nowUs();
+  body = responseBody(result);
+  if(stats != nullptr) {
+    stats->decodeTime.record(t1 - t0);
+    stats->execTime.record(t2 - t1);
+    stats->encodeTime.record(metrics::nowUs() - t2);
+  }
+  if(cache != nullptr) {
+    size_t evicted = cache->put(key, body);
+    if(stats != nullptr)
+      stats->cacheEvictions.add(evicted);
+  }
+  out = body.substr(0, body.size() - XML_END.size());
+}
+
+void RPCConnection::notify(const std::string& xml, RPCMethod* func) {
+  if(func == nullptr) {
+    std::cout << "Error: notified function not found.\n";
+    return;
+  }
+  // they answer through the connection, which a notification has no use for
+  if(func->async() != nullptr || func->streaming() != nullptr || func->bidi() != nullptr) {
+    std::cout << "Error: notified function has no plain execute().\n";
+    return;
+  }
+  MethodStats* stats = func->stats();
+  request req;
+  uint64 t0 = metrics::nowUs();
+  // nobody waits for an answer, a malformed one is dropped
+  if(!parse(xml, req, false))
+    return;
+  uint64 t1 = metrics::nowUs();
+  std::vector<XmlElement> result;
+  func->execute(req.params, result);
+  if(stats != nullptr) {
+    stats->calls.add();
+    stats->decodeTime.record(t1 - t0);
+    stats->execTime.record(metrics::nowUs() - t1);
+  }
 }
 
-void RPCConnection::execute(const std::string& xml) {
+void RPCConnection::execute(const std::string& xml, RPCMethod* func, uint64 deadline, uint64 enqueued,
+                            Tracer::Span* span) {
+  Tracer::mark(span, Tracer::DEQUEUED);
+  if(isOneWay(xml)) {
+    notify(xml, func);
+    return;
+  }
+  MethodStats* stats = func != nullptr ? func->stats() : nullptr;
+  if(stats != nullptr) {
+    stats->calls.add();
+    if(enqueued != 0)
+      stats->queueWait.record(metrics::nowUs() - enqueued);
+  }
+  if(span != nullptr) {
+    span->id = peekID(xml);
+    if(func != nullptr)
+      span->method = func->getName();
+  }
+
+  // the client gave up, do not waste a worker on it
+  if(deadline != 0 && TimerWheel::nowMs() >= deadline) {
+    if(stats != nullptr)
+      stats->errors.add();
+    closeStream(peekID(xml));
+    generateErrorResponse(peekID(xml), "timeout");
+    return;
+  }
+  CallContext::Scope context(deadline);
+
+  AsyncRPCMethod* async = func != nullptr ? func->async() : nullptr;
+  StreamingRPCMethod* streaming = func != nullptr ? func->streaming() : nullptr;
+  BidiRPCMethod* bidi = func != nullptr ? func->bidi() : nullptr;
+
+  // cached and coalesced calls are keyed by the raw parameters, a cached
+  // response only needs the id of this request in front of it. Async calls
+  // complete after the method is unpinned and streams have no single
+  // response, both bypass them.
+  bool plain = func != nullptr && async == nullptr && streaming == nullptr && bidi == nullptr;
+  ResultCache* cache = plain ? func->cache() : nullptr;
+  SingleFlight* flights = plain ? func->flights() : nullptr;
+  std::string key, body;
+  if(cache != nullptr || flights != nullptr) {
+    size_t pos = xml.find(PARAMS_TAG);
+    if(pos != std::string::npos)
+      key = xml.substr(pos);
+  }
+  if(cache != nullptr && !key.empty()) {
+    bool hit = cache->get(key, body);
+    if(stats != nullptr)
+      (hit ? stats->cacheHits : stats->cacheMisses).add();
+    if(hit) {
+      sendXml(responseHead(peekID(xml)) + body, span);
+      return;
+    }
+  }
+  // an identical call is running, its leader will answer this one too
+  if(flights != nullptr && !key.empty() && !flights->join(key, this, peekID(xml)))
+    return;
+
   request req;
-  parse(xml, req);
-  RPCMethod * func = _p_server->getMethod(req.fun_name);
+  uint64 t0 = metrics::nowUs();
+  if(!parse(xml, req)) {
+    // answered with a fault already, so are the calls coalesced behind it
+    if(stats != nullptr)
+      stats->errors.add();
+    if(flights != nullptr && !key.empty()) {
+      for(auto &w : flights->finish(key)) {
+        w.first->generateErrorResponse(w.second);
+        w.first->unref();
+      }
+    }
+    return;
+  }
+  uint64 t1 = metrics::nowUs();
+  Tracer::mark(span, Tracer::PARSED);
+  if(stats != nullptr)
+    stats->decodeTime.record(t1 - t0);
   if(func == nullptr) {
-    std::cout << "Error: execute function not found. \"" << req.fun_name << "\"\n";
+    std::cout << "Error: execute function not found. \"" << req.fun_name << "\" id " << req.fun_id << "\n";
     errorHandler("", req.id);
     return;
   }
 
+  if(async != nullptr) {
+    // the worker is free again as soon as the call is started
+    async->executeAsync(req.params, std::make_shared<Responder>(this, req.id, deadline));
+    Tracer::mark(span, Tracer::EXECUTED);
+    if(stats != nullptr)
+      stats->execTime.record(metrics::nowUs() - t1);
+    return;
+  }
+
+  if(bidi != nullptr) {
+    std::shared_ptr<StreamChannel> channel = findStream(req.id);
+    if(!channel)    // not read by the server's dispatch, nothing to read from
+      channel = openStream(req.id);
+    StreamReader in(this, req.id, channel);
+    StreamWriter out(this, req.id, channel);
+    std::vector<XmlElement> result;
+    bidi->session(req.params, in, out, result);
+    Tracer::mark(span, Tracer::EXECUTED);
+    if(stats != nullptr)
+      stats->execTime.record(metrics::nowUs() - t1);
+    closeStream(req.id);
+    sendResult(req.id, result);
+    return;
+  }
+
+  if(streaming != nullptr) {
+    StreamWriter writer(this, req.id);
+    streaming->stream(req.params, writer);
+    Tracer::mark(span, Tracer::EXECUTED);
+    if(stats != nullptr)
+      stats->execTime.record(metrics::nowUs() - t1);
+    sendResult(req.id, std::vector<XmlElement>());    // end of stream
+    return;
+  }
+
   std::vector<XmlElement> result;
   func->execute(req.params, result);
+  uint64 t2 = metrics::nowUs();
+  Tracer::mark(span, Tracer::EXECUTED);
 
   // generate response xml data
-  std::string response(XML_START);
-  response += ID_TAG;
-  XmlElement id((int)req.id);
-  response += id.encode(); 
-  response += ID_ETAG;
-
-  response += PARAMS_TAG;
-  for(auto &ele : result)
-    response += ele.encode();
-  response += PARAMS_ETAG;
-  response += XML_END;
+  body = responseBody(result);
+  Tracer::mark(span, Tracer::ENCODED);
+  if(stats != nullptr) {
+    stats->execTime.record(t2 - t1);
+    stats->encodeTime.record(metrics::nowUs() - t2);
+  }
+  if(cache != nullptr && !key.empty()) {
+    size_t evicted = cache->put(key, body);
+    if(stats != nullptr)
+      stats->cacheEvictions.add(evicted);
+  }
+  if(flights != nullptr && !key.empty()) {
+    for(auto &w : flights->finish(key)) {
+      w.first->sendXml(responseHead(w.second) + body);
+      w.first->unref();
+    }
+  }
+  std::string response = responseHead(req.id) + body;
 
   // sneding result
-  sendXml(response);
+  sendXml(response, span);
 
 }
 
@@ -5,10 +5,16 @@
 #include <string>
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include <queue>
 #include <condition_variable>
+#include <memory>
+#include <map>
 
 #include "../serialization/serialization.h"
+#include "timer_wheel.h"
+#include "stream_channel.h"
+#include "trace.h"
 
 namespace simprpc{
 
@@ -26,6 +32,9 @@ namespace simprpc{
   data.
 */
 class RPCServer;
+class RPCMethod;
+class ShmChannel;
+class Reactor;
 
 // enum{ OUT_BUFFER,IN_BUFFER};
 
@@ -39,40 +48,223 @@ public:
   static const std::string PARAMS_ETAG;
   static const std::string FNAME_TAG;
   static const std::string FNAME_ETAG;
+  // optional, between fname and params: milliseconds the client waits
+  static const std::string TIMEOUT_TAG;
+  static const std::string TIMEOUT_ETAG;
 
 
   static const std::string FAULT_TAG;
   static const std::string FAULT_ETAG;
 
+  // wraps the params of a chunk of a streamed result, the stream ends with a
+  // regular response (or a fault) of the same id
+  static const std::string STREAM_TAG;
+  static const std::string STREAM_ETAG;
+
+  // Client streams (see BidiRPCMethod): the client sends its chunks with
+  // STREAM_TAG frames of the request id and closes its side with an END_TAG
+  // frame. Either end returns chunk credit with WINDOW_TAG frames carrying
+  // the number of chunks it consumed, both start with STREAM_CREDIT.
+  static const std::string END_TAG;
+  static const std::string END_ETAG;
+  static const std::string WINDOW_TAG;
+  static const std::string WINDOW_ETAG;
+  static const int STREAM_CREDIT = 16;
+
+  // Batch request: <batch>, an optional <timeout>, then one
+  // <call><fname>..</fname><params>..</params></call> per entry. Its response
+  // holds one <params> or <fault> per entry, in order, inside <batch>.
+  static const std::string BATCH_TAG;
+  static const std::string BATCH_ETAG;
+  static const std::string CALL_TAG;
+  static const std::string CALL_ETAG;
+
+  // Right behind the id of a notification, a call nobody waits for. The
+  // server runs it and sends nothing back, not even a fault.
+  static const std::string ONEWAY_TAG;
+  static const std::string ONEWAY_ETAG;
+
+  // sent by a client together with a memfd to switch to a shared memory
+  // channel, echoed by the server once the segment is mapped
+  static const std::string SHM_HELLO;
+
+  // built-in call answering the dense id of every registered method as
+  // (name, id) pairs, clients then send the id in <fname> instead of the name
+  static const std::string METHODS_CALL;
+
+  // built-in call answering the server's metrics as (name, value) pairs, or
+  // as Prometheus text if its parameter is the string "prometheus"
+  static const std::string STATS_CALL;
+
   struct request{
     uint32_t id;
     std::string fun_name; // funciton name that client ask for
+    int fun_id;           // or its id, -1 if called by name
+    int timeout;          // ms the client waits, -1 if not given
     std::vector<XmlElement> params;
 
-    request(): id(0) {}
+    request(): id(0), fun_id(-1), timeout(-1) {}
   };
-  RPCConnection(int sockfd, RPCServer* ps): _connfd(sockfd), _sending(false), _p_server(ps) {}
-  ~RPCConnection();
 
-  void terminateConnection(); // close socket
+  // Life cycle of a request queued in the thread pool, shared between the
+  // worker and the deadline timer so that exactly one of them answers it.
+  // Whoever moves it out of REQ_QUEUED also takes over the reference of pc
+  // the queued task holds. The timer belongs to the event loop that armed it,
+  // a worker starting the request hands it back with Reactor::disarm().
+  enum { REQ_QUEUED, REQ_RUNNING, REQ_EXPIRED };
+  struct Request{
+    std::atomic<int> phase;
+    TimerWheel::Timer timer;
+    Reactor* loop;
+
+    explicit Request(Reactor* r): phase(REQ_QUEUED), loop(r) { }
+  };
+  typedef std::shared_ptr<Request> RequestState;
+
+  RPCConnection(int sockfd, RPCServer* ps): _connfd(sockfd), _refs(1), _closed(false), _passedFd(-1), _shm(nullptr),
+    _shmLoop(nullptr), _reactor(nullptr), _sending(false), _outBytes(0), _p_server(ps) {}
+
+  // A connection is reference counted, the creator owns the first reference.
+  // Every worker task holds its own reference so the object and its socket
+  // are only released after the last in-flight request is done.
+  void ref() { _refs.fetch_add(1, std::memory_order_relaxed); }
+  void unref() {
+    if(_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  void terminateConnection(); // shutdown socket, fd is closed on destruction
 
   // void resetBuffer() { _inbuf.clear();}
   int recvXml(); 
-  int sendXml(const std::string& xml);
+  int sendXml(const std::string& xml, Tracer::Span* span = nullptr);
+
+  // split bytes read by the event loop into complete requests, returns 0 if
+  // any request is ready
+  int splitXml(const char* buf, int len);
+
+  int fd() const { return _connfd; }
+
+  // event loop owning this connection, responses are queued to it if it
+  // writes them itself
+  void setReactor(Reactor* r) { _reactor = r; }
+  Reactor* reactor() const { return _reactor; }
+
+  // Shared memory channel. attachShm() maps the memfd received with
+  // SHM_HELLO and acknowledges it, from then on requests are read with
+  // recvShm() and responses go to the ring. recvShm() waits at most
+  // timeout_ms (-1 forever) and returns the number of bytes read, 0 on
+  // timeout and -1 once the channel is closed.
+  bool attachShm();
+  int recvShm(int timeout_ms = -1);
+  bool isShm() const { return _shm.load(std::memory_order_acquire) != nullptr; }
+
+  // loop reading the channel, released with the connection since queued
+  // requests hand their deadline timers back to it
+  void setShmLoop(Reactor* loop) { _shmLoop = loop; }
 
   // const std::string& getBuffer() const { return _inbuf; }
    
-  // parsing the xml and excute the cresponding command
-  void execute(const std::string& xml);
+  // parsing the xml and excute the cresponding command. func is the method
+  // the server dispatched it to and pinned (nullptr if there is none), it is
+  // not looked up again. deadline is
+  // absolute in TimerWheel::nowMs() time, 0 for none, a request past it is
+  // answered with a fault. enqueued
+  // is the metrics::nowUs() the request was queued at, 0 if it was not.
+  // The stages of a sampled request are stamped on span.
+  void execute(const std::string& xml, RPCMethod* func, uint64 deadline = 0, uint64 enqueued = 0,
+               Tracer::Span* span = nullptr);
+
+  // send a fault response for request id, with an optional reason
+  void generateErrorResponse(int id, const std::string& reason = std::string());
+
+  // send the successful response of request id
+  void sendResult(int id, const std::vector<XmlElement>& result);
+
+  // send one chunk of the streamed result of request id
+  int sendChunk(int id, const std::vector<XmlElement>& chunk);
+
+  // give n chunks of credit back to the client stream of request id
+  void sendWindow(int id, int n);
 
-  void getReqXml(std::string&s) { 
+  // true if xml is a batch request
+  static bool isBatch(const std::string& xml);
+
+  // true if xml is a notification
+  static bool isOneWay(const std::string& xml);
+
+  // cut a batch request into its entries (the contents of each <call>),
+  // timeout is -1 if the client gave none
+  static bool splitBatch(const std::string& xml, std::vector<std::string>& entries, int& timeout);
+
+  // run one batch entry with its pinned method func and store its <params>
+  // or <fault> element in out
+  void executeEntry(const std::string& entry, RPCMethod* func, std::string& out, uint64 deadline,
+                    uint64 enqueued = 0);
+
+  static std::string faultBody(const std::string& reason);
+  // response to batch request id, of the bodies executeEntry() gave
+  static std::string batchFrame(int id, const std::vector<std::string>& bodies);
+
+  // Frames of streams, sent by both ends. decodeChunk() gives the params of
+  // a chunk frame.
+  static std::string chunkFrame(int id, const std::vector<XmlElement>& chunk);
+  static std::string windowFrame(int id, int n);
+  static std::string endFrame(int id);
+  static bool decodeChunk(const std::string& xml, std::vector<XmlElement>& chunk);
+
+  // Channels of client streams by request id. openStream() is called when
+  // the request is read so that no chunk arriving before the session starts
+  // is lost, closeStream() when it ended.
+  std::shared_ptr<StreamChannel> openStream(int id);
+  std::shared_ptr<StreamChannel> findStream(int id);
+  void closeStream(int id);
+
+  // hand a stream frame to its channel, false if xml is a regular request
+  bool deliverStreamFrame(const std::string& xml);
+
+  bool closed() const { return _closed.load(std::memory_order_relaxed); }
+
+  // Accounting of responses queued to an event loop which writes them
+  // itself. waitOutput() blocks until at most limit bytes are pending, false
+  // if the connection was closed. Responses sent by the worker itself are
+  // never pending here, sendXml() waits for the socket instead.
+  void outputQueued(size_t n);
+  void outputWritten(size_t n);
+  bool waitOutput(size_t limit);
+
+  // extract request id from a complete xml without parsing the rest, -1 on error
+  static int peekID(const std::string& xml);
+
+  // extract the <fname> element (method name or id) the same way, an
+  // element of TypeNone on error
+  static XmlElement peekMethod(const std::string& xml);
+
+  // timeout of the client in ms, -1 if the request carries none
+  static int peekTimeout(const std::string& xml);
+
+  // true if some bytes of an incomplete request are buffered
+  bool hasPartialFrame() const { return !_inbuf.empty(); }
+
+  // true if no worker task holds this connection, owners is the number of
+  // references others keep (the connection table, a shared memory loop)
+  bool idle(int owners = 1) const { return _refs.load(std::memory_order_acquire) <= owners; }
+
+  // readAt is the Tracer::now() the frame was complete at, 0 if tracing is off
+  void getReqXml(std::string&s, uint64* readAt = nullptr) { 
     _readyLock.lock();
     if(!_readyQueue.empty()) {
-      s = std::move(_readyQueue.front());    
+      s = std::move(_readyQueue.front().first);    
+      if(readAt != nullptr)
+        *readAt = _readyQueue.front().second;
       _readyQueue.pop();
     }
     _readyLock.unlock();
   }
+
+  // idle and partial request timers, only touched by the event loop thread
+  TimerWheel::Timer idleTimer;
+  TimerWheel::Timer frameTimer;
   
   // for debug only
 #ifdef DEBUG
@@ -90,25 +282,51 @@ public:
 
 
 private:
-  int _connfd; 
+  ~RPCConnection();
+
+  const int _connfd; 
+  std::atomic<int> _refs;
+  std::atomic<bool> _closed;
   std::string _inbuf;   // store the received data of a single request (encoded)
+  int _passedFd;        // fd received over a unix socket, if any
+  // set once by the event loop on SHM_HELLO while workers may be sending
+  std::atomic<ShmChannel*> _shm;
+  std::mutex _shmLock;    // writers of the ring
+  Reactor* _shmLoop;
+  Reactor* _reactor;
 
   std::mutex _readyLock;
-  std::queue<std::string> _readyQueue;
+  std::queue<std::pair<std::string, uint64> > _readyQueue;
 
   std::mutex _outlock;
   std::condition_variable _cv;   // if worker thread want to send result but find _outbuf is in use, wait on cr
   bool _sending;        // flag to identify whether some worker are sending response.
+  size_t _outBytes;     // queued to the event loop, guarded by _outlock
+  std::condition_variable _drained;
+
+  std::mutex _streamLock;
+  std::map<int, std::shared_ptr<StreamChannel> > _streams;
 
   const RPCServer* const _p_server;
 
-  // parse a receved xml string into a function call request
-  void parse(const std::string& xml, request& pr);  
+  // queue the requests buf completes, bytes of an unfinished one are kept in
+  // _inbuf. True if any got ready.
+  bool _split(const char* buf, size_t len);
+
+  // parse a receved xml string into a function call request, false if it
+  // is malformed. That is answered with a fault unless reply is false.
+  bool parse(const std::string& xml, request& pr, bool reply = true);
+
+  // execute() of a notification, the result is dropped
+  void notify(const std::string& xml, RPCMethod* func);
+
+  static std::string responseHead(int id);
+  // the rest of it, from the result params to the end of the xml
+  static std::string responseBody(const std::vector<XmlElement>& result);
 
-  bool isValid() { return _connfd > -1; }
+  bool isValid() { return !_closed.load(std::memory_order_relaxed); }
 
   void errorHandler(const char* msg, int errcode);
-  void generateErrorResponse(int id);
 };
 
 
@@ -2,15 +2,39 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <memory>
+#include <atomic>
 
 #include "../serialization/serialization.h"
+#include "thpool.h"
+#include "result_cache.h"
+#include "single_flight.h"
+#include "responder.h"
+#include "stream_writer.h"
+#include "stream_reader.h"
+#include "method_stats.h"
 
 namespace simprpc{
 
+class AsyncRPCMethod;
+class StreamingRPCMethod;
+class BidiRPCMethod;
+
 class RPCMethod{
 public:
-  RPCMethod(const std::string&s): _name(s) { }
-  RPCMethod(const char* s): _name(s) { }
+  // Where execute() runs:
+  //  POOL:      the shared worker pool of the server (default)
+  //  INLINE:    directly on the event loop thread that read the request, the
+  //             response is written from there too. Only for cheap methods
+  //             that never block, they stall every connection of the loop.
+  //  DEDICATED: a pool of its own with the given number of threads, so slow
+  //             methods do not hold the shared workers
+  enum Policy { POOL, INLINE, DEDICATED };
+
+  RPCMethod(const std::string&s, Policy policy = POOL, size_t threads = 1): _name(s), _policy(policy),
+    _threads(threads), _priority(ThreadPool::PRIO_NORMAL), _stats(nullptr), _pins(0), _removed(false) { }
+  RPCMethod(const char* s, Policy policy = POOL, size_t threads = 1): _name(s), _policy(policy), _threads(threads),
+    _priority(ThreadPool::PRIO_NORMAL), _stats(nullptr), _pins(0), _removed(false) { }
   virtual ~RPCMethod() = default;
   RPCMethod(const RPCMethod&) = delete;
   RPCMethod& operator=(const RPCMethod&) = delete;
@@ -18,8 +42,107 @@ public:
 
   virtual void execute(const std::vector<XmlElement>& params, std::vector<XmlElement>& result) = 0;
   std::string& getName(){ return _name; }
+  Policy policy() const { return _policy; }
+  size_t dedicatedThreads() const { return _threads; }
+
+  // Queue class of the calls in the worker pool, ThreadPool::PRIO_HIGH for
+  // latency sensitive methods, PRIO_LOW for bulk work. Default PRIO_NORMAL.
+  void setPriority(int prio) { _priority = prio; }
+  int priority() const { return _priority; }
+
+  // Mark the method as a pure function of its parameters. Its responses are
+  // then cached for ttl_ms (0: until evicted) within budget_bytes of memory,
+  // and repeated calls are answered without decoding nor executing them.
+  // Must be called before the method is registered.
+  void enableCache(uint32 ttl_ms, size_t budget_bytes) { _cache.reset(new ResultCache(ttl_ms, budget_bytes)); }
+
+  // nullptr unless enableCache() was called, stats() gives hit/miss counts
+  ResultCache* cache() const { return _cache.get(); }
+
+  // Run identical concurrent calls (same parameters) only once and answer
+  // all of them with that result. Must be called before registration.
+  void enableCoalescing() { _flights.reset(new SingleFlight()); }
+  SingleFlight* flights() const { return _flights.get(); }
+
+  // metrics of the method, set by the server registering it
+  MethodStats* stats() const { return _stats; }
+
+  // non null if the method completes its calls asynchronously
+  virtual AsyncRPCMethod* async() { return nullptr; }
+
+  // non null if the method streams its result in chunks
+  virtual StreamingRPCMethod* streaming() { return nullptr; }
+
+  // non null if the client streams its input to the method
+  virtual BidiRPCMethod* bidi() { return nullptr; }
 private:
+  friend class RPCServer;
+
   std::string _name;
+  Policy _policy;
+  size_t _threads;
+  int _priority;
+  std::unique_ptr<ResultCache> _cache;
+  std::unique_ptr<SingleFlight> _flights;
+  MethodStats* _stats;
+  std::atomic<int> _pins;   // calls dispatched and not done, see RPCServer::removeMethod
+  std::atomic<bool> _removed;   // removeMethod() waits for the last unpin
+};
+
+
+// A method whose calls complete later, for handlers waiting on IO or other
+// services. executeAsync() starts the call and returns, the worker is free
+// again while the responder is pending. Async methods are neither cached nor
+// coalesced, and bulkheads only count the time executeAsync() runs.
+class AsyncRPCMethod : public RPCMethod{
+public:
+  AsyncRPCMethod(const std::string&s, Policy policy = POOL, size_t threads = 1): RPCMethod(s, policy, threads) { }
+  AsyncRPCMethod(const char* s, Policy policy = POOL, size_t threads = 1): RPCMethod(s, policy, threads) { }
+
+  // The deadline of the call is responder->remainingMs(). A responder
+  // dropped without an answer sends a fault. The method must outlive the
+  // work it starts.
+  virtual void executeAsync(const std::vector<XmlElement>& params, ResponderPtr responder) = 0;
+
+  AsyncRPCMethod* async() override { return this; }
+
+  void execute(const std::vector<XmlElement>& params, std::vector<XmlElement>& result) override final { }
+};
+
+
+// A method producing its result piece by piece. stream() writes the chunks
+// as they are ready and the client receives them in order, then the end of
+// the stream. Streaming methods are neither cached nor coalesced and can not
+// be INLINE, write() may wait for the event loop to drain the connection.
+class StreamingRPCMethod : public RPCMethod{
+public:
+  StreamingRPCMethod(const std::string&s, Policy policy = POOL, size_t threads = 1): RPCMethod(s, policy, threads) { }
+  StreamingRPCMethod(const char* s, Policy policy = POOL, size_t threads = 1): RPCMethod(s, policy, threads) { }
+
+  virtual void stream(const std::vector<XmlElement>& params, StreamWriter& out) = 0;
+
+  StreamingRPCMethod* streaming() override { return this; }
+
+  void execute(const std::vector<XmlElement>& params, std::vector<XmlElement>& result) override final { }
+};
+
+
+// A method the client streams to, opened with RPCClient::openStream(). The
+// session reads the client's chunks from in until it closes its side, may
+// write chunks back on out meanwhile, and returns result as the final
+// response. Uploads only read, interactive sessions do both. A session holds
+// its worker until it returns, give such methods a DEDICATED pool.
+class BidiRPCMethod : public RPCMethod{
+public:
+  BidiRPCMethod(const std::string&s, Policy policy = POOL, size_t threads = 1): RPCMethod(s, policy, threads) { }
+  BidiRPCMethod(const char* s, Policy policy = POOL, size_t threads = 1): RPCMethod(s, policy, threads) { }
+
+  virtual void session(const std::vector<XmlElement>& params, StreamReader& in, StreamWriter& out,
+                       std::vector<XmlElement>& result) = 0;
+
+  BidiRPCMethod* bidi() override { return this; }
+
+  void execute(const std::vector<XmlElement>& params, std::vector<XmlElement>& result) override final { }
 };
 
-}
\ No newline at end of file
+}
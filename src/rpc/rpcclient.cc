@@ -1,36 +1,44 @@
 
 #include <iostream>
 #include <string>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
-#include <strings.h>
+#include <errno.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <climits>
 
 #include "rpcclient.h"
 #include "rpc_connection.h"
+#include "transport.h"
+#include "shm_channel.h"
 
 using namespace simprpc;
 
+const int RPCClient::ASYNC_SLICE_MS;
 
-RPCClient::RPCClient(const char* ip, int port):_valid(true), _hasMaster(false), _connfd(-1), _reqID(0) {
-  struct sockaddr_in addr;
-  bzero(&addr, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  inet_pton(AF_INET, ip, &addr.sin_addr);
 
-  int sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
-  if(sockfd < 0 || ::connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+RPCClient::RPCClient(const char* ip, int port):_valid(true), _hasMaster(false), _connfd(-1), _wakefd(-1),
+  _reqID(0), _polling(false), _driverStop(false), _asyncPending(0), _shm(nullptr) {
+  Transport transport(ip, port);
+  int sockfd = transport.connect();
+  if(sockfd < 0){
     _valid = false;
     std::cout << "RPCClient: create socket failed\n";
     return;
   }
   _connfd = sockfd;
   std::cout << "Client connection established!\n";
+
+  if(transport.sharedMemory() && !setupShm()) {
+    std::cout << "RPCClient: shared memory setup failed.\n";
+    close(_connfd);
+    _valid = false;
+    return;
+  }
   
   // set non blocking
   if(fcntl(_connfd, F_SETFL, O_NONBLOCK) < 0) {
@@ -39,6 +47,16 @@ RPCClient::RPCClient(const char* ip, int port):_valid(true), _hasMaster(false),
     _valid = false;
     return;
   }
+  _wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(_wakefd < 0) {
+    std::cout << "RPCClient: create eventfd failed.\n";
+    close(_connfd);
+    _valid = false;
+    return;
+  }
+
+  // a server without method ids is still called by name
+  refreshMethods();
 }
 
 void RPCClient::cleanShutdown() {
@@ -50,18 +68,30 @@ void RPCClient::cleanShutdown() {
   // not send. And _valid = false makes no new respondEvent will be 
   // added into the map
   std::unique_lock<std::mutex> lresp(_respLock);
-  while(1){
-    if(_respMap.empty())
-      break;
-    // when IO thread receive a full xml respond, it always remove it from list 
-    // then wakes up all threads waiting on that cv
-    _respMap.begin()->second->cv.wait(lresp);
+  // the IO thread signals _drainCv whenever it removes a respond from the map
+  while(!_respMap.empty())
+    _drainCv.wait(lresp);
+  // let the IO thread write the notifications still queued
+  while(_driver.joinable() && unsent()) {
+    _driverCv.notify_one();
+    _drainCv.wait_for(lresp, std::chrono::milliseconds(ASYNC_SLICE_MS));
   }
+  _driverStop = true;
+  _driverCv.notify_all();
+  lresp.unlock();
+  if(_driver.joinable())
+    _driver.join();
+
   _reqLock.lock();
   while(!_reqQueue.empty())
     _reqQueue.pop();
   _reqLock.unlock();   
   
+  if(_shm != nullptr) {
+    _shm->close();
+    delete _shm;
+    _shm = nullptr;
+  }
   if(_connfd != -1)
     ::close(_connfd);
   _hasMaster = false;
@@ -72,17 +102,28 @@ void RPCClient::cleanShutdown() {
 
 void RPCClient::dirtyShutdown() {
   _valid = false;
+  std::vector<RespondEvent*> failed;
   _respLock.lock();
-  for(auto it = _respMap.begin(); it != _respMap.end(); it++)
-    it->second->cv.notify_all();
+  for(auto it = _respMap.begin(); it != _respMap.end(); it++) {
+    it->second->active = false;
+    if(it->second->done)
+      failed.push_back(it->second);
+    else
+      it->second->cv.notify_all();
+  }
   _respMap.clear();
+  _asyncPending = 0;
+  _drainCv.notify_all();
   _respLock.unlock();
+  complete(failed);
 
   _reqLock.lock();
   while(!_reqQueue.empty())
     _reqQueue.pop();
   _reqLock.unlock();
 
+  if(_shm != nullptr)   // released by the destructor, senders may still use it
+    _shm->close();
   ::close(_connfd);
   _hasMaster = false;
   _reqID = 0;
@@ -91,35 +132,91 @@ void RPCClient::dirtyShutdown() {
 
 RPCClient::~RPCClient() {
   RPCClient::cleanShutdown();
+  if(_wakefd >= 0)
+    ::close(_wakefd);
 } 
 
 
 bool RPCClient::execute(const std::string& funcName, const std::vector<XmlElement>& params,\
- std::vector<XmlElement>& ret)
+ std::vector<XmlElement>& ret, uint32 timeout_ms)
 {
+  return call(funcName, params, ret, timeout_ms, nullptr);
+}
+
+bool RPCClient::executeStream(const std::string& funcName, const std::vector<XmlElement>& params,
+                              const ChunkHandler& onChunk, uint32 timeout_ms) {
+  std::vector<XmlElement> ret;
+  return call(funcName, params, ret, timeout_ms, &onChunk);
+}
+
+bool RPCClient::executeBatch(const std::vector<BatchCall>& calls, std::vector<BatchResult>& results,
+                             uint32 timeout_ms) {
+  results.clear();
   _idLock.lock();
   int id = _reqID++;
   _idLock.unlock();
 
-  std::string xml = genXml(funcName, params, id);
-  RequestEvent req(&xml, 0);
-  // submit to request list
-  _reqLock.lock();
-  if(! _valid) {
-    _reqLock.unlock();
+  std::string xml(RPCConnection::XML_START);
+  xml += RPCConnection::ID_TAG;
+  xml += XmlElement(id).encode();
+  xml += RPCConnection::ID_ETAG;
+  xml += RPCConnection::BATCH_TAG;
+  if(timeout_ms > 0) {
+    xml += RPCConnection::TIMEOUT_TAG;
+    xml += XmlElement(int(timeout_ms)).encode();
+    xml += RPCConnection::TIMEOUT_ETAG;
+  }
+  for(auto &c : calls) {
+    xml += RPCConnection::CALL_TAG;
+    xml += encodeMethod(c.method);
+    xml += RPCConnection::PARAMS_TAG;
+    for(auto &param : c.params)
+      xml += param.encode();
+    xml += RPCConnection::PARAMS_ETAG;
+    xml += RPCConnection::CALL_ETAG;
+  }
+  xml += RPCConnection::BATCH_ETAG;
+  xml += RPCConnection::XML_END;
+
+  RespondEvent resp;
+  if(!transact(id, std::move(xml), timeout_ms, resp, nullptr))
+    return false;
+  if(!genBatchResult(resp.xml, results) || results.size() != calls.size()) {
+    results.clear();
     return false;
   }
-  _reqQueue.push(req);
-  _reqLock.unlock();
+  return true;
+}
+
+bool RPCClient::call(const std::string& funcName, const std::vector<XmlElement>& params,
+                     std::vector<XmlElement>& ret, uint32 timeout_ms, const ChunkHandler* onChunk) {
+  _idLock.lock();
+  int id = _reqID++;
+  _idLock.unlock();
 
   // generate a RPC respond event
   RespondEvent resp;
+  if(!transact(id, genXml(funcName, params, id, timeout_ms), timeout_ms, resp, onChunk))
+    return false;
+
+  // parse result and return
+  bool ok = genResult(resp.xml, ret);
+  return ok;
+}
+
+bool RPCClient::transact(int id, std::string&& xml, uint32 timeout_ms, RespondEvent& resp,
+                         const ChunkHandler* onChunk) {
+  Deadline deadline = Deadline::max();
+  if(timeout_ms > 0)
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
   std::pair<std::map<int, RespondEvent*>::iterator, bool> r;
 
   // here we must hold lock before check the _valid field, in this
   // case, even if another thread change the _valid state after we
   // check, we can still safely insert into map, since shutdown code
   // need to hold _respLock to check _respMap status.
+  // The event is registered before the request is sent, otherwise the
+  // IO thread may get the response first and drop it.
   _respLock.lock();
   if(! _valid) {
     _respLock.unlock();
@@ -131,6 +228,14 @@ bool RPCClient::execute(const std::string& funcName, const std::vector<XmlElemen
   if(r.second == false) 
     return false;
 
+  if(!submit(std::move(xml))) {
+    _respLock.lock();
+    _respMap.erase(id);
+    _drainCv.notify_all();
+    _respLock.unlock();
+    return false;
+  }
+
   /*
     The working procedure here is as following:
     1. check if response is ready
@@ -151,29 +256,289 @@ bool RPCClient::execute(const std::string& funcName, const std::vector<XmlElemen
   */
   while(_valid) {
     std::unique_lock<std::mutex> lk(_respLock); 
-    if(resp.ready) { // got respond
-      if(!_hasMaster){
-        if(!_respMap.empty())
-          _respMap.begin()->second->cv.notify_all();  // ask other threads to be handle IO
-
-        // TODO:could add some code for closing connection when no job to do for a long time 
-        _recvBuffer.clear();  // since there is no one use this client now
+    if(!resp.chunks.empty()) {
+      // consume them unlocked, meanwhile someone else may read
+      std::deque<std::string> chunks;
+      chunks.swap(resp.chunks);
+      if(!_hasMaster)
+        handOver();
+      lk.unlock();
+      for(auto &chunk : chunks) {
+        std::vector<XmlElement> values;
+        if(onChunk != nullptr && genResult(chunk.substr(RPCConnection::STREAM_TAG.size()), values))
+          (*onChunk)(values);
       }
+      continue;
+    }
+    if(resp.ready) { // got respond
+      // the rest of _recvBuffer may be part of another response, keep it
+      if(!_hasMaster)
+        handOver();   // ask other threads to be handle IO
       break;
     }
+    if(std::chrono::steady_clock::now() >= deadline) {
+      // give up, a late response is dropped as garbage by the IO thread
+      _respMap.erase(id);
+      _drainCv.notify_all();
+      if(!_hasMaster)
+        handOver();
+      return false;
+    }
     if(_hasMaster){ 
-      resp.cv.wait(lk);
+      if(deadline == Deadline::max())
+        resp.cv.wait(lk);
+      else
+        resp.cv.wait_until(lk, deadline);
     }
     else{
       _hasMaster = true;
       lk.unlock();
-      handleIO(id);
+      handleIO(id, deadline);
     }
   }
+  return resp.ready;
+}
 
-  // parse result and return
-  bool ok = genResult(resp.xml, ret);
-  return ok;
+void RPCClient::executeAsync(const std::string& funcName, const std::vector<XmlElement>& params, Callback done,
+                             uint32 timeout_ms) {
+  _idLock.lock();
+  int id = _reqID++;
+  _idLock.unlock();
+
+  RespondEvent* resp = new RespondEvent();
+  resp->done = std::move(done);
+  if(timeout_ms > 0)
+    resp->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  std::string xml = genXml(funcName, params, id, timeout_ms);
+  std::vector<RespondEvent*> failed(1, resp);
+
+  std::unique_lock<std::mutex> lk(_respLock);
+  if(!_valid || !_respMap.insert(std::pair<int, RespondEvent*>{id, resp}).second) {
+    lk.unlock();
+    complete(failed);
+    return;
+  }
+  _asyncPending++;
+  if(!_driver.joinable())
+    _driver = std::thread(&RPCClient::driveAsync, this);
+  lk.unlock();
+
+  if(!submit(std::move(xml))) {
+    // a dirty shutdown may have failed the event already
+    lk.lock();
+    bool mine = _respMap.erase(id) > 0;
+    if(mine) {
+      _asyncPending--;
+      _drainCv.notify_all();
+    }
+    lk.unlock();
+    if(mine)
+      complete(failed);
+    return;
+  }
+  lk.lock();
+  if(!_hasMaster)
+    _driverCv.notify_one();
+}
+
+bool RPCClient::notify(const std::string& funcName, const std::vector<XmlElement>& params) {
+  // no response is matched to it, the id is never looked up
+  if(!submit(genXml(funcName, params, -1, 0, true)))
+    return false;
+  // the IO thread writes it unless a caller is doing the IO already
+  std::lock_guard<std::mutex> lk(_respLock);
+  if(!_driver.joinable())
+    _driver = std::thread(&RPCClient::driveAsync, this);
+  else if(!_hasMaster)
+    _driverCv.notify_one();
+  return true;
+}
+
+std::unique_ptr<ClientStream> RPCClient::openStream(const std::string& funcName,
+                                                   const std::vector<XmlElement>& params, uint32 timeout_ms) {
+  _idLock.lock();
+  int id = _reqID++;
+  _idLock.unlock();
+
+  RespondEvent* resp = new RespondEvent();
+  resp->stream = true;
+  resp->credit = RPCConnection::STREAM_CREDIT;
+  if(timeout_ms > 0)
+    resp->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  std::unique_ptr<ClientStream> stream(new ClientStream(this, id, resp));
+  std::string xml = genXml(funcName, params, id, timeout_ms);
+
+  std::unique_lock<std::mutex> lk(_respLock);
+  if(!_valid || !_respMap.insert(std::pair<int, RespondEvent*>{id, resp}).second) {
+    resp->active = false;
+    return nullptr;
+  }
+  _asyncPending++;
+  if(!_driver.joinable())
+    _driver = std::thread(&RPCClient::driveAsync, this);
+  lk.unlock();
+
+  stream->send(std::move(xml));
+  return stream;
+}
+
+// Reads responses on behalf of async calls whenever no execute() caller
+// does, in slices so that their deadlines are checked and waiting callers
+// get their turn.
+void RPCClient::driveAsync() {
+  std::unique_lock<std::mutex> lk(_respLock);
+  while(!_driverStop) {
+    std::vector<RespondEvent*> expired;
+    bool erased = false;
+    auto now = std::chrono::steady_clock::now();
+    for(auto it = _respMap.begin(); _asyncPending > 0 && it != _respMap.end(); ) {
+      RespondEvent* e = it->second;
+      if((e->done || e->stream) && now >= e->deadline) {
+        // streams are owned by their ClientStream, only wake it up
+        if(e->done)
+          expired.push_back(e);
+        e->active = false;
+        e->cv.notify_all();
+        it = _respMap.erase(it);
+        _asyncPending--;
+        erased = true;
+      }
+      else
+        ++it;
+    }
+    if(erased) {
+      _drainCv.notify_all();
+      lk.unlock();
+      complete(expired);
+      lk.lock();
+      continue;
+    }
+
+    if(_asyncPending == 0 && !unsent())
+      _driverCv.wait(lk);
+    else if(_hasMaster)
+      _driverCv.wait_for(lk, std::chrono::milliseconds(ASYNC_SLICE_MS));
+    else {
+      _hasMaster = true;
+      lk.unlock();
+      handleIO(-1, now + std::chrono::milliseconds(ASYNC_SLICE_MS));
+      lk.lock();
+      if(!_hasMaster)
+        handOver();
+    }
+  }
+}
+
+void RPCClient::handOver() {
+  if(!_respMap.empty())
+    _respMap.begin()->second->cv.notify_all();
+  if(_asyncPending > 0 || unsent())
+    _driverCv.notify_one();
+}
+
+void RPCClient::complete(std::vector<RespondEvent*>& events) {
+  for(auto e : events) {
+    std::vector<XmlElement> ret;
+    bool ok = e->ready && genResult(e->xml, ret);
+    e->done(ok, ret);
+    delete e;
+  }
+  events.clear();
+}
+
+// submit to request list, or straight into the ring of a shared memory
+// channel which needs no IO thread to be sent
+bool RPCClient::submit(std::string&& xml) {
+  _reqLock.lock();
+  bool queued = _valid;
+  if(queued && _shm != nullptr)
+    queued = _shm->write(xml.c_str(), xml.size()) == int(xml.size());
+  else if(queued)
+    _reqQueue.push(RequestEvent(std::move(xml), 0));
+  _reqLock.unlock();
+  // pairs with the check of unsent() in waitIO()
+  if(queued && _shm == nullptr && _polling.load()) {
+    uint64 one = 1;
+    if(write(_wakefd, &one, sizeof(one)) < 0)
+      std::cout << "RPCClient: waking IO thread failed: " << errno << std::endl;
+  }
+  return queued;
+}
+
+bool RPCClient::unsent() {
+  std::lock_guard<std::mutex> lk(_reqLock);
+  return !_reqQueue.empty();
+}
+
+bool RPCClient::refreshMethods() {
+  std::vector<XmlElement> ret;
+  if(!execute(RPCConnection::METHODS_CALL, std::vector<XmlElement>(), ret))
+    return false;
+  std::map<std::string, int> ids;
+  for(size_t i = 0; i + 1 < ret.size(); i += 2) {
+    if(ret[i].istype(TypeString) && ret[i + 1].istype(TypeInt))
+      ids[*((std::string*)ret[i].getdata())] = *((int*)ret[i + 1].getdata());
+  }
+  _methodLock.lock();
+  _methodIds.swap(ids);
+  _methodLock.unlock();
+  return true;
+}
+
+// Hand the memfd of a new channel to the server together with SHM_HELLO and
+// wait for the echo, the socket is still blocking at this point.
+bool RPCClient::setupShm() {
+  ShmChannel* shm = ShmChannel::create();
+  if(shm == nullptr)
+    return false;
+
+  const std::string& hello = RPCConnection::SHM_HELLO;
+  struct iovec iov;
+  iov.iov_base = (void*)hello.c_str();
+  iov.iov_len = hello.size();
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  memset(cbuf, 0, sizeof(cbuf));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  int memfd = shm->fd();
+  memcpy(CMSG_DATA(cm), &memfd, sizeof(int));
+
+  if(sendmsg(_connfd, &msg, MSG_NOSIGNAL) != int(hello.size())) {
+    delete shm;
+    return false;
+  }
+
+  std::string ack;
+  char buf[64];
+  while(ack.size() < hello.size()) {
+    int n = read(_connfd, buf, std::min(sizeof(buf), hello.size() - ack.size()));
+    if(n <= 0) {
+      delete shm;
+      return false;
+    }
+    ack.append(buf, n);
+  }
+  if(ack != hello) {
+    delete shm;
+    return false;
+  }
+  _shm = shm;
+  return true;
+}
+
+// the socket of a shared memory channel carries no data, only its EOF
+bool RPCClient::peerClosed() {
+  char c;
+  int n = recv(_connfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
 }
 
 int RPCClient::parseID(std::string& xml) {
@@ -189,11 +554,41 @@ int RPCClient::parseID(std::string& xml) {
 }
 
 
+// Instead of spinning on EAGAIN the IO thread sleeps in poll() until there
+// is something to do. A request queued meanwhile by another thread wakes it
+// through _wakefd, unless it is already seen by the check of unsent().
+void RPCClient::waitIO(bool writing, const Deadline& deadline) {
+  _polling.store(true);
+  if(!writing && unsent()) {
+    _polling.store(false);
+    return;
+  }
+  int timeout = -1;
+  if(deadline != Deadline::max()) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    // round up, poll() would return a little early and leave us spinning
+    timeout = int(std::max<int64_t>(0, std::min<int64_t>(left.count() + 1, INT_MAX)));
+  }
+  struct pollfd fds[2];
+  fds[0].fd = _connfd;
+  fds[0].events = POLLIN | (writing ? POLLOUT : 0);
+  fds[1].fd = _wakefd;
+  fds[1].events = POLLIN;
+  // errors and a closed socket are seen by the next read()
+  if(poll(fds, 2, timeout) > 0 && (fds[1].revents & POLLIN)) {
+    uint64 n;
+    if(read(_wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      std::cout << "RPCClient: reading eventfd failed: " << errno << std::endl;
+  }
+  _polling.store(false);
+}
+
+
 /*
   1. 由于是非阻塞写，对于一次写不完的情况，需要设置一个指针指向可写的位置, req的数据结果需要修改
   2. 当接受xml完毕，解析到id后，先从_respMap中移除，然后判断是否是自己以及唤醒，注意要wakeu all
 */
-void RPCClient::handleIO(int myid) {
+void RPCClient::handleIO(int myid, const Deadline& deadline) {
 
   const int bufsz = 4096;
   char buf[bufsz];
@@ -207,14 +602,16 @@ void RPCClient::handleIO(int myid) {
       p = &_reqQueue.front();
     }
     _reqLock.unlock();
+    bool blocked = false;   // the socket takes no more for now
     if(p) {
       
       while(1) {
-        int n = write(_connfd, p->xml->c_str(), p->xml->size() - p->offset);
+        int n = write(_connfd, p->xml.c_str() + p->offset, p->xml.size() - p->offset);
         if(n < 0) {
           if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            std::cout << " send later\n";
-            continue;
+            // read meanwhile, the server may wait for us to take responses
+            blocked = true;
+            break;
           }
           std::cout << "RPCClient: sending error: " << errno << std::endl;
           RPCClient::dirtyShutdown();
@@ -222,7 +619,7 @@ void RPCClient::handleIO(int myid) {
         }
         else {
           p->offset += n;
-          if(p->offset == p->xml->size()) {
+          if(p->offset == p->xml.size()) {
             _reqLock.lock();
             _reqQueue.pop();
             _reqLock.unlock();
@@ -234,10 +631,33 @@ void RPCClient::handleIO(int myid) {
     } // end writing
 
 
+    // hand the IO over once our own request timed out, the next waiter
+    // takes over as master
+    if(std::chrono::steady_clock::now() >= deadline) {
+      _respLock.lock();
+      _hasMaster = false;
+      _respLock.unlock();
+      return;
+    }
+
     // Reading
-    int n = read(_connfd, buf, bufsz - 1);
+    int n;
+    if(_shm != nullptr) {
+      n = _shm->read(buf, bufsz - 1, SHM_POLL_MS);
+      if(n == 0) {
+        if(peerClosed()) {
+          std::cout << "RPCClient: remote close connection!\n";
+          RPCClient::dirtyShutdown();
+          return;
+        }
+        continue;
+      }
+    }
+    else
+      n = read(_connfd, buf, bufsz - 1);
     if(n < 0) {
-      if(errno == EAGAIN || errno == EWOULDBLOCK){
+      if(_shm == nullptr && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        waitIO(blocked, deadline);
         continue;
       }
       std::cout << "RPCClient reading error: " << errno << std::endl;
@@ -250,8 +670,7 @@ void RPCClient::handleIO(int myid) {
       return; // no need to wait rest 
     }
     else{
-      buf[n] = 0;
-      _recvBuffer += buf;
+      _recvBuffer.append(buf, n);
       std::vector<std::string> ready_xmls;
 
       size_t pos = 0;
@@ -263,7 +682,11 @@ void RPCClient::handleIO(int myid) {
 
       if(pos > 0)   // must received complete messages
       { 
+        // trimmed while still master, another thread may take over as soon
+        // as _hasMaster is cleared below
+        _recvBuffer.erase(0, pos);
         bool find_my_expect = false;  // whether contain respond current thread waiting for
+        std::vector<RespondEvent*> finished;   // async ones, completed after unlocking
         _respLock.lock();
         for(auto &str : ready_xmls) {
           std::cout << "Get a complete response.\n";
@@ -272,11 +695,42 @@ void RPCClient::handleIO(int myid) {
           auto it = _respMap.find(id);
           if(it == _respMap.end()) {  // garbage
             continue;
+          } else if(str.compare(0, RPCConnection::WINDOW_TAG.size(), RPCConnection::WINDOW_TAG) == 0) {
+            // the session of a stream returned credit
+            size_t offset = RPCConnection::WINDOW_TAG.size();
+            XmlElement n;
+            if(n.decode(str, &offset) && n.istype(TypeInt)) {
+              it->second->credit += *((int*)n.getdata());
+              it->second->cv.notify_all();
+            }
+          } else if(str.compare(0, RPCConnection::STREAM_TAG.size(), RPCConnection::STREAM_TAG) == 0) {
+            // a chunk of a streamed result, the event stays until the end
+            RespondEvent* pResp = it->second;
+            if(pResp->done)
+              continue;
+            pResp->chunks.push_back(std::move(str));
+            if(id == myid) {
+              find_my_expect = true;
+              _hasMaster = false;
+            }
+            pResp->cv.notify_all();
           } else{
             RespondEvent* pResp = it->second;
             _respMap.erase(it);
+            _drainCv.notify_all();
             pResp->ready = true;
             pResp->xml = std::move(str);
+            if(pResp->done) {
+              _asyncPending--;
+              finished.push_back(pResp);
+              continue;
+            }
+            if(pResp->stream) {
+              _asyncPending--;
+              pResp->active = false;
+              pResp->cv.notify_all();
+              continue;
+            }
             if(id == myid) {
               find_my_expect = true;
               _hasMaster = false;
@@ -285,7 +739,7 @@ void RPCClient::handleIO(int myid) {
           }
         }
         _respLock.unlock();
-        _recvBuffer = _recvBuffer.substr(pos);
+        complete(finished);
         if(find_my_expect)
           break;
       }
@@ -308,17 +762,67 @@ bool RPCClient::genResult(const std::string& remain_xml, std::vector<XmlElement>
   return true;
 }
 
-std::string RPCClient::genXml(const std::string& fname, const std::vector<XmlElement>& params, int id) {
+bool RPCClient::genBatchResult(const std::string& remain_xml, std::vector<BatchResult>& results) {
+  if(remain_xml.compare(0, RPCConnection::BATCH_TAG.size(), RPCConnection::BATCH_TAG) != 0)
+    return false;
+  size_t offset = RPCConnection::BATCH_TAG.size();
+  while(1) {
+    BatchResult r;
+    r.ok = remain_xml.compare(offset, RPCConnection::PARAMS_TAG.size(), RPCConnection::PARAMS_TAG) == 0;
+    const std::string& etag = r.ok ? RPCConnection::PARAMS_ETAG : RPCConnection::FAULT_ETAG;
+    if(r.ok)
+      offset += RPCConnection::PARAMS_TAG.size();
+    else if(remain_xml.compare(offset, RPCConnection::FAULT_TAG.size(), RPCConnection::FAULT_TAG) == 0)
+      offset += RPCConnection::FAULT_TAG.size();
+    else
+      break;
+
+    XmlElement ele;
+    while(ele.decode(remain_xml, &offset)) {
+      if(r.ok)
+        r.values.emplace_back(std::move(ele));
+      else if(ele.istype(TypeString))
+        r.fault = *((std::string*)ele.getdata());
+    }
+    offset = remain_xml.find(etag, offset);
+    if(offset == std::string::npos)
+      return false;
+    offset += etag.size();
+    results.push_back(std::move(r));
+  }
+  return remain_xml.compare(offset, RPCConnection::BATCH_ETAG.size(), RPCConnection::BATCH_ETAG) == 0;
+}
+
+std::string RPCClient::encodeMethod(const std::string& fname) {
+  std::string xml(RPCConnection::FNAME_TAG);
+  _methodLock.lock();
+  auto it = _methodIds.find(fname);
+  XmlElement funName = it != _methodIds.end() ? XmlElement(it->second) : XmlElement(fname);
+  _methodLock.unlock();
+  xml += funName.encode();
+  xml += RPCConnection::FNAME_ETAG;
+  return xml;
+}
+
+std::string RPCClient::genXml(const std::string& fname, const std::vector<XmlElement>& params, int id,
+                              uint32 timeout_ms, bool oneway) {
   std::string xml(RPCConnection::XML_START);
   xml += RPCConnection::ID_TAG;
   XmlElement ele(id);
   xml += ele.encode();
   xml += RPCConnection::ID_ETAG;
+  if(oneway) {
+    xml += RPCConnection::ONEWAY_TAG;
+    xml += RPCConnection::ONEWAY_ETAG;
+  }
 
-  xml += RPCConnection::FNAME_TAG;
-  XmlElement funName(fname);
-  xml += funName.encode();
-  xml += RPCConnection::FNAME_ETAG;
+  xml += encodeMethod(fname);
+
+  if(timeout_ms > 0) {
+    xml += RPCConnection::TIMEOUT_TAG;
+    xml += XmlElement(int(timeout_ms)).encode();
+    xml += RPCConnection::TIMEOUT_ETAG;
+  }
 
   xml += RPCConnection::PARAMS_TAG;
   for(auto &param : params)
@@ -328,3 +832,80 @@ std::string RPCClient::genXml(const std::string& fname, const std::vector<XmlEle
   xml += RPCConnection::XML_END;
   return xml;
 }
+
+
+/* ========= ClientStream ========= */
+
+ClientStream::~ClientStream() {
+  closeWrite();
+  std::lock_guard<std::mutex> lk(_client->_respLock);
+  if(_event->active) {
+    _client->_respMap.erase(_id);
+    _client->_asyncPending--;
+    _client->_drainCv.notify_all();
+  }
+}
+
+void ClientStream::send(std::string&& xml) {
+  if(!_client->submit(std::move(xml)))
+    return;
+  std::lock_guard<std::mutex> lk(_client->_respLock);
+  if(!_client->_hasMaster)
+    _client->_driverCv.notify_one();
+}
+
+bool ClientStream::write(const std::vector<XmlElement>& chunk) {
+  {
+    std::unique_lock<std::mutex> lk(_client->_respLock);
+    while(_event->active && _event->credit <= 0)
+      _event->cv.wait(lk);
+    if(!_event->active || _writeClosed)
+      return false;
+    _event->credit--;
+  }
+  send(RPCConnection::chunkFrame(_id, chunk));
+  return true;
+}
+
+void ClientStream::closeWrite() {
+  if(_writeClosed)
+    return;
+  _writeClosed = true;
+  bool active;
+  {
+    std::lock_guard<std::mutex> lk(_client->_respLock);
+    active = _event->active;
+  }
+  if(active)
+    send(RPCConnection::endFrame(_id));
+}
+
+bool ClientStream::read(std::vector<XmlElement>& chunk) {
+  std::string frame;
+  int grant = 0;
+  {
+    std::unique_lock<std::mutex> lk(_client->_respLock);
+    while(_event->active && _event->chunks.empty())
+      _event->cv.wait(lk);
+    if(_event->chunks.empty())
+      return false;
+    frame = std::move(_event->chunks.front());
+    _event->chunks.pop_front();
+    if(++_consumed >= RPCConnection::STREAM_CREDIT / 2 && _event->active) {
+      grant = _consumed;
+      _consumed = 0;
+    }
+  }
+  if(grant > 0)
+    send(RPCConnection::windowFrame(_id, grant));
+  return RPCConnection::decodeChunk(frame, chunk);
+}
+
+bool ClientStream::finish(std::vector<XmlElement>& result) {
+  closeWrite();
+  std::vector<XmlElement> chunk;
+  while(read(chunk))
+    chunk.clear();
+  std::lock_guard<std::mutex> lk(_client->_respLock);
+  return _event->ready && _client->genResult(_event->xml, result);
+}
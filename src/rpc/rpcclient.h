@@ -5,29 +5,109 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
 #include <map>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <memory>
+#include <atomic>
 
 #include "../serialization/serialization.h"
 
 namespace simprpc{
 
+class ShmChannel;
+class ClientStream;
+struct CallAwaiter;
+
 // support multi-thread sending request with same client instance
 class RPCClient{
 public:
+  // ip may also be a "unix:/path" address, see Transport
   RPCClient(const char*ip, int port);
   ~RPCClient();
 
-  bool execute(const std::string& funcName, const std::vector<XmlElement>& params, std::vector<XmlElement>& ret);
+  // timeout_ms bounds the wait for the response (0: wait forever) and is
+  // sent along, the server drops the request once it passed and methods can
+  // read what is left with CallContext::remainingMs()
+  bool execute(const std::string& funcName, const std::vector<XmlElement>& params, std::vector<XmlElement>& ret,
+               uint32 timeout_ms = 0);
+
+  // Call a StreamingRPCMethod. onChunk gets every chunk of the result in
+  // order on the calling thread, the call returns true once the stream ended
+  // normally. timeout_ms bounds the whole stream.
+  typedef std::function<void(std::vector<XmlElement>& chunk)> ChunkHandler;
+  bool executeStream(const std::string& funcName, const std::vector<XmlElement>& params,
+                     const ChunkHandler& onChunk, uint32 timeout_ms = 0);
+
+  // Open a stream to a BidiRPCMethod, nullptr if the request could not be
+  // sent. See ClientStream, it must be destroyed before the client.
+  std::unique_ptr<ClientStream> openStream(const std::string& funcName, const std::vector<XmlElement>& params,
+                                           uint32 timeout_ms = 0);
+
+  // Completion of executeAsync(): ok and the result, as execute() returns them.
+  // It runs on whatever thread received the response (a caller of execute()
+  // handling IO or the client's IO thread), so it must not block nor destroy
+  // the client.
+  typedef std::function<void(bool ok, std::vector<XmlElement>& ret)> Callback;
+
+  // Send a request without waiting for it. An IO thread of the client is
+  // started on first use and reads responses while async calls are pending
+  // and no execute() caller does. timeout_ms fails the call once passed.
+  void executeAsync(const std::string& funcName, const std::vector<XmlElement>& params, Callback done,
+                    uint32 timeout_ms = 0);
+
+  // Send a call nobody waits for, the server runs it without answering.
+  // Returns once the request is queued, false if the client is not
+  // connected. Errors of the call are not reported. Queued notifications
+  // are still sent when the client is destroyed.
+  bool notify(const std::string& funcName, const std::vector<XmlElement>& params);
+
+  // One entry of executeBatch() and its outcome. fault is the reason the
+  // server gave when ok is false.
+  struct BatchCall{
+    std::string method;
+    std::vector<XmlElement> params;
+  };
+  struct BatchResult{
+    bool ok;
+    std::vector<XmlElement> values;
+    std::string fault;
+  };
+
+  // Send several calls in one request. The server runs them in parallel and
+  // answers all of them at once, results[i] is the outcome of calls[i].
+  // Async, streaming and bidi methods can not be batched. Returns false if
+  // no response arrived, results is empty then.
+  bool executeBatch(const std::vector<BatchCall>& calls, std::vector<BatchResult>& results,
+                    uint32 timeout_ms = 0);
+
+#if __cplusplus >= 202002L
+  // co_await form of executeAsync(), defined in coro.h. The request is sent
+  // right away, several calls can be in flight before awaiting them.
+  CallAwaiter call(const std::string& funcName, const std::vector<XmlElement>& params, uint32 timeout_ms = 0);
+#endif
+
+  // Fetch the method ids of the server (RPCConnection::METHODS_CALL), later
+  // calls of known methods send the id instead of the name. Done once by the
+  // constructor, call again after the server registered new methods.
+  bool refreshMethods();
 
 protected:
+  friend class ClientStream;
+
   bool _valid;    // whether this client instance is valid
   // TODO: In current implementation, we have to mege masterlock and respndLock into one
   // otherwise thread may find job not done and has master then fall asleep but other thread
   // has just got all respond and give up master. We cannot sleep on two locks!
   bool _hasMaster; // whether there is a thread handling io for this instance
   int _connfd;  // socket connection to remote server
+  int _wakefd;  // eventfd, wakes the IO thread waiting in waitIO()
   int _reqID;
 
+  typedef std::chrono::steady_clock::time_point Deadline;  // max() for none
+
   std::mutex _idLock; // a lock used for alocate request id;
   // std::mutex _masterLock;
   std::condition_variable _cv;
@@ -38,32 +118,124 @@ protected:
     std::mutex lock;
     std::condition_variable cv;
     std::string xml;
-
-    RespondEvent(): ready(false) {} 
+    Callback done;        // set for async calls, nobody waits on cv then
+    std::deque<std::string> chunks;   // of a streamed result, not consumed yet
+    Deadline deadline;
+    // of a ClientStream: read by the IO thread like async calls, active
+    // while in _respMap, credit is the chunks it may still send
+    bool stream;
+    bool active;
+    int credit;
+
+    RespondEvent(): ready(false), deadline(Deadline::max()), stream(false), active(true), credit(0) {} 
   };
 
+  // owns its xml, a caller may time out while its request is still queued
   struct RequestEvent {
-    const std::string *xml;
+    std::string xml;
     size_t offset;
 
-    RequestEvent(const std::string* p, size_t off): xml(p), offset(off) { }
+    RequestEvent(std::string&& s, size_t off): xml(std::move(s)), offset(off) { }
   };
 
   std::mutex _reqLock;
   std::queue<RequestEvent> _reqQueue;
+  std::atomic<bool> _polling;   // the IO thread waits in waitIO(), submit() wakes it
   std::string _recvBuffer;
   std::mutex _respLock;
   std::map<int, RespondEvent*> _respMap;
+  std::condition_variable _drainCv;   // signaled whenever _respMap shrinks
+
+  // IO thread of async calls, guarded by _respLock
+  static const int ASYNC_SLICE_MS = 10;   // how often it checks their deadlines
+  std::thread _driver;
+  std::condition_variable _driverCv;
+  bool _driverStop;
+  int _asyncPending;    // async events in _respMap
+
+  std::mutex _methodLock;
+  std::map<std::string, int> _methodIds;
+
+  // set for "shm:" addresses, requests are written to it under _reqLock
+  ShmChannel* _shm;
+  static const int SHM_POLL_MS = 100;   // how often a waiting reader checks the socket
 
   // int buildConnection();
   int parseID(std::string& xml);
-  void handleIO(int myid);    // myid represent the reqeust id that the working thread hold
-  std::string genXml(const std::string& fname, const std::vector<XmlElement>& params, int id);
+  bool setupShm();
+  bool peerClosed();
+  // myid represent the reqeust id that the working thread hold, returns
+  // early once deadline passed
+  void handleIO(int myid, const Deadline& deadline);
+  // block until the socket is readable (or writable if writing), a request
+  // is queued or deadline passed
+  void waitIO(bool writing, const Deadline& deadline);
+  std::string genXml(const std::string& fname, const std::vector<XmlElement>& params, int id, uint32 timeout_ms = 0,
+                     bool oneway = false);
   bool genResult(const std::string& reamin_xml, std::vector<XmlElement>& ret); 
+  bool genBatchResult(const std::string& remain_xml, std::vector<BatchResult>& results);
+  // <fname> element of a request, the method id if it is known
+  std::string encodeMethod(const std::string& fname);
+  bool call(const std::string& funcName, const std::vector<XmlElement>& params, std::vector<XmlElement>& ret,
+            uint32 timeout_ms, const ChunkHandler* onChunk);
+  // send xml as request id and wait for its response in resp, false if
+  // none arrived
+  bool transact(int id, std::string&& xml, uint32 timeout_ms, RespondEvent& resp, const ChunkHandler* onChunk);
+  bool submit(std::string&& xml);
+  bool unsent();    // requests are waiting in _reqQueue
+  void driveAsync();
+  // let another thread take over the IO, called with _respLock held
+  void handOver();
+  // run and free finished async events, without holding _respLock
+  void complete(std::vector<RespondEvent*>& events);
 
   void cleanShutdown();  // close connection
   void dirtyShutdown();  // directly clear all events and set _valid to be false
 };
 
 
-}
\ No newline at end of file
+/*
+  Client side of a stream to a BidiRPCMethod, multiplexed with other calls
+  on the client's connection under the id of its request.
+
+  write() sends a chunk once the server granted credit for it, at most
+  RPCConnection::STREAM_CREDIT chunks are unread by the session at a time.
+  Chunks the session writes back are read with read(), credit is returned
+  to it while doing so. One thread may write while another reads.
+*/
+class ClientStream{
+public:
+  ~ClientStream();
+  ClientStream(const ClientStream&) = delete;
+  ClientStream& operator=(const ClientStream&) = delete;
+
+  // false if the call is over (answered, timed out or connection lost)
+  bool write(const std::vector<XmlElement>& chunk);
+
+  // no more chunks from this side, the session's reads then return false
+  void closeWrite();
+
+  // next chunk from the session, false once the call is over and all its
+  // chunks were read
+  bool read(std::vector<XmlElement>& chunk);
+
+  // close the writing side, drop unread chunks and wait for the final
+  // response, true with its result if the session succeeded
+  bool finish(std::vector<XmlElement>& result);
+
+private:
+  friend class RPCClient;
+  ClientStream(RPCClient* client, int id, RPCClient::RespondEvent* event): _client(client), _id(id),
+    _event(event), _writeClosed(false), _consumed(0) { }
+
+  // queue a frame for sending and make sure some thread is doing the IO
+  void send(std::string&& xml);
+
+  RPCClient* _client;
+  const int _id;
+  std::unique_ptr<RPCClient::RespondEvent> _event;
+  bool _writeClosed;
+  int _consumed;    // chunks read since credit was last returned
+};
+
+}
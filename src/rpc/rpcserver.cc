@@ -4,207 +4,630 @@
 #include <vector>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <strings.h>
-#include <sys/epoll.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
-#include <cmath>
+#include <sys/resource.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 
 #include "rpcserver.h"
 #include "rpc_method.h"
 #include "rpc_connection.h"
+#include "reactor.h"
+#include "rcu.h"
 
 using namespace simprpc;
 
 
 // this function specify the working thread job, which is parsing xml, execute command
-// and send response back to client
-void th_work(RPCConnection* pc, const std::string xml) {
-  pc->execute(xml);
+// and send response back to client. The task holds a reference of pc which
+// is dropped once the response has been sent, the pin of method is left to
+// the caller.
+static void run_work(RPCConnection* pc, RPCMethod* method, const std::string& xml,
+    const RPCConnection::RequestState& state, uint64 deadline, uint64 enqueued, Tracer::Span* span) {
+  if(state) {
+    int expected = RPCConnection::REQ_QUEUED;
+    if(!state->phase.compare_exchange_strong(expected, RPCConnection::REQ_RUNNING)) {
+      // already answered by the deadline timer, which also took our reference
+      Tracer::discard(span);
+      return;
+    }
+    state->loop->disarm(state);
+  }
+  pc->execute(xml, method, deadline, enqueued, span);
+  Tracer::finish(span);
+  pc->unref();
 }
 
+void th_work(RPCConnection* pc, RPCMethod* method, const std::string xml, RPCConnection::RequestState state,
+    uint64 deadline, uint64 enqueued, Tracer::Span* span) {
+  run_work(pc, method, xml, state, deadline, enqueued, span);
+  RPCServer::unpin(method);
+}
 
-static int set_nonblock(int fd) {
-  int old = fcntl(fd, F_GETFL);
-  if(fcntl(fd, F_SETFL, old | O_NONBLOCK) < 0) {
-    std::cout << "set non-block failed.\n";
-    exit(EXIT_FAILURE);
-  }
-  return old;
+// th_work of a method behind a bulkhead, once done the slot is handed to the
+// next call waiting in it
+void th_limited_work(Bulkhead* bulkhead, RPCConnection* pc, RPCMethod* method, const std::string xml,
+    RPCConnection::RequestState state, uint64 deadline, uint64 enqueued, Tracer::Span* span) {
+  run_work(pc, method, xml, state, deadline, enqueued, span);
+  Bulkhead::Call next;
+  if(bulkhead->leave(next))
+    next();
+  // the bulkhead is freed with the method
+  RPCServer::unpin(method);
 }
 
 
-/* ========= RPCServer ========= */
+// Responses of the entries of one batch request, filled in by the workers
+// running them. The last one done sends the batch response and frees it.
+struct BatchResponse{
+  RPCConnection* pc;    // referenced until the response is sent
+  int id;
+  std::vector<std::string> bodies;
+  std::atomic<size_t> remaining;
 
-RPCServer::RPCServer(const char* ip, int port, size_t thpoll_sz, size_t bucksz):  _connectionManager(bucksz), _thpool(thpoll_sz){
-  // initialize threadpoll
-  _thpool.init();
+  BatchResponse(RPCConnection* c, int i, size_t n): pc(c), id(i), bodies(n), remaining(n) { }
 
-  // initialize listenfd
-  struct sockaddr_in saddr;
-  bzero(&saddr, sizeof(saddr));
-  saddr.sin_family = AF_INET;
-  saddr.sin_port = htons(port);
-  inet_pton(AF_INET, ip, &saddr.sin_addr);
+  void done(size_t i, std::string&& body) {
+    bodies[i] = std::move(body);
+    if(remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      send();
+  }
 
-  _listenfd = socket(PF_INET, SOCK_STREAM, 0);
-  if(_listenfd < 0){
-    std::cout << "Error creating socket.\n";
-    exit(EXIT_FAILURE);
+  void send() {
+    pc->sendXml(RPCConnection::batchFrame(id, bodies));
+    pc->unref();
+    delete this;
   }
+};
+
+void th_batch_work(BatchResponse* batch, size_t i, RPCMethod* method, const std::string entry, uint64 deadline,
+    uint64 enqueued) {
+  std::string out;
+  batch->pc->executeEntry(entry, method, out, deadline, enqueued);
+  batch->done(i, std::move(out));
+  RPCServer::unpin(method);
+}
 
-  if(bind(_listenfd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
-    std::cout << "Error binding.\n";
-    exit(EXIT_FAILURE);
+void th_limited_batch_work(Bulkhead* bulkhead, BatchResponse* batch, size_t i, RPCMethod* method,
+    const std::string entry, uint64 deadline, uint64 enqueued) {
+  std::string out;
+  batch->pc->executeEntry(entry, method, out, deadline, enqueued);
+  batch->done(i, std::move(out));
+  Bulkhead::Call next;
+  if(bulkhead->leave(next))
+    next();
+  RPCServer::unpin(method);
+}
+
+
+// answers RPCConnection::METHODS_CALL, cheap enough to run inline
+class MethodListMethod : public RPCMethod{
+public:
+  MethodListMethod(const RPCServer* server): RPCMethod(RPCConnection::METHODS_CALL, RPCMethod::INLINE),
+    _server(server) { }
+
+  void execute(const std::vector<XmlElement>& params, std::vector<XmlElement>& result) override {
+    _server->listMethods(result);
   }
 
-  if(listen(_listenfd, 10) < 0) {
-    std::cout << "Error listening.\n";
-    exit(EXIT_FAILURE);
+private:
+  const RPCServer* _server;
+};
+
+// answers RPCConnection::STATS_CALL, snapshots every histogram so it runs in
+// the pool
+class StatsMethod : public RPCMethod{
+public:
+  StatsMethod(const RPCServer* server): RPCMethod(RPCConnection::STATS_CALL), _server(server) { }
+
+  void execute(const std::vector<XmlElement>& params, std::vector<XmlElement>& result) override {
+    if(!params.empty() && params[0].istype(TypeString) && *((std::string*)params[0].getdata()) == "prometheus") {
+      std::string text;
+      _server->dumpMetrics(text);
+      result.emplace_back(text);
+      return;
+    }
+    std::vector<std::pair<std::string, double> > values;
+    _server->metricsValues(values);
+    for(auto &v : values) {
+      result.emplace_back(v.first);
+      result.emplace_back(v.second);
+    }
   }
 
+private:
+  const RPCServer* _server;
+};
+
+
+/* ========= RPCServer ========= */
+
+RPCServer::RPCServer(const char* ip, int port, size_t thpoll_sz, Reactor::Backend backend): _table(new MethodTable()),
+  _bytesIn(_metrics.counter("simprpc_bytes_in_total")), _bytesOut(_metrics.counter("simprpc_bytes_out_total")),
+  _overloaded(_metrics.counter("simprpc_overloaded_total")),
+  _thpool(thpoll_sz), _transport(ip, port), _backend(backend), _reactorCount(1), _backlog(SOMAXCONN), _idleTimeout(0),
+  _frameTimeout(0), _requestTimeout(0), _shmThreads(0) {
+  // initialize threadpoll
+  _thpool.init();
+
+  if(!_transport.valid())
+    exit(EXIT_FAILURE);
+
+  _metrics.gauge("simprpc_connections", "", [this] { return int64(_connectionManager.count()); });
+  _metrics.gauge("simprpc_queue_depth", "", [this] { return int64(_thpool.pending()); });
+  // queue waits of the shared pool by priority class, they also drive the
+  // admission control (a no-op while it is disabled)
+  const char* classes[ThreadPool::PRIO_CLASSES] = { "high", "normal", "low" };
+  for(int i = 0; i < ThreadPool::PRIO_CLASSES; i++)
+    _classWait[i] = &_metrics.histogram("simprpc_class_queue_wait_seconds", std::string("class=\"") + classes[i] + "\"");
+  _thpool.setWaitObserver([this](int prio, uint64_t wait_us) {
+    _classWait[prio]->record(wait_us);
+    _admission.observe(wait_us);
+  });
+
+  _methodsCall.reset(new MethodListMethod(this));
+  registMethod(_methodsCall.get());
+  _statsCall.reset(new StatsMethod(this));
+  registMethod(_statsCall.get());
 }
 
 RPCServer::~RPCServer() {
-  _methodMap.clear();
   _connectionManager.shutdown();
+  while(_shmThreads.load() > 0)   // closing the connections ends their loops
+    std::this_thread::yield();
   _thpool.shutdown();
+  for(auto &pool : _dedicatedPools)
+    pool->shutdown();
+  _transport.unlink();
+  delete _table.load();
 }
 
-bool RPCServer::registMethod(RPCMethod* method) {
+bool RPCServer::registMethod(RPCMethod* method, size_t maxRunning, size_t maxQueued) {
   std::string mname = method->getName();
   std::cout << "Register method: " << mname;
+  // their calls wait for the event loop, run inline they would wait for
+  // themselves and stall every connection of the loop
+  if(method->policy() == RPCMethod::INLINE &&
+     (method->async() != nullptr || method->streaming() != nullptr || method->bidi() != nullptr)) {
+    std::cout << " failed, async and streaming methods can not be INLINE.\n";
+    return false;
+  }
 
-  std::pair<std::string, RPCMethod*> new_method{mname, method};
-
-  std::pair<std::map<std::string, RPCMethod*>::iterator, bool> ret;
-  ret = _methodMap.insert(new_method);
-  if(ret.second)
-    std::cout << " succeed.\n";
-  else
+  std::lock_guard<std::mutex> lock(_tableLock);
+  const MethodTable* old = _table.load(std::memory_order_relaxed);
+  if(old->byName.count(mname) > 0) {
     std::cout << " failed.\n";
-  return ret.second;
+    return false;
+  }
+  std::unique_ptr<MethodStats> &stats = _methodStats[mname];
+  if(!stats)
+    stats.reset(new MethodStats(_metrics, mname));
+  method->_stats = stats.get();
+  method->_removed.store(false);   // it may have been registered before
+
+  MethodTable* t = new MethodTable(*old);
+  t->byName[mname] = method;
+  t->byId.push_back(method);
+  if(method->policy() == RPCMethod::DEDICATED) {
+    ThreadPool* pool = new ThreadPool(std::max<size_t>(1, method->dedicatedThreads()));
+    pool->init();
+    _dedicatedPools.emplace_back(pool);
+    t->pools[method] = pool;
+  }
+  if(maxRunning > 0 && method->policy() != RPCMethod::INLINE) {
+    Bulkhead* bulkhead = new Bulkhead(maxRunning, maxQueued);
+    _bulkheads.emplace_back(bulkhead);
+    t->bulkheads[method] = bulkhead;
+  }
+  _publish(t);
+  std::cout << " succeed.\n";
+  return true;
 }
 
-// bool RPCServer::removeMethod(std::string& methodName) {
-//   auto it = _methodMap.find(methodName);
-//   if(it != _methodMap.end()) {
-//     std::cout << "Remove method: " << it->first << std::endl;
-//     _methodMap.erase(it);
-//     return true;
-//   }
-//   std::cout << "Method not existed: " << it->first << std::endl;
-//   return false;
-// }
+// removeMethod() waiting for the calls of a method, shared by all methods
+// as removals are rare
+static std::mutex unpin_lock;
+static std::condition_variable unpinned;
+
+// moves the owner of p out of v, an empty pointer if p is not there
+template<typename T>
+static std::unique_ptr<T> takeOwned(std::vector<std::unique_ptr<T> >& v, T* p) {
+  std::unique_ptr<T> owned;
+  for(auto it = v.begin(); it != v.end(); ++it) {
+    if(it->get() == p) {
+      owned = std::move(*it);
+      v.erase(it);
+      break;
+    }
+  }
+  return owned;
+}
+
+bool RPCServer::removeMethod(const std::string& methodName) {
+  RPCMethod* method;
+  std::unique_ptr<ThreadPool> pool;
+  std::unique_ptr<Bulkhead> bulkhead;
+  {
+    std::lock_guard<std::mutex> lock(_tableLock);
+    const MethodTable* old = _table.load(std::memory_order_relaxed);
+    auto it = old->byName.find(methodName);
+    if(it == old->byName.end()) {
+      std::cout << "Method not existed: " << methodName << std::endl;
+      return false;
+    }
+    method = it->second;
+    MethodTable* t = new MethodTable(*old);
+    t->byName.erase(methodName);
+    std::replace(t->byId.begin(), t->byId.end(), method, (RPCMethod*)nullptr);
+    auto pit = t->pools.find(method);
+    if(pit != t->pools.end()) {
+      pool = takeOwned(_dedicatedPools, pit->second);
+      t->pools.erase(pit);
+    }
+    auto bit = t->bulkheads.find(method);
+    if(bit != t->bulkheads.end()) {
+      bulkhead = takeOwned(_bulkheads, bit->second);
+      t->bulkheads.erase(bit);
+    }
+    _publish(t);
+  }
+  // no new call can pin it now, wait for the ones dispatched before
+  method->_removed.store(true);
+  {
+    std::unique_lock<std::mutex> lock(unpin_lock);
+    unpinned.wait(lock, [method] { return method->_pins.load() == 0; });
+  }
+  if(pool)
+    pool->shutdown();
+  std::cout << "Remove method: " << methodName << std::endl;
+  return true;
+}
+
+void RPCServer::unpin(RPCMethod* method) {
+  if(method == nullptr)
+    return;
+  // seq_cst with the store of _removed: either removeMethod() sees no pins
+  // or we see it waiting
+  if(method->_pins.fetch_sub(1) == 1 && method->_removed.load()) {
+    std::lock_guard<std::mutex> lock(unpin_lock);
+    unpinned.notify_all();
+  }
+}
+
+// swap in a new method table and free the old one once no lookup can still
+// read it, called with _tableLock held. Readers only look up and pin a
+// method, so this does not wait for calls.
+void RPCServer::_publish(const MethodTable* t) {
+  const MethodTable* old = _table.exchange(t, std::memory_order_seq_cst);
+  Rcu::synchronize();
+  delete old;
+}
+
+RPCMethod* RPCServer::getMethod(const XmlElement& fname) const {
+  if(fname.istype(TypeInt))
+    return getMethod(*((int*)fname.getdata()));
+  if(fname.istype(TypeString))
+    return getMethod(*((std::string*)fname.getdata()));
+  return nullptr;
+}
+
+Bulkhead* RPCServer::getBulkhead(const std::string& methodName) const {
+  Rcu::ReadGuard guard;
+  RPCMethod* method = getMethod(methodName);
+  const MethodTable* t = _table.load(std::memory_order_acquire);
+  auto it = t->bulkheads.find(method);
+  return it != t->bulkheads.end() ? it->second : nullptr;
+}
 
+void RPCServer::listMethods(std::vector<XmlElement>& ret) const {
+  Rcu::ReadGuard guard;
+  const MethodTable* t = _table.load(std::memory_order_acquire);
+  for(size_t i = 0; i < t->byId.size(); i++) {
+    if(t->byId[i] == nullptr)
+      continue;
+    ret.push_back(XmlElement(t->byId[i]->getName()));
+    ret.push_back(XmlElement(int(i)));
+  }
+}
+
+void RPCServer::setAdmissionControl(uint32 target_ms, uint32 interval_ms) {
+  _admission.configure(target_ms, interval_ms);
+}
+
+// the pool lock is only taken while requests are queued
+bool RPCServer::_admit() {
+  if(!_admission.enabled())
+    return true;
+  size_t queued = _thpool.pending();
+  if(_admission.admit(queued, queued > 0 ? _thpool.oldestWaitUs() : 0))
+    return true;
+  _overloaded.add();
+  return false;
+}
 
 void RPCServer::start() {
-  int epfd = epoll_create(5);
-  epoll_event ev;
-  ev.data.fd = _listenfd;
-  ev.events = EPOLLIN | EPOLLET;
-  epoll_ctl(epfd, EPOLL_CTL_ADD, _listenfd, &ev);
-  set_nonblock(_listenfd);
+  size_t n = _reactorCount;
+  if(n == 0)
+    n = std::max(1u, std::thread::hardware_concurrency());
+
+  // the kernel balances tcp connections among SO_REUSEPORT sockets, unix
+  // sockets have no such option so their loops all accept on the same one
+  std::vector<int> listenfds;
+  for(size_t i = 0; i < n; i++) {
+    int fd = (i > 0 && _transport.isLocal()) ? listenfds[0] : _transport.listen(_backlog, n > 1);
+    if(fd < 0)
+      break;
+    listenfds.push_back(fd);
+  }
+  if(listenfds.size() < n) {
+    std::cout << "Error creating listening sockets.\n";
+    for(size_t i = 0; i < listenfds.size(); i++)
+      if(i == 0 || !_transport.isLocal())
+        close(listenfds[i]);
+    return;
+  }
 
-  // using vector to dynamically handle ready events  
-  std::vector<epoll_event> read_evs(20);  
+  std::vector<Reactor*> reactors;
+  for(size_t i = 0; i < n; i++)
+    reactors.push_back(Reactor::create(_backend, this, listenfds[i]));
+  std::vector<std::thread> threads;
+  for(size_t i = 1; i < n; i++)
+    threads.emplace_back(&Reactor::run, reactors[i]);
+  std::cout << "Server started with " << n << " event loop(s).\n";
+  reactors[0]->run();
+
+  for(auto &t : threads)
+    t.join();
+  for(size_t i = 0; i < n; i++) {
+    delete reactors[i];
+    if(i == 0 || !_transport.isLocal())
+      close(listenfds[i]);
+  }
+}
+
+// looks up where the calls of fname run and pins the method, the task
+// running the call unpins it
+void RPCServer::_route(const XmlElement& fname, Route& route) {
+  route.method = nullptr;
+  route.policy = RPCMethod::POOL;
+  route.pool = &_thpool;
+  route.prio = ThreadPool::PRIO_NORMAL;
+  route.bulkhead = nullptr;
+  route.session = false;
+  route.stats = nullptr;
+
+  Rcu::ReadGuard guard;
+  RPCMethod* method = getMethod(fname);
+  if(method == nullptr)
+    return;   // answered with a fault by a worker
+  method->_pins.fetch_add(1, std::memory_order_relaxed);
+  route.method = method;
+  const MethodTable* t = _table.load(std::memory_order_acquire);
+  route.policy = method->policy();
+  route.prio = method->priority();
+  route.session = method->bidi() != nullptr;
+  route.stats = method->stats();
+  if(route.policy == RPCMethod::DEDICATED) {
+    auto it = t->pools.find(method);
+    if(it != t->pools.end())
+      route.pool = it->second;
+  }
+  auto it = t->bulkheads.find(method);
+  if(it != t->bulkheads.end())
+    route.bulkhead = it->second;
+}
 
-  std::cout << "Server started.\n";
+// submit every complete request of pc to the thread pool, called by the
+// event loop reading pc with its wheel timers
+void RPCServer::_dispatch(RPCConnection* pc, Reactor* loop, TimerWheel* timers) {
+  std::string s;
+  uint64 readAt = 0;
   while(1) {
-    int ret = epoll_wait(epfd, &read_evs.front(), read_evs.size(), -1);
-    if(ret < 0) {
-      if(errno == EINTR)
-        continue;
-      std::cout << "error epoll_wait. errno: " << errno << "\n";
+    pc->getReqXml(s, &readAt);
+    if(s.empty())
       break;
+    if(!pc->isShm() && s == RPCConnection::SHM_HELLO) {
+      _startShm(pc);
+      s.clear();
+      continue;
     }
-    if(ret == int(read_evs.size()))
-      read_evs.resize(read_evs.size() * 2);
-    for(int i = 0; i < ret; i++) {
-      int sockfd = read_evs[i].data.fd;
-      if(read_evs[i].events & EPOLLRDHUP) {
-        epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
-        std::cout << "Try closing a connection...";
-        // free a connection
-        if(_connectionManager.close(sockfd) == false){
-          std::cout << "Error connection not found.\n";
-          close(sockfd);
+    // chunks and window updates of client streams go to their session
+    if(pc->deliverStreamFrame(s)) {
+      s.clear();
+      continue;
+    }
+    if(RPCConnection::isBatch(s)) {
+      _dispatchBatch(pc, s);
+      s.clear();
+      continue;
+    }
+    // the client's timeout counts from the moment the request is read
+    int timeout = RPCConnection::peekTimeout(s);
+    uint64 deadline = timeout >= 0 ? TimerWheel::nowMs() + timeout : 0;
+
+    Tracer::Span* span = Tracer::sample();
+    if(span != nullptr)
+      span->at[Tracer::FRAME] = readAt;
+
+    Route route;
+    _route(RPCConnection::peekMethod(s), route);
+    if(route.policy == RPCMethod::INLINE) {
+      // cheap method, answer right away from the calling loop
+      Tracer::mark(span, Tracer::ENQUEUED);
+      pc->execute(s, route.method, deadline, 0, span);
+      Tracer::finish(span);
+      unpin(route.method);
+      s.clear();
+      continue;
+    }
+    RPCMethod* method = route.method;
+    ThreadPool* pool = route.pool;
+    int prio = route.prio;
+    Bulkhead* bulkhead = route.bulkhead;
+    bool session = route.session;
+    // notifications are dropped instead of answered with a fault
+    bool oneway = RPCConnection::isOneWay(s);
+    MethodStats* stats = route.stats;
+
+    // the shared queue is standing, refuse the request before it adds to it
+    if(pool == &_thpool && !_admit()) {
+      if(stats != nullptr)
+        stats->errors.add();
+      if(!oneway)
+        pc->generateErrorResponse(RPCConnection::peekID(s), "overloaded");
+      Tracer::discard(span);
+      unpin(method);
+      s.clear();
+      continue;
+    }
+
+    // the earlier of the server's request timeout and the client's deadline
+    uint32 expire = _requestTimeout;
+    if(timeout >= 0 && (expire == 0 || uint32(timeout) < expire))
+      expire = std::max(timeout, 1);
+
+    RPCConnection::RequestState state;
+    if(expire > 0 && !oneway) {
+      // The timer answers the request if no worker picked it up in time. It
+      // holds no reference of pc: while the request is queued the task's
+      // reference keeps pc alive, and expiring it takes that one over.
+      state = std::make_shared<RPCConnection::Request>(loop);
+      int id = RPCConnection::peekID(s);
+      RPCConnection::Request* req = state.get();
+      // the node refers to its own state until it fires or is disarmed
+      req->timer.callback = [pc, state, id, stats] {
+        RPCConnection::RequestState self = state;
+        self->timer.callback = nullptr;
+        int expected = RPCConnection::REQ_QUEUED;
+        if(self->phase.compare_exchange_strong(expected, RPCConnection::REQ_EXPIRED)) {
+          if(stats != nullptr)
+            stats->errors.add();
+          pc->closeStream(id);
+          pc->generateErrorResponse(id, "timeout");
+          pc->unref();
         }
-        else std::cout << "OK\n";
+      };
+      timers->add(&req->timer, expire);
+    }
+    // the channel must exist before the client's first chunk is read. A
+    // notification gets none, notify() drops calls of sessions and nothing
+    // would close it.
+    if(session && !oneway)
+      pc->openStream(RPCConnection::peekID(s));
+    pc->ref();
+    uint64 enqueued = metrics::nowUs();
+    Tracer::mark(span, Tracer::ENQUEUED);
+    if(bulkhead == nullptr) {
+      pool->submitPriority(prio, th_work, pc, method, s, state, deadline, enqueued, span);
+      s.clear();
+      continue;
+    }
+    Bulkhead::Call call = [bulkhead, pool, prio, pc, method, s, state, deadline, enqueued, span] {
+      pool->submitPriority(prio, th_limited_work, bulkhead, pc, method, s, state, deadline, enqueued, span);
+    };
+    if(!bulkhead->enter(std::move(call))) {
+      if(stats != nullptr) {
+        stats->errors.add();
+        stats->busy.add();
+      }
+      // the method is saturated, answer now, the timer has not fired yet
+      if(state) {
+        state->phase.store(RPCConnection::REQ_EXPIRED);
+        timers->cancel(&state->timer);
+        state->timer.callback = nullptr;
       }
-      else if(read_evs[i].events & EPOLLIN)
-        _inEvents(sockfd, epfd);
-      // else if(read_evs[i].events & EPOLLOUT)
-      //   _outEvents(sockfd, epfd);
+      if(!oneway)
+        pc->generateErrorResponse(RPCConnection::peekID(s), "busy");
+      if(session && !oneway)
+        pc->closeStream(RPCConnection::peekID(s));
+      Tracer::discard(span);
+      pc->unref();
+      unpin(method);
     }
+    s.clear();
   }
-  close(epfd);
-  close(_listenfd);
 }
 
-void RPCServer::_inEvents(int fd, int epfd) {
-  if(fd == _listenfd) {
-    while(1){
-      struct sockaddr_in caddr;
-      socklen_t clen = sizeof(caddr);
-
-      int connfd = accept(_listenfd, (struct sockaddr*)&caddr, &clen);
-      if(connfd < 0) {
-        if(errno != EAGAIN && errno == EINTR)
-          std::cout << "Error accepting client, errno:" << errno << std::endl;
-        break;
-      }
-      bool ret = _connectionManager.add(connfd, this);
-      if(ret == false){
-        std::cout << "Error creating connection, already existed.\n";
-        close(connfd);
-        continue;
-      }
-      std::cout << "New connection established.\n";
-      
-      // register epoll event
-      struct epoll_event ev;
-      ev.data.fd = connfd;
-      ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
-      epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev);
-      set_nonblock(connfd);
-    }
+// fan the entries of a batch out to the pools their methods run in, the
+// response is sent once all of them are done
+void RPCServer::_dispatchBatch(RPCConnection* pc, const std::string& xml) {
+  int id = RPCConnection::peekID(xml);
+  std::vector<std::string> entries;
+  int timeout;
+  if(!RPCConnection::splitBatch(xml, entries, timeout)) {
+    pc->generateErrorResponse(id, "invalid batch");
+    return;
+  }
+  if(!_admit()) {
+    pc->generateErrorResponse(id, "overloaded");
+    return;
+  }
+  uint64 deadline = timeout >= 0 ? TimerWheel::nowMs() + timeout : 0;
+
+  pc->ref();
+  BatchResponse* batch = new BatchResponse(pc, id, entries.size());
+  if(entries.empty()) {
+    batch->send();
+    return;
   }
-  else{ // data from client
-    RPCConnection *pc = _connectionManager.find(fd);
-    if(pc == nullptr) {
-      std::cout << "Error: receive data but connection not found.\n";
-      exit(EXIT_FAILURE);
+  uint64 enqueued = metrics::nowUs();
+  for(size_t i = 0; i < entries.size(); i++) {
+    Route route;
+    _route(RPCConnection::peekMethod(entries[i]), route);
+    if(route.policy == RPCMethod::INLINE) {
+      th_batch_work(batch, i, route.method, entries[i], deadline, 0);
+      continue;
     }
-    while(1) {
-      int n = pc->recvXml();
-      if(n < 0) {
-        if(errno != EAGAIN && errno != EINTR)
-          std::cout << "Error reading from " << fd << "errno: " << errno << std::endl;
-        break;
-      }
-      if(n == 0) {  // receive a complete xml 
-
-        // submit to thread pool to handle the work
-        std::string s;
-        while(1) {
-          pc->getReqXml(s);
-          if(!s.empty()) {
-            _thpool.submit(th_work, pc, s);
-            s.clear();
-          }
-          else
-            break;
-        }
+    RPCMethod* method = route.method;
+    ThreadPool* pool = route.pool;
+    int prio = route.prio;
+    Bulkhead* bulkhead = route.bulkhead;
+    if(bulkhead == nullptr) {
+      pool->submitPriority(prio, th_batch_work, batch, i, method, entries[i], deadline, enqueued);
+      continue;
+    }
+    std::string entry = entries[i];
+    Bulkhead::Call call = [bulkhead, pool, prio, batch, i, method, entry, deadline, enqueued] {
+      pool->submitPriority(prio, th_limited_batch_work, bulkhead, batch, i, method, entry, deadline, enqueued);
+    };
+    if(!bulkhead->enter(std::move(call))) {
+      if(route.stats != nullptr) {
+        route.stats->errors.add();
+        route.stats->busy.add();
       }
+      batch->done(i, RPCConnection::faultBody("busy"));
+      unpin(method);
     }
   }
 }
 
+void RPCServer::_startShm(RPCConnection* pc) {
+  if(!pc->attachShm()) {
+    std::cout << "Error setting up shared memory channel.\n";
+    pc->terminateConnection();
+    return;
+  }
+  std::cout << "Shared memory channel established.\n";
+  ShmReactor* loop = new ShmReactor(this, pc);
+  pc->setShmLoop(loop);
+  pc->ref();
+  _shmThreads++;
+  std::thread(&RPCServer::_shmLoop, this, pc, loop).detach();
+}
+
+// the loop ends when either side closes the channel, the last reference of
+// pc releases it
+void RPCServer::_shmLoop(RPCConnection* pc, Reactor* loop) {
+  loop->run();
+  pc->unref();
+  _shmThreads--;
+}
+
 // void RPCServer::_outEvents(int fd, int epfd) {
 //   RPCConnection *pc = _connectionManager.find(fd);
 //   if(pc == nullptr){
@@ -233,67 +656,94 @@ void RPCServer::_inEvents(int fd, int epfd) {
 
 /* ============= ConnectionManager ============= */
 
+ConnectionManager::ConnectionManager() {
+  // fd numbers are bounded by the hard limit of open files, the soft limit
+  // may be raised up to it at any time
+  struct rlimit rl;
+  size_t maxfd = 1 << 16;
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    maxfd = rl.rlim_max == RLIM_INFINITY ? (1 << 24) : std::min<size_t>(rl.rlim_max, 1 << 24);
+  _count.store(0, std::memory_order_relaxed);
+  _nchunks = (maxfd + CHUNK_SIZE - 1) >> CHUNK_BITS;
+  _chunks.reset(new std::atomic<Slot*>[_nchunks]);
+  for(size_t i = 0; i < _nchunks; i++)
+    _chunks[i].store(nullptr, std::memory_order_relaxed);
+}
+
 ConnectionManager::~ConnectionManager() {
   ConnectionManager::shutdown();
+  for(size_t i = 0; i < _nchunks; i++)
+    delete[] _chunks[i].load(std::memory_order_relaxed);
+}
+
+ConnectionManager::Slot* ConnectionManager::_getSlot(int fd, bool create) const {
+  if(fd < 0 || (size_t(fd) >> CHUNK_BITS) >= _nchunks)
+    return nullptr;
+  std::atomic<Slot*>& chunk = _chunks[fd >> CHUNK_BITS];
+  Slot* p = chunk.load(std::memory_order_acquire);
+  if(p == nullptr && create) {
+    Slot* fresh = new Slot[CHUNK_SIZE];
+    for(size_t i = 0; i < CHUNK_SIZE; i++)
+      fresh[i].store(nullptr, std::memory_order_relaxed);
+    // another thread may install the chunk at the same time
+    if(chunk.compare_exchange_strong(p, fresh, std::memory_order_acq_rel))
+      p = fresh;
+    else
+      delete[] fresh;
+  }
+  return p == nullptr ? nullptr : p + (fd & (CHUNK_SIZE - 1));
 }
 
-RPCConnection* ConnectionManager::find(int fd) {
-  size_t buck_id = _getBuckId(fd);
-  std::unique_lock<std::mutex> lock(_locks.at(buck_id));
-  auto it = _recorders.at(buck_id).find(fd);
-  if(it == _recorders.at(buck_id).end())
+RPCConnection* ConnectionManager::find(int fd) const {
+  Slot* slot = _getSlot(fd, false);
+  if(slot == nullptr)
     return nullptr;
-  return it->second;
+  return slot->load(std::memory_order_acquire);
 }
 
 bool ConnectionManager::add(int fd, RPCServer* ps) {
-  size_t buck_id = _getBuckId(fd);
-  std::pair<std::map<int, RPCConnection*>::iterator, bool> ret;
-  std::unique_lock<std::mutex> lock(_locks.at(buck_id));
-
-  RPCConnection * pc = new RPCConnection(fd, ps);
-  ret = _recorders.at(buck_id).insert(std::pair<int, RPCConnection*>{fd, pc});
-  if(ret.second != true)
-    delete pc;
-  return ret.second;
+  Slot* slot = _getSlot(fd, true);
+  if(slot == nullptr) {
+    std::cout << "ConnectionManager error: fd " << fd << " out of range\n";
+    return false;
+  }
+  RPCConnection* pc = new RPCConnection(fd, ps);
+  RPCConnection* expected = nullptr;
+  if(!slot->compare_exchange_strong(expected, pc, std::memory_order_acq_rel)) {
+    pc->unref();
+    return false;
+  }
+  _count.fetch_add(1, std::memory_order_relaxed);
+  return true;
 }
 
 bool ConnectionManager::close(int fd) {
-  size_t buck_id = _getBuckId(fd);
-  std::unique_lock<std::mutex> lock(_locks.at(buck_id));
-
-  auto it = _recorders.at(buck_id).find(fd);
-  if(it == _recorders.at(buck_id).end()) {
+  Slot* slot = _getSlot(fd, false);
+  RPCConnection* pc = slot == nullptr ? nullptr : slot->exchange(nullptr, std::memory_order_acq_rel);
+  if(pc == nullptr) {
     std::cout << "ConnectionManager error: fd to be closed not exist\n" ;
     return false;
   }
-  delete it->second;  // 
-  _recorders.at(buck_id).erase(it);
+  _count.fetch_sub(1, std::memory_order_relaxed);
+  // stop the socket now, the fd itself is released with the last reference
+  // so that it cannot be reused while workers still write to it
+  pc->terminateConnection();
+  pc->unref();
   return true;
 }
 
 void ConnectionManager::shutdown() {
-  if(_bucket_sz == 0)
-    return;
-  for(size_t i = 0; i < _bucket_sz; i++) {
-    std::unique_lock<std::mutex> lock(_locks.at(i));
-    auto &submap = _recorders.at(i);
-    for(auto it = submap.begin(); it != submap.end(); ) {
-      delete it->second;
-      it = submap.erase(it);
+  for(size_t i = 0; i < _nchunks; i++) {
+    Slot* chunk = _chunks[i].load(std::memory_order_acquire);
+    if(chunk == nullptr)
+      continue;
+    for(size_t j = 0; j < CHUNK_SIZE; j++) {
+      RPCConnection* pc = chunk[j].exchange(nullptr, std::memory_order_acq_rel);
+      if(pc != nullptr) {
+        _count.fetch_sub(1, std::memory_order_relaxed);
+        pc->terminateConnection();
+        pc->unref();
+      }
     }
   }
-  _bucket_sz = 0;
-  _locks.clear();
 }
-
-
-size_t ConnectionManager::_getBuckId(int val) const {
-  if(val < 0)
-    val = -val;
-  const static double base = sqrt(2.0) - 1;
-  double v = val * base;
-  return static_cast<size_t>(_bucket_sz * (v - int(v)));
-}
-
-
@@ -5,9 +5,19 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
-
+#include "../serialization/serialization.h"
 #include "thpool.h"
+#include "timer_wheel.h"
+#include "transport.h"
+#include "reactor.h"
+#include "admission.h"
+#include "bulkhead.h"
+#include "rpc_method.h"
+#include "metrics.h"
 
 namespace simprpc{
 
@@ -16,15 +26,24 @@ class RPCMethod;
 class RPCServer;
 
 // This class will handle connection management and promise access/modify connection
-// safely in parallel
+// safely in parallel.
+//
+// Connections are kept in a flat table indexed by socket fd. The table is split
+// into fixed size chunks which are allocated on first use and never freed before
+// shutdown, so lookups are a plain atomic load without any lock. The table owns
+// one reference of every registered connection, close() drops it and the
+// connection is actually freed when the last task holding it finishes.
 class ConnectionManager{
 public:
-  ConnectionManager(size_t sz = 7): _bucket_sz(sz), _locks(sz), _recorders(sz){ }
+  ConnectionManager();
   ~ConnectionManager();
 
   // Access fucntions
-  // return cresponding connection class with given socket file descriptor
-  RPCConnection* find(int sockfd);
+  // return cresponding connection class with given socket file descriptor.
+  // The pointer stays valid until close(sockfd), which is only called by the
+  // event loop owning the connection. Only that loop may look connections up,
+  // it hands a reference (ref()) to anyone using one after it returns.
+  RPCConnection* find(int sockfd) const;
   
   // register a new connection
   bool add(int sockfd, RPCServer* ps);
@@ -35,12 +54,19 @@ public:
   // close all connection and shutdown the manager
   void shutdown();
 
+  // number of registered connections
+  size_t count() const { return _count.load(std::memory_order_relaxed); }
+
 private:
-  size_t _bucket_sz;
-  std::vector<std::mutex> _locks;
-  std::vector<std::map<int, RPCConnection*> > _recorders;
+  typedef std::atomic<RPCConnection*> Slot;
+  static const size_t CHUNK_BITS = 10;
+  static const size_t CHUNK_SIZE = 1 << CHUNK_BITS;
 
-  size_t _getBuckId(int val) const;
+  size_t _nchunks;
+  std::unique_ptr<std::atomic<Slot*>[]> _chunks;
+  std::atomic<size_t> _count;
+
+  Slot* _getSlot(int fd, bool create) const;
 };
 
 
@@ -48,33 +74,169 @@ class RPCServer{
 public:
   // RPCServer(size_t thpoll_sz)std::string
   // RPCServer(const char* ip, int port);
+  // ip may also be a "unix:/path" address, see Transport. backend selects
+  // the event loop, io_uring falls back to epoll if unavailable.
   RPCServer() = delete;
-  RPCServer(const char* ip, int port, size_t thpoll_sz=10, size_t bucksz=7);
+  RPCServer(const char* ip, int port, size_t thpoll_sz=10, Reactor::Backend backend=Reactor::EPOLL);
   ~RPCServer();
 
   void start();
 
-  bool registMethod(RPCMethod* method);
-
+  // Methods may be registered and removed at any time, also while serving.
+  // Both wait for lookups still reading the previous method table, which
+  // are short. removeMethod() then waits until the calls already dispatched
+  // to the method are done, without blocking changes to other methods. It
+  // must not be called from a call of the removed method itself. A removed
+  // method is no longer referenced once removeMethod() returns and may be
+  // destroyed, its dedicated pool and bulkhead are freed.
+  // Method ids are never reused, clients holding a stale id get a fault.
+  //
+  // maxRunning > 0 limits the calls of the method executing at a time, up to
+  // maxQueued more wait for a slot without taking a worker and the rest is
+  // answered with a "busy" fault. INLINE methods are not limited.
+  // Fails for async, streaming and bidi methods declared INLINE.
+  bool registMethod(RPCMethod* method, size_t maxRunning = 0, size_t maxQueued = 0);
+  bool removeMethod(const std::string& methodName);
+
+  // Lookups are lock free and must be done inside an Rcu::ReadGuard, the
+  // returned method may be removed once it ends. To use it longer pin it
+  // in the guard, as dispatching does, see unpin().
   RPCMethod* getMethod(const std::string& s) const { 
-    auto it = _methodMap.find(s);
-    if(it == _methodMap.end())
+    const MethodTable* t = _table.load(std::memory_order_acquire);
+    auto it = t->byName.find(s);
+    if(it == t->byName.end())
       return nullptr;
     return it->second;
   }
 
-  // bool removeMethod(std::string& methodName);
+  // methods are numbered densely in registration order, see METHODS_CALL
+  RPCMethod* getMethod(int id) const {
+    const MethodTable* t = _table.load(std::memory_order_acquire);
+    if(id < 0 || size_t(id) >= t->byId.size())
+      return nullptr;
+    return t->byId[id];
+  }
+
+  // method named by the <fname> element of a request, by name or id
+  RPCMethod* getMethod(const XmlElement& fname) const;
+
+  // concurrency limit of a method, nullptr if it has none. It stays valid
+  // until the method is removed.
+  Bulkhead* getBulkhead(const std::string& methodName) const;
+
+  // append (name, id) of every registered method to ret
+  void listMethods(std::vector<XmlElement>& ret) const;
+
+  // Every dispatched call pins its method so that removeMethod() waits for
+  // it. The task running the call releases it when done, method may be
+  // nullptr.
+  static void unpin(RPCMethod* method);
+
+  // Timeouts in milliseconds, 0 disables them (default). They must be set
+  // before start().
+  //  idle:    close a connection without traffic nor running request
+  //  frame:   close a connection whose partial request is not completed in time
+  //  request: answer a fault if a request is still queued when it expires
+  void setIdleTimeout(uint32 ms) { _idleTimeout = ms; }
+  void setFrameTimeout(uint32 ms) { _frameTimeout = ms; }
+  void setRequestTimeout(uint32 ms) { _requestTimeout = ms; }
+
+  // Number of event loops accepting and reading connections, each on its own
+  // thread (start() runs the first one). A connection stays on the loop that
+  // accepted it. tcp loops listen on their own SO_REUSEPORT socket, unix ones
+  // share one. 0 means one per cpu, default is 1. Must be set before start().
+  void setReactorCount(size_t n) { _reactorCount = n; }
+
+  // length of the queue of pending connections per listening socket
+  void setListenBacklog(int n) { _backlog = n; }
+
+  // Requests wait in the worker pool in the priority class of their method,
+  // a low class one waiting longer than ms is run before higher classes
+  // anyway (0: strict priority). queueStats() gives the waiting time of the
+  // calls of a class.
+  void setQueueAging(uint32 ms) { _thpool.setAging(ms); }
+  ThreadPool::ClassStats queueStats(int prio) { return _thpool.stats(prio); }
+
+  // Refuse new requests with an "overloaded" fault while the shortest queue
+  // wait of the shared pool stayed above target_ms for interval_ms (CoDel).
+  // Requests of INLINE and DEDICATED methods are not subject to it. target 0
+  // disables it (default). Must be set before start().
+  void setAdmissionControl(uint32 target_ms, uint32 interval_ms = 100);
+  uint64 overloadRejections() const { return _admission.rejected(); }
+
+  // Metrics of the server: calls, faults and latency histograms of every
+  // method (see MethodStats), bytes read and written, open connections, the
+  // depth of the shared queue, its waits by priority class and the requests
+  // refused as overloaded. They are answered by the built-in
+  // RPCConnection::STATS_CALL method, dumpMetrics() gives Prometheus text.
+  MetricsRegistry& metrics() { return _metrics; }
+  void dumpMetrics(std::string& out) const { _metrics.prometheus(out); }
+  void metricsValues(std::vector<std::pair<std::string, double> >& out) const { _metrics.values(out); }
+
+  Counter& bytesIn() const { return _bytesIn; }
+  Counter& bytesOut() const { return _bytesOut; }
 
 
 private:
-  // TODO: change to shared_ptr
-  std::map<std::string, RPCMethod*> _methodMap;
+  friend class Reactor;
+  friend class ShmReactor;
+
+  // Immutable snapshot of the registered methods. Writers copy it, modify
+  // the copy and swap the pointer, the old one is freed after a grace period.
+  struct MethodTable{
+    std::map<std::string, RPCMethod*> byName;
+    std::vector<RPCMethod*> byId;     // indexed by method id, nullptr if removed
+    std::map<const RPCMethod*, ThreadPool*> pools;   // of DEDICATED methods
+    std::map<const RPCMethod*, Bulkhead*> bulkheads; // of limited methods
+  };
+
+  std::atomic<const MethodTable*> _table;
+  std::mutex _tableLock;    // serializes writers
+  std::unique_ptr<RPCMethod> _methodsCall;
+  std::unique_ptr<RPCMethod> _statsCall;
+  MetricsRegistry _metrics;
+  Counter& _bytesIn;
+  Counter& _bytesOut;
+  Counter& _overloaded;     // requests refused by the admission control
+  Histogram* _classWait[ThreadPool::PRIO_CLASSES];
+  // by method name, kept for the server's life
+  std::map<std::string, std::unique_ptr<MethodStats> > _methodStats;
+  // owners of the pools and limits of registered methods, guarded by
+  // _tableLock. removeMethod() frees them once the method's calls are done.
+  std::vector<std::unique_ptr<ThreadPool> > _dedicatedPools;
+  std::vector<std::unique_ptr<Bulkhead> > _bulkheads;
   ConnectionManager _connectionManager;
+  AdmissionControl _admission;
   ThreadPool _thpool;
-  int _listenfd;
-
-  void _inEvents(int fd, int epfd); // execute method actually happens in _inEvents
-  // void _outEvents(int fd, int epfd);
+  Transport _transport;
+  Reactor::Backend _backend;
+  size_t _reactorCount;
+  int _backlog;
+
+  uint32 _idleTimeout;
+  uint32 _frameTimeout;
+  uint32 _requestTimeout;
+  std::atomic<int> _shmThreads;   // running shared memory connection loops
+
+  // where the calls of a method run, looked up once per request
+  struct Route{
+    RPCMethod* method;    // pinned, nullptr if not found
+    RPCMethod::Policy policy;
+    ThreadPool* pool;
+    int prio;
+    Bulkhead* bulkhead;
+    bool session;     // a BidiRPCMethod
+    MethodStats* stats;
+  };
+
+  void _publish(const MethodTable* t);
+  void _route(const XmlElement& fname, Route& route);
+  // whether the shared queue takes another request, see AdmissionControl
+  bool _admit();
+  void _dispatch(RPCConnection* pc, Reactor* loop, TimerWheel* timers);
+  void _dispatchBatch(RPCConnection* pc, const std::string& xml);
+  void _startShm(RPCConnection* pc);
+  void _shmLoop(RPCConnection* pc, Reactor* loop);
 
 };
 
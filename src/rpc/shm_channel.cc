@@ -0,0 +1,274 @@
+#include <iostream>
+#include <new>
+#include <algorithm>
+#include <climits>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "shm_channel.h"
+
+using namespace simprpc;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared memory rings need address free atomics");
+
+static const uint32 SHM_MAGIC = 0x53525043;   // "SRPC"
+static const uint32 SHM_VERSION = 1;
+static const int SPIN_LIMIT = 4000;   // polls before falling asleep on the futex
+
+// spinning only helps if the peer runs on another cpu meanwhile
+static int spin_limit() {
+  static const int limit = std::thread::hardware_concurrency() > 1 ? SPIN_LIMIT : 0;
+  return limit;
+}
+
+struct ShmChannel::Ring{
+  alignas(64) std::atomic<uint32> head;   // bytes consumed, written by reader
+  std::atomic<uint32> writerSleeping;
+  alignas(64) std::atomic<uint32> tail;   // bytes produced, written by writer
+  std::atomic<uint32> readerSleeping;
+};
+
+struct ShmChannel::Header{
+  uint32 magic;
+  uint32 version;
+  uint32 capacity;
+  std::atomic<uint32> closed;
+  Ring rings[2];    // [0] client to server, [1] server to client
+};
+
+// the header takes the first page, ring data follows
+static const size_t DATA_OFFSET = 4096;
+// closing does not change the ring positions, sleepers re-check the closed flag
+// at least this often in case they missed the wake up
+static const int SLEEP_SLICE_MS = 100;
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+static void futex_wait(std::atomic<uint32>* addr, uint32 val, int timeout_ms) {
+  struct timespec ts;
+  struct timespec* pts = nullptr;
+  if(timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    pts = &ts;
+  }
+  // not FUTEX_PRIVATE: the word lives in memory shared with another process
+  syscall(SYS_futex, reinterpret_cast<uint32*>(addr), FUTEX_WAIT, val, pts, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32>* addr) {
+  syscall(SYS_futex, reinterpret_cast<uint32*>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static uint64 now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wait until *word moves away from val, the channel is closed or timeout
+// expires. Spin first, then announce sleeping through flag and block.
+static void wait_change(std::atomic<uint32>* word, uint32 val, std::atomic<uint32>* flag,
+                        const std::atomic<uint32>* closed, int timeout_ms) {
+  for(int i = 0, n = spin_limit(); i < n; i++) {
+    if(word->load(std::memory_order_acquire) != val || closed->load(std::memory_order_relaxed))
+      return;
+    cpu_relax();
+  }
+  uint64 deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : 0;
+  flag->store(1, std::memory_order_seq_cst);
+  while(word->load(std::memory_order_seq_cst) == val && !closed->load(std::memory_order_seq_cst)) {
+    int left = SLEEP_SLICE_MS;
+    if(timeout_ms >= 0) {
+      uint64 now = now_ms();
+      if(now >= deadline)
+        break;
+      left = std::min<int>(left, int(deadline - now));
+    }
+    futex_wait(word, val, left);
+  }
+  flag->store(0, std::memory_order_relaxed);
+}
+
+ShmChannel* ShmChannel::create(size_t capacity) {
+  static_assert(sizeof(Header) <= DATA_OFFSET, "header larger than a page");
+  size_t cap = 4096;
+  while(cap < capacity && cap < (size_t(1) << 30))
+    cap <<= 1;
+  size_t size = DATA_OFFSET + 2 * cap;
+
+  int fd = memfd_create("simprpc", MFD_CLOEXEC);
+  if(fd < 0) {
+    std::cout << "ShmChannel: memfd_create failed, errno: " << errno << std::endl;
+    return nullptr;
+  }
+  if(ftruncate(fd, size) < 0) {
+    std::cout << "ShmChannel: ftruncate failed, errno: " << errno << std::endl;
+    ::close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(base == MAP_FAILED) {
+    std::cout << "ShmChannel: mmap failed, errno: " << errno << std::endl;
+    ::close(fd);
+    return nullptr;
+  }
+  Header* h = new (base) Header();
+  h->magic = SHM_MAGIC;
+  h->version = SHM_VERSION;
+  h->capacity = uint32(cap);
+  h->closed.store(0);
+  for(int i = 0; i < 2; i++) {
+    h->rings[i].head.store(0);
+    h->rings[i].tail.store(0);
+    h->rings[i].writerSleeping.store(0);
+    h->rings[i].readerSleeping.store(0);
+  }
+  return new ShmChannel(fd, base, size, uint32(cap), false);
+}
+
+ShmChannel* ShmChannel::attach(int memfd) {
+  struct stat st;
+  if(fstat(memfd, &st) < 0 || size_t(st.st_size) < DATA_OFFSET) {
+    ::close(memfd);
+    return nullptr;
+  }
+  size_t size = st.st_size;
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if(base == MAP_FAILED) {
+    ::close(memfd);
+    return nullptr;
+  }
+  Header* h = static_cast<Header*>(base);
+  uint32 cap = h->capacity;
+  if(h->magic != SHM_MAGIC || h->version != SHM_VERSION || cap == 0 || (cap & (cap - 1)) != 0
+     || size != DATA_OFFSET + 2 * size_t(cap)) {
+    std::cout << "ShmChannel: invalid segment received.\n";
+    munmap(base, size);
+    ::close(memfd);
+    return nullptr;
+  }
+  return new ShmChannel(memfd, base, size, cap, true);
+}
+
+ShmChannel::ShmChannel(int fd, void* base, size_t size, uint32 cap, bool server):
+  _fd(fd), _base(base), _size(size), _cap(cap) {
+  _header = static_cast<Header*>(base);
+  char* data = static_cast<char*>(base) + DATA_OFFSET;
+  int tx = server ? 1 : 0;
+  _tx = &_header->rings[tx];
+  _rx = &_header->rings[1 - tx];
+  _txData = data + tx * size_t(_cap);
+  _rxData = data + (1 - tx) * size_t(_cap);
+}
+
+ShmChannel::~ShmChannel() {
+  munmap(_base, _size);
+  ::close(_fd);
+}
+
+bool ShmChannel::closed() const {
+  return _header->closed.load(std::memory_order_relaxed) != 0;
+}
+
+void ShmChannel::close() {
+  _header->closed.store(1, std::memory_order_seq_cst);
+  for(int i = 0; i < 2; i++) {
+    futex_wake(&_header->rings[i].head);
+    futex_wake(&_header->rings[i].tail);
+  }
+}
+
+bool ShmChannel::_valid(uint32 head, uint32 tail) {
+  if(tail - head <= _cap)
+    return true;
+  std::cout << "ShmChannel: corrupt ring positions, closing.\n";
+  close();
+  return false;
+}
+
+int ShmChannel::write(const char* p, size_t len) {
+  const uint32 cap = _cap;
+  size_t done = 0;
+  while(done < len) {
+    if(closed())
+      return -1;
+    uint32 tail = _tx->tail.load(std::memory_order_relaxed);
+    uint32 head = _tx->head.load(std::memory_order_acquire);
+    if(!_valid(head, tail))
+      return -1;
+    uint32 room = cap - (tail - head);
+    if(room == 0) {
+      wait_change(&_tx->head, head, &_tx->writerSleeping, &_header->closed, -1);
+      continue;
+    }
+    size_t n = std::min<size_t>(room, len - done);
+    size_t pos = tail & (cap - 1);
+    size_t first = std::min<size_t>(n, cap - pos);
+    memcpy(_txData + pos, p + done, first);
+    memcpy(_txData, p + done + first, n - first);
+    _tx->tail.store(tail + uint32(n), std::memory_order_seq_cst);
+    if(_tx->readerSleeping.load(std::memory_order_seq_cst))
+      futex_wake(&_tx->tail);
+    done += n;
+  }
+  return int(done);
+}
+
+int ShmChannel::read(char* buf, size_t len, int timeout_ms) {
+  const char* first;
+  const char* second;
+  size_t firstLen, secondLen;
+  int avail = peek(first, firstLen, second, secondLen, timeout_ms);
+  if(avail <= 0)
+    return avail;
+  size_t n = std::min<size_t>(avail, len);
+  size_t a = std::min(n, firstLen);
+  memcpy(buf, first, a);
+  memcpy(buf + a, second, n - a);
+  consume(n);
+  return int(n);
+}
+
+int ShmChannel::peek(const char*& first, size_t& firstLen, const char*& second, size_t& secondLen,
+                     int timeout_ms) {
+  const uint32 cap = _cap;
+  uint32 head = _rx->head.load(std::memory_order_relaxed);
+  uint32 tail = _rx->tail.load(std::memory_order_acquire);
+  if(tail == head) {
+    if(closed())
+      return -1;
+    wait_change(&_rx->tail, head, &_rx->readerSleeping, &_header->closed, timeout_ms);
+    tail = _rx->tail.load(std::memory_order_acquire);
+    if(tail == head)
+      return closed() ? -1 : 0;
+  }
+  if(!_valid(head, tail))
+    return -1;
+  size_t n = tail - head;
+  size_t pos = head & (cap - 1);
+  first = _rxData + pos;
+  firstLen = std::min<size_t>(n, cap - pos);
+  second = _rxData;
+  secondLen = n - firstLen;
+  return int(n);
+}
+
+void ShmChannel::consume(size_t n) {
+  uint32 head = _rx->head.load(std::memory_order_relaxed);
+  _rx->head.store(head + uint32(n), std::memory_order_seq_cst);
+  if(_rx->writerSleeping.load(std::memory_order_seq_cst))
+    futex_wake(&_rx->head);
+}
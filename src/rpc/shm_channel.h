@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+#include "types.h"
+
+namespace simprpc{
+
+/*
+  Shared memory transport for processes on the same host.
+
+  A channel is a memfd segment holding two single-producer/single-consumer
+  byte rings, one per direction. The client creates the segment and passes
+  the memfd to the server over the unix socket it connected with ("shm:"
+  addresses, see Transport), after that frames are copied straight into the
+  ring by the writer and out of it by the reader without any syscall.
+
+  A side waiting for data or for free space spins for a short while and then
+  sleeps on a futex of the ring position, the other side only issues a wake
+  up if the peer announced it went to sleep.
+
+  The rings carry the same byte stream as a socket would, so framing stays
+  the one of RPCConnection. Each direction must have a single writer and a
+  single reader at a time, callers serialize access themselves.
+*/
+class ShmChannel{
+public:
+  static const size_t DEFAULT_CAPACITY = 1 << 20;  // bytes per direction
+
+  // client side: create and initialize a new segment, nullptr on error
+  static ShmChannel* create(size_t capacity = DEFAULT_CAPACITY);
+
+  // server side: map the segment behind a received memfd, nullptr if it is
+  // not a valid channel. The channel takes ownership of memfd.
+  static ShmChannel* attach(int memfd);
+
+  ~ShmChannel();
+  ShmChannel(const ShmChannel&) = delete;
+  ShmChannel& operator=(const ShmChannel&) = delete;
+
+  int fd() const { return _fd; }
+
+  // write all len bytes, waiting for room if needed. -1 if channel is closed
+  int write(const char* p, size_t len);
+
+  // read available bytes, waiting at most timeout_ms (-1 forever) for some to
+  // arrive. Returns the number of bytes, 0 on timeout and -1 if closed.
+  int read(char* buf, size_t len, int timeout_ms = -1);
+
+  // Available bytes in place, waiting as read() does. They are one span or
+  // two if they wrap around the end of the ring (second is empty then), and
+  // stay valid until consume() hands them back to the writer. Returns the
+  // total, 0 on timeout and -1 if closed.
+  int peek(const char*& first, size_t& firstLen, const char*& second, size_t& secondLen,
+           int timeout_ms = -1);
+  void consume(size_t n);
+
+  // mark the channel closed for both processes and wake them up
+  void close();
+  bool closed() const;
+
+private:
+  struct Ring;
+  struct Header;
+
+  ShmChannel(int fd, void* base, size_t size, uint32 cap, bool server);
+
+  // ring positions read from the peer, false (and the channel closed) if
+  // they can not be right
+  bool _valid(uint32 head, uint32 tail);
+
+  int _fd;
+  void* _base;
+  size_t _size;
+  uint32 _cap;    // validated capacity, the header copy is writable by the peer
+  Header* _header;
+  Ring* _tx;      // ring this process writes to
+  Ring* _rx;      // ring this process reads from
+  char* _txData;
+  char* _rxData;
+};
+
+}
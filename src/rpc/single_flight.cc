@@ -0,0 +1,27 @@
+#include "single_flight.h"
+#include "rpc_connection.h"
+
+using namespace simprpc;
+
+bool SingleFlight::join(const std::string& key, RPCConnection* pc, int id) {
+  std::lock_guard<std::mutex> lock(_lock);
+  auto it = _flights.find(key);
+  if(it == _flights.end()) {
+    _flights.emplace(key, std::vector<Waiter>());
+    return true;
+  }
+  pc->ref();
+  it->second.push_back(Waiter(pc, id));
+  return false;
+}
+
+std::vector<SingleFlight::Waiter> SingleFlight::finish(const std::string& key) {
+  std::vector<Waiter> waiters;
+  std::lock_guard<std::mutex> lock(_lock);
+  auto it = _flights.find(key);
+  if(it != _flights.end()) {
+    waiters.swap(it->second);
+    _flights.erase(it);
+  }
+  return waiters;
+}
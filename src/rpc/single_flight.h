@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <utility>
+
+namespace simprpc{
+
+class RPCConnection;
+
+/*
+  Coalescing of identical calls running at the same time. The first call of a
+  key becomes the leader and executes the method, calls of the same key
+  arriving meanwhile only register where their response has to go and are
+  answered by the leader with the same result.
+*/
+class SingleFlight{
+public:
+  typedef std::pair<RPCConnection*, int> Waiter;   // connection and request id
+
+  SingleFlight() { }
+  SingleFlight(const SingleFlight&) = delete;
+  SingleFlight& operator=(const SingleFlight&) = delete;
+
+  // true if the caller leads key and must execute it, otherwise the request
+  // (pc, id) is queued behind the leader which takes over a reference of pc
+  bool join(const std::string& key, RPCConnection* pc, int id);
+
+  // the leader of key is done, returns the requests to answer. Their
+  // connection references are handed to the caller.
+  std::vector<Waiter> finish(const std::string& key);
+
+private:
+  std::mutex _lock;
+  std::unordered_map<std::string, std::vector<Waiter> > _flights;
+};
+
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+
+namespace simprpc{
+
+/*
+  Server side state of a stream a client writes to, shared between the event
+  loop delivering its frames and the worker running the session.
+
+  Both directions are flow controlled in chunks: a sender starts with
+  RPCConnection::STREAM_CREDIT chunks of credit and may only send more once
+  the receiver returned some with a window frame, after consuming them.
+*/
+struct StreamChannel{
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::string> inbox;   // chunk frames from the client, not read yet
+  bool ended;                      // the client closed its side
+  int sendCredit;                  // chunks the server may still send
+
+  StreamChannel(int credit): ended(false), sendCredit(credit) { }
+};
+
+}
@@ -0,0 +1,25 @@
+#include <chrono>
+
+#include "stream_reader.h"
+#include "rpc_connection.h"
+
+using namespace simprpc;
+
+bool StreamReader::read(std::vector<XmlElement>& chunk) {
+  std::string frame;
+  {
+    std::unique_lock<std::mutex> lock(_channel->lock);
+    // closing the connection does not signal, check it now and then
+    while(_channel->inbox.empty() && !_channel->ended && !_pc->closed())
+      _channel->cv.wait_for(lock, std::chrono::milliseconds(100));
+    if(_channel->inbox.empty())
+      return false;
+    frame = std::move(_channel->inbox.front());
+    _channel->inbox.pop_front();
+  }
+  if(++_consumed >= RPCConnection::STREAM_CREDIT / 2) {
+    _pc->sendWindow(_id, _consumed);
+    _consumed = 0;
+  }
+  return RPCConnection::decodeChunk(frame, chunk);
+}
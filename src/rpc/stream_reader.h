@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include <memory>
+
+#include "../serialization/serialization.h"
+#include "stream_channel.h"
+
+namespace simprpc{
+
+class RPCConnection;
+
+/*
+  Input of a BidiRPCMethod session, the chunks the client writes in the
+  order it wrote them. Reading returns credit to the client every half
+  window, so at most RPCConnection::STREAM_CREDIT chunks of a stream are ever
+  buffered by the server.
+*/
+class StreamReader{
+public:
+  StreamReader(RPCConnection* pc, int id, const std::shared_ptr<StreamChannel>& channel): _pc(pc), _id(id),
+    _channel(channel), _consumed(0) { }
+  StreamReader(const StreamReader&) = delete;
+  StreamReader& operator=(const StreamReader&) = delete;
+
+  // wait for the next chunk, false once the client closed its side or the
+  // connection is gone
+  bool read(std::vector<XmlElement>& chunk);
+
+private:
+  RPCConnection* _pc;
+  const int _id;
+  std::shared_ptr<StreamChannel> _channel;
+  int _consumed;    // chunks read since credit was last returned
+};
+
+}
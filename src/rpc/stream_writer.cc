@@ -0,0 +1,23 @@
+#include <chrono>
+
+#include "stream_writer.h"
+#include "rpc_connection.h"
+
+using namespace simprpc;
+
+const size_t StreamWriter::WINDOW;
+
+bool StreamWriter::write(const std::vector<XmlElement>& chunk) {
+  if(_channel) {
+    std::unique_lock<std::mutex> lock(_channel->lock);
+    while(_channel->sendCredit <= 0 && !_pc->closed())
+      _channel->cv.wait_for(lock, std::chrono::milliseconds(100));
+    if(_pc->closed())
+      return false;
+    _channel->sendCredit--;
+  }
+  if(!_pc->waitOutput(WINDOW))
+    return false;
+  _chunks++;
+  return _pc->sendChunk(_id, chunk) == 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "../serialization/serialization.h"
+#include "stream_channel.h"
+
+namespace simprpc{
+
+class RPCConnection;
+
+/*
+  Output of a StreamingRPCMethod call. Every write() goes out right away as a
+  chunk frame under the id of the request, the server closes the stream with
+  an empty regular response once the method returns.
+
+  write() blocks while more than WINDOW bytes of the connection are still
+  waiting to be written, so a fast producer is held back by a slow reader
+  instead of piling the result up in memory. Where the worker writes to the
+  socket itself (epoll backend) the full socket buffer does the same. Within a session it also waits
+  for chunk credit from the client, see StreamChannel.
+*/
+class StreamWriter{
+public:
+  static const size_t WINDOW = 1 << 20;
+
+  StreamWriter(RPCConnection* pc, int id, const std::shared_ptr<StreamChannel>& channel = nullptr): _pc(pc),
+    _id(id), _channel(channel), _chunks(0) { }
+  StreamWriter(const StreamWriter&) = delete;
+  StreamWriter& operator=(const StreamWriter&) = delete;
+
+  // send one chunk, false once the connection is gone and the method may stop
+  bool write(const std::vector<XmlElement>& chunk);
+
+  size_t chunks() const { return _chunks; }
+
+private:
+  RPCConnection* _pc;
+  const int _id;
+  std::shared_ptr<StreamChannel> _channel;
+  size_t _chunks;
+};
+
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "transport.h"
+
+using namespace simprpc;
+
+const std::string Transport::UNIX_SCHEME("unix:");
+const std::string Transport::TCP_SCHEME("tcp:");
+const std::string Transport::SHM_SCHEME("shm:");
+
+Transport::Transport(const char* address, int port): _valid(false), _shm(false), _addrlen(0), _bound(false),
+  _dev(0), _ino(0) {
+  memset(&_addr, 0, sizeof(_addr));
+  std::string s(address ? address : "");
+
+  if(s.compare(0, SHM_SCHEME.size(), SHM_SCHEME) == 0) {
+    _shm = true;
+    s = UNIX_SCHEME + s.substr(SHM_SCHEME.size());
+  }
+  if(s.compare(0, UNIX_SCHEME.size(), UNIX_SCHEME) == 0) {
+    _path = s.substr(UNIX_SCHEME.size());
+    struct sockaddr_un* un = (struct sockaddr_un*)&_addr;
+    if(_path.empty() || _path.size() >= sizeof(un->sun_path)) {
+      std::cout << "Transport: invalid unix socket path \"" << _path << "\"\n";
+      return;
+    }
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, _path.c_str(), _path.size() + 1);
+    _addrlen = sizeof(struct sockaddr_un);
+    _valid = true;
+    return;
+  }
+
+  if(s.compare(0, TCP_SCHEME.size(), TCP_SCHEME) == 0)
+    s = s.substr(TCP_SCHEME.size());
+  struct sockaddr_in* in = (struct sockaddr_in*)&_addr;
+  in->sin_family = AF_INET;
+  in->sin_port = htons(port);
+  if(inet_pton(AF_INET, s.c_str(), &in->sin_addr) != 1) {
+    std::cout << "Transport: invalid address \"" << s << "\"\n";
+    return;
+  }
+  _addrlen = sizeof(struct sockaddr_in);
+  _valid = true;
+}
+
+int Transport::listen(int backlog, bool reusePort) {
+  if(!_valid)
+    return -1;
+  if(isLocal()) {
+    // only take the path over from a server that is gone
+    int probe = connect();
+    if(probe >= 0) {
+      ::close(probe);
+      std::cout << "Error: " << _path << " is in use by a running server.\n";
+      errno = EADDRINUSE;
+      return -1;
+    }
+    struct stat st;
+    if(errno == ECONNREFUSED && ::stat(_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      ::unlink(_path.c_str());
+  }
+  int fd = ::socket(_addr.ss_family, SOCK_STREAM, 0);
+  if(fd < 0) {
+    std::cout << "Error creating socket.\n";
+    return -1;
+  }
+  if(!isLocal()) {
+    // allow restarting while old connections are in TIME_WAIT
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+      std::cout << "Error setting SO_REUSEPORT.\n";
+      ::close(fd);
+      return -1;
+    }
+  }
+
+  if(::bind(fd, (const struct sockaddr*)&_addr, _addrlen) < 0) {
+    std::cout << "Error binding.\n";
+    ::close(fd);
+    return -1;
+  }
+  if(isLocal()) {
+    struct stat st;
+    if(::stat(_path.c_str(), &st) == 0) {
+      _bound = true;
+      _dev = st.st_dev;
+      _ino = st.st_ino;
+    }
+  }
+  if(::listen(fd, backlog) < 0) {
+    std::cout << "Error listening.\n";
+    ::close(fd);
+    unlink();
+    return -1;
+  }
+  return fd;
+}
+
+int Transport::connect() const {
+  if(!_valid)
+    return -1;
+  int fd = ::socket(_addr.ss_family, SOCK_STREAM, 0);
+  if(fd < 0)
+    return -1;
+  if(::connect(fd, (const struct sockaddr*)&_addr, _addrlen) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void Transport::unlink() const {
+  // a later server may have replaced a file we lost, leave that one alone
+  struct stat st;
+  if(isLocal() && _bound && ::stat(_path.c_str(), &st) == 0 && st.st_dev == _dev && st.st_ino == _ino)
+    ::unlink(_path.c_str());
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+namespace simprpc{
+
+/*
+  Stream transport shared by RPCServer and RPCClient. The kind of socket is
+  selected by the scheme of the address, framing and everything above the
+  socket stay the same:
+
+    "unix:/run/simprpc.sock"   AF_UNIX stream socket, port is ignored
+    "shm:/run/simprpc.sock"    AF_UNIX socket used to set up a shared memory
+                               channel (see ShmChannel), a server treats it
+                               as "unix:" and accepts both kinds of clients
+    "tcp:127.0.0.1"            AF_INET stream socket on the given port
+    "127.0.0.1"                same as "tcp:"
+*/
+class Transport{
+public:
+  static const std::string UNIX_SCHEME;
+  static const std::string TCP_SCHEME;
+  static const std::string SHM_SCHEME;
+
+  Transport(const char* address, int port);
+
+  bool valid() const { return _valid; }
+  bool isLocal() const { return _addr.ss_family == AF_UNIX; }
+  bool sharedMemory() const { return _shm; }
+  const std::string& path() const { return _path; }
+
+  // create a listening socket bound to this address, -1 on error.
+  // A unix socket file nobody accepts on anymore, left by a previous server,
+  // is removed first. If a live server answers on it, errno is EADDRINUSE.
+  // With reusePort several tcp sockets may listen on the same port and the
+  // kernel spreads incoming connections among them, unix sockets ignore it.
+  int listen(int backlog, bool reusePort = false);
+
+  // create a socket connected to this address, -1 on error
+  int connect() const;
+
+  // remove the socket file of a unix address if it is still the one listen()
+  // created, called by the server on exit
+  void unlink() const;
+
+private:
+  bool _valid;
+  bool _shm;
+  struct sockaddr_storage _addr;
+  socklen_t _addrlen;
+  std::string _path;
+  bool _bound;      // the socket file below was created by listen()
+  dev_t _dev;
+  ino_t _ino;
+};
+
+}
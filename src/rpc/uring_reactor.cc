@@ -0,0 +1,340 @@
+#include <iostream>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#include "uring_reactor.h"
+#include "rpcserver.h"
+#include "rpc_connection.h"
+
+using namespace simprpc;
+
+// user_data of an operation: an fd or a connection pointer shifted to leave
+// room for the kind of operation in the low bits
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE, OP_BUFFERS };
+static const uint64 OP_MASK = 7;
+static const unsigned short BUF_GROUP = 0;
+
+static inline uint64 tag_fd(int fd, int op) { return (uint64(fd) << 3) | op; }
+
+static int uring_setup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+UringReactor::UringReactor(RPCServer* server, int listenfd): Reactor(server, listenfd), _ringfd(-1),
+  _sqPtr(MAP_FAILED), _sqSize(0), _cqPtr(MAP_FAILED), _cqSize(0), _sqes(nullptr), _sqesSize(0), _cqes(nullptr),
+  _sqLocalTail(0), _toSubmit(0), _bufBase(nullptr), _multishotRecv(true),
+  _eventfd(-1), _eventValue(0) { }
+
+UringReactor::~UringReactor() {
+  if(_sqes != nullptr)
+    munmap(_sqes, _sqesSize);
+  if(_cqPtr != MAP_FAILED && _cqPtr != _sqPtr)
+    munmap(_cqPtr, _cqSize);
+  if(_sqPtr != MAP_FAILED)
+    munmap(_sqPtr, _sqSize);
+  if(_ringfd >= 0)
+    close(_ringfd);
+  if(_eventfd >= 0)
+    close(_eventfd);
+  free(_bufBase);
+  for(auto &it : _out)
+    for(size_t i = 0; i < it.second.bufs.size(); i++)
+      it.first->unref();
+  for(auto &p : _pending)
+    p.first->unref();
+}
+
+bool UringReactor::init() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = RING_ENTRIES * 8;   // multishot ops post many completions
+  _ringfd = uring_setup(RING_ENTRIES, &params);
+  if(_ringfd < 0)
+    return false;
+  if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    return false;
+
+  _sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    _sqSize = _cqSize = std::max(_sqSize, _cqSize);
+  _sqPtr = mmap(nullptr, _sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+  if(_sqPtr == MAP_FAILED)
+    return false;
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    _cqPtr = _sqPtr;
+  else {
+    _cqPtr = mmap(nullptr, _cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+    if(_cqPtr == MAP_FAILED)
+      return false;
+  }
+  _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED)
+    return false;
+  _sqes = static_cast<io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(_sqPtr);
+  _sqHead = (unsigned*)(sq + params.sq_off.head);
+  _sqTail = (unsigned*)(sq + params.sq_off.tail);
+  _sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+  _sqArray = (unsigned*)(sq + params.sq_off.array);
+  _sqLocalTail = *_sqTail;
+  char* cq = static_cast<char*>(_cqPtr);
+  _cqHead = (unsigned*)(cq + params.cq_off.head);
+  _cqTail = (unsigned*)(cq + params.cq_off.tail);
+  _cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+  _cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // buffers the kernel picks from for multishot recv
+  void* base;
+  if(posix_memalign(&base, 4096, size_t(BUF_COUNT) * BUF_SIZE) != 0)
+    return false;
+  _bufBase = static_cast<char*>(base);
+  _provide(0, BUF_COUNT);
+
+  _eventfd = eventfd(0, EFD_CLOEXEC);
+  return _eventfd >= 0;
+}
+
+io_uring_sqe* UringReactor::_getSqe() {
+  unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+  if(_sqLocalTail - head >= RING_ENTRIES) {
+    _enter(0, -1);    // ring full, let the kernel consume it
+    head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+  }
+  unsigned idx = _sqLocalTail & *_sqMask;
+  io_uring_sqe* sqe = &_sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  _sqArray[idx] = idx;
+  _sqLocalTail++;
+  _toSubmit++;
+  return sqe;
+}
+
+// submit every queued sqe and wait for wait_nr completions at most timeout_ms
+int UringReactor::_enter(unsigned wait_nr, int timeout_ms) {
+  __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if(timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    arg.ts = (uint64)&ts;
+  }
+  unsigned flags = IORING_ENTER_EXT_ARG | (wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  int ret = uring_enter(_ringfd, _toSubmit, wait_nr, flags, &arg, sizeof(arg));
+  if(ret >= 0)
+    _toSubmit = 0;
+  return ret < 0 ? -errno : ret;
+}
+
+void UringReactor::_armAccept() {
+  io_uring_sqe* sqe = _getSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = _listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = tag_fd(_listenfd, OP_ACCEPT);
+}
+
+void UringReactor::_armRecv(int fd) {
+  io_uring_sqe* sqe = _getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  sqe->ioprio = _multishotRecv ? IORING_RECV_MULTISHOT : 0;
+  sqe->len = _multishotRecv ? 0 : BUF_SIZE;
+  sqe->user_data = tag_fd(fd, OP_RECV);
+}
+
+void UringReactor::_armWake() {
+  io_uring_sqe* sqe = _getSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = _eventfd;
+  sqe->addr = (uint64)&_eventValue;
+  sqe->len = sizeof(_eventValue);
+  sqe->user_data = tag_fd(_eventfd, OP_WAKE);
+}
+
+void UringReactor::_postSend(RPCConnection* pc, OutQueue& q) {
+  const std::string& front = q.bufs.front();
+  io_uring_sqe* sqe = _getSqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = pc->fd();
+  sqe->addr = (uint64)(front.data() + q.offset);
+  sqe->len = front.size() - q.offset;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64)pc | OP_SEND;
+}
+
+// hand count buffers starting at bid back to the kernel, submitted with the
+// next io_uring_enter like every other operation
+void UringReactor::_provide(unsigned bid, unsigned count) {
+  io_uring_sqe* sqe = _getSqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = (uint64)(_bufBase + size_t(bid) * BUF_SIZE);
+  sqe->len = BUF_SIZE;
+  sqe->off = bid;
+  sqe->buf_group = BUF_GROUP;
+  sqe->user_data = OP_BUFFERS;
+}
+
+bool UringReactor::send(RPCConnection* pc, const std::string& xml) {
+  pc->ref();    // dropped once the buffer is written
+  pc->outputQueued(xml.size());
+  if(std::this_thread::get_id() == _loopThread) {
+    // inline method answered from the loop itself, no need to wake it up
+    _queueSend(pc, std::string(xml));
+    return true;
+  }
+  _pendingLock.lock();
+  bool wake = _pending.empty();
+  _pending.push_back(std::make_pair(pc, xml));
+  _pendingLock.unlock();
+  if(wake) {
+    uint64 one = 1;
+    if(write(_eventfd, &one, sizeof(one)) < 0)
+      std::cout << "Error waking event loop, errno: " << errno << std::endl;
+  }
+  return true;
+}
+
+void UringReactor::_queueSend(RPCConnection* pc, std::string&& xml) {
+  OutQueue& q = _out[pc];
+  q.bufs.push_back(std::move(xml));
+  if(q.bufs.size() == 1)   // nothing in flight for this connection yet
+    _postSend(pc, q);
+}
+
+// move responses handed over by workers into the per connection queues
+void UringReactor::_flushPending() {
+  std::vector<std::pair<RPCConnection*, std::string> > batch;
+  _pendingLock.lock();
+  batch.swap(_pending);
+  _pendingLock.unlock();
+  for(auto &p : batch)
+    _queueSend(p.first, std::move(p.second));
+}
+
+void UringReactor::run() {
+  _loopThread = std::this_thread::get_id();
+  _armAccept();
+  _armWake();
+  while(1) {
+    _flushPending();
+    int ret = _enter(1, _timers.nextTimeout());
+    if(ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+      std::cout << "error io_uring_enter. errno: " << -ret << "\n";
+      break;
+    }
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+      _onCqe(&_cqes[head & *_cqMask]);
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    runTimers();
+  }
+}
+
+void UringReactor::_onCqe(const io_uring_cqe* cqe) {
+  uint64 data = cqe->user_data;
+  int op = int(data & OP_MASK);
+  switch(op) {
+    case OP_ACCEPT:
+      if(cqe->res >= 0 && accepted(cqe->res) != nullptr)
+        _armRecv(cqe->res);
+      else if(cqe->res < 0)
+        std::cout << "Error accepting client, errno:" << -cqe->res << std::endl;
+      if(!(cqe->flags & IORING_CQE_F_MORE))
+        _armAccept();
+      break;
+    case OP_RECV:
+      _onRecv(int(data >> 3), cqe->res, cqe->flags);
+      break;
+    case OP_SEND:
+      _onSend((RPCConnection*)(data & ~OP_MASK), cqe->res);
+      break;
+    case OP_WAKE:
+      _armWake();   // pending responses are flushed at the top of the loop
+      break;
+    case OP_BUFFERS:
+      if(cqe->res < 0)
+        std::cout << "Error providing receive buffers, errno: " << -cqe->res << std::endl;
+      break;
+    default:
+      break;
+  }
+}
+
+void UringReactor::_onRecv(int fd, int res, unsigned flags) {
+  RPCConnection* pc = findConnection(fd);
+  if(flags & IORING_CQE_F_BUFFER) {
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if(pc != nullptr && res > 0 && pc->splitXml(_bufBase + size_t(bid) * BUF_SIZE, res) == 0)
+      dispatch(pc);
+    _provide(bid, 1);
+  }
+  if(pc == nullptr)   // completion of an already closed connection
+    return;
+
+  if(res == -EINVAL && _multishotRecv) {   // kernel older than 6.0
+    _multishotRecv = false;
+    _armRecv(fd);
+    return;
+  }
+  if(res == 0 || (res < 0 && res != -ENOBUFS)) {
+    std::cout << "Try closing a connection...";
+    if(closeConnection(fd))
+      std::cout << "OK\n";
+    return;
+  }
+  touched(pc, fd);
+  if(!(flags & IORING_CQE_F_MORE))
+    _armRecv(fd);
+}
+
+void UringReactor::_onSend(RPCConnection* pc, int res) {
+  auto it = _out.find(pc);
+  if(it == _out.end())
+    return;
+  OutQueue& q = it->second;
+  if(res < 0) {
+    std::cout << "Error in sending response, errno: " << -res << std::endl;
+    for(size_t i = 0; i < q.bufs.size(); i++) {
+      pc->outputWritten(q.bufs[i].size());
+      pc->unref();
+    }
+    _out.erase(it);
+    return;
+  }
+  q.offset += res;
+  if(q.offset == q.bufs.front().size()) {
+    pc->outputWritten(q.offset);
+    q.bufs.pop_front();
+    q.offset = 0;
+    pc->unref();
+  }
+  if(q.bufs.empty())
+    _out.erase(it);
+  else
+    _postSend(pc, q);
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "reactor.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace simprpc{
+
+/*
+  io_uring event loop.
+
+  The listening socket uses a multishot accept and every connection a
+  multishot recv picking its buffers from a group provided to the kernel,
+  so a steady stream of requests costs no syscall per read. Responses
+  are handed over by workers through send(), the loop posts them as send
+  operations, at most one in flight per connection to keep them ordered, and
+  submits everything queued in one io_uring_enter per iteration.
+
+  Needs Linux 5.19 or later (multishot accept); the file descriptors a
+  "shm:" client passes cannot be received this way, use epoll for those.
+*/
+class UringReactor : public Reactor{
+public:
+  UringReactor(RPCServer* server, int listenfd);
+  ~UringReactor();
+
+  // set up the rings, false if io_uring or a needed feature is missing
+  bool init();
+
+  void run() override;
+  bool send(RPCConnection* pc, const std::string& xml) override;
+
+private:
+  static const unsigned RING_ENTRIES = 256;
+  static const unsigned BUF_COUNT = 256;      // power of 2
+  static const unsigned BUF_SIZE = 4096;
+
+  struct OutQueue{
+    std::deque<std::string> bufs;
+    size_t offset;    // bytes of front already sent
+    OutQueue(): offset(0) { }
+  };
+
+  int _ringfd;
+  void* _sqPtr;
+  size_t _sqSize;
+  void* _cqPtr;
+  size_t _cqSize;
+  unsigned *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+  unsigned *_cqHead, *_cqTail, *_cqMask;
+  io_uring_sqe* _sqes;
+  size_t _sqesSize;
+  io_uring_cqe* _cqes;
+  unsigned _sqLocalTail;
+  unsigned _toSubmit;
+
+  char* _bufBase;
+  bool _multishotRecv;
+
+  int _eventfd;         // workers wake the loop through it
+  unsigned long _eventValue;
+  std::mutex _pendingLock;
+  std::vector<std::pair<RPCConnection*, std::string> > _pending;
+  std::unordered_map<RPCConnection*, OutQueue> _out;
+  std::thread::id _loopThread;
+
+  io_uring_sqe* _getSqe();
+  int _enter(unsigned wait_nr, int timeout_ms);
+  void _armAccept();
+  void _armRecv(int fd);
+  void _armWake();
+  void _postSend(RPCConnection* pc, OutQueue& q);
+  void _provide(unsigned bid, unsigned count);
+  void _queueSend(RPCConnection* pc, std::string&& xml);
+  void _flushPending();
+  void _onCqe(const io_uring_cqe* cqe);
+  void _onRecv(int fd, int res, unsigned flags);
+  void _onSend(RPCConnection* pc, int res);
+};
+
+}
@@ -0,0 +1,174 @@
+
+// Micro benchmark of XmlElement encode and decode, one case per type and
+// direction. Every trial runs each case for --time-ms and reports the mean
+// time and heap allocations per operation.
+//
+//   serial_bench --trials=5 --time-ms=200 --json=serial.json
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "serialization/xmldata.h"
+#include "bench_report.h"
+
+
+using namespace simprpc;
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options{
+  int trials;
+  int timeMs;     // per case and trial
+  string json;    // file, "-" for stdout
+
+  Options(): trials(5), timeMs(200), json() { }
+};
+
+static void usage() {
+  std::cerr << "usage: serial_bench [--trials=n] [--time-ms=n] [--json=file|-]\n";
+}
+
+static bool parseOptions(int argc, char** argv, Options& opt) {
+  for(int i = 1; i < argc; i++) {
+    string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if(arg.compare(0, 2, "--") != 0 || eq == string::npos)
+      return false;
+    string key = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+    if(key == "trials") opt.trials = atoi(value.c_str());
+    else if(key == "time-ms") opt.timeMs = atoi(value.c_str());
+    else if(key == "json") opt.json = value;
+    else
+      return false;
+  }
+  return opt.trials > 0 && opt.timeMs > 0;
+}
+
+
+struct Case{
+  string name;
+  XmlElement value;
+  string xml;     // value encoded
+};
+
+// there is no public way to build an array, decode one
+static XmlElement intArray(int n) {
+  string xml("<element><array>");
+  for(int i = 0; i < n; i++)
+    xml += XmlElement(i * 7919).encode();
+  xml += "</array></element>";
+  XmlElement ele;
+  size_t offset = 0;
+  ele.decode(xml, &offset);
+  return ele;
+}
+
+static vector<Case> cases() {
+  vector<Case> all(6);
+  all[0].name = "int";
+  all[0].value = XmlElement(123456789);
+  all[1].name = "double";
+  all[1].value = XmlElement(3.14159265358979);
+  all[2].name = "string_64";
+  all[2].value = XmlElement(string(64, 'x'));
+  all[3].name = "string_4k";
+  all[3].value = XmlElement(string(4096, 'x'));
+  string bytes(4096, '\0');
+  for(size_t i = 0; i < bytes.size(); i++)
+    bytes[i] = char(i * 31);
+  all[4].name = "binary_4k";
+  all[4].value = XmlElement(bytes.data(), bytes.size());
+  all[5].name = "array_16";
+  all[5].value = intArray(16);
+  for(auto &c : all)
+    c.xml = c.value.encode();
+  return all;
+}
+
+// results of the measured operations go here, so they are not optimized away
+volatile size_t sink;
+
+// runs op in batches for at least ms, returns ns and allocations per op.
+// Throughput is 1e9 / mean_ns and is left out of the report, it would only
+// repeat every verdict.
+static void measure(const std::function<size_t()>& op, int ms, BenchMetrics& m) {
+  // untimed warm up
+  for(int i = 0; i < 100; i++)
+    sink = op();
+
+  uint64 ops = 0, batch = 64;
+  uint64 allocs = bench::allocations().load();
+  Clock::time_point start = Clock::now(), end = start + std::chrono::milliseconds(ms), now;
+  do {
+    for(uint64 i = 0; i < batch; i++)
+      sink = op();
+    ops += batch;
+    now = Clock::now();
+  } while(now < end);
+  allocs = bench::allocations().load() - allocs;
+
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count() / double(ops);
+  m["mean_ns"] = ns;
+  m["allocs_per_op"] = double(allocs) / ops;
+}
+
+int main(int argc, char** argv) {
+  Options opt;
+  if(!parseOptions(argc, argv, opt)) {
+    usage();
+    return 1;
+  }
+
+  vector<Case> all = cases();
+  vector<BenchTrial> trials;
+  for(int t = 0; t < opt.trials; t++) {
+    BenchTrial trial;
+    for(auto &c : all) {
+      const XmlElement& value = c.value;
+      const string& xml = c.xml;
+      BenchMetrics& enc = trial[c.name + ".encode"];
+      measure([&value] { return value.encode().size(); }, opt.timeMs, enc);
+      enc["bytes"] = double(xml.size());
+      BenchMetrics& dec = trial[c.name + ".decode"];
+      measure([&xml] {
+        XmlElement ele;
+        size_t offset = 0;
+        return ele.decode(xml, &offset) ? offset : 0;
+      }, opt.timeMs, dec);
+      dec["bytes"] = double(xml.size());
+    }
+    trials.push_back(trial);
+  }
+
+  // median of the trials on the console, allocations do not vary
+  printf("%d trials of %d ms per case, median shown\n\n", opt.trials, opt.timeMs);
+  printf("%-18s %8s %12s %12s %10s\n", "case", "bytes", "mean_ns", "ops_per_sec", "allocs/op");
+  for(auto &c : trials[0]) {
+    vector<double> ns;
+    for(auto &t : trials)
+      ns.push_back(t[c.first]["mean_ns"]);
+    std::sort(ns.begin(), ns.end());
+    double median = ns[ns.size() / 2];
+    printf("%-18s %8.0f %12.1f %12.0f %10.2f\n", c.first.c_str(), c.second.at("bytes"), median,
+           median > 0 ? 1e9 / median : 0, c.second.at("allocs_per_op"));
+  }
+
+  if(!opt.json.empty()) {
+    vector<std::pair<string, string> > config;
+    config.push_back(std::make_pair(string("trials"), bench::number(opt.trials)));
+    config.push_back(std::make_pair(string("time_ms"), bench::number(opt.timeMs)));
+    if(!bench::writeReport(opt.json, bench::report("serial", config, trials))) {
+      std::cerr << "serial_bench: can not write " << opt.json << "\n";
+      return 1;
+    }
+  }
+  return 0;
+}
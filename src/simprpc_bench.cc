@@ -0,0 +1,412 @@
+
+// Load generator for the reference methods of test_server (echo, sleep,
+// blob).
+//
+// Open loop (default) sends at a fixed arrival rate no matter how fast the
+// server answers. The latency of a call is counted from the moment it was
+// scheduled, so time it waited for a free in-flight slot is included and a
+// stalling server is not hidden (coordinated omission). Closed loop keeps
+// every in-flight slot busy and measures the server's own pace.
+//
+// Each of --trials runs connects anew and is reported on its own, so that
+// simprpc_compare can tell noise from a change (see bench_report.h).
+//
+//   simprpc_bench --mode=open --rate=5000 --conns=4 --inflight=8 --duration=10
+//                 --mix=echo:8,sleep:1,blob:1 --sizes=64,1024 --trials=3 --json=out.json
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+
+#include "rpc/rpcclient.h"
+#include "bench_report.h"
+
+
+using namespace simprpc;
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options{
+  string host;
+  int port;
+  string mode;        // open or closed
+  double rate;        // calls per second of all connections, open loop
+  int conns;
+  int inflight;       // per connection
+  double duration;    // seconds recorded
+  double warmup;      // seconds run before recording
+  int trials;
+  int sleepUs;        // parameter of sleep calls
+  uint32 timeoutMs;
+  vector<std::pair<string, int> > mix;   // method, weight
+  vector<int> sizes;  // payload bytes of echo and blob calls
+  string json;        // file, "-" for stdout
+
+  Options(): host("127.0.0.1"), port(12345), mode("open"), rate(1000), conns(4), inflight(8), duration(10),
+    warmup(1), trials(1), sleepUs(1000), timeoutMs(10000), json() {
+    mix.push_back(std::make_pair(string("echo"), 1));
+    sizes.push_back(64);
+  }
+};
+
+static void usage() {
+  std::cerr << "usage: simprpc_bench [--host=ip] [--port=n] [--mode=open|closed] [--rate=calls/s]\n"
+               "         [--conns=n] [--inflight=n] [--duration=s] [--warmup=s] [--mix=echo:8,sleep:1,blob:1]\n"
+               "         [--sizes=64,1024] [--sleep-us=n] [--timeout-ms=n] [--trials=n]\n"
+               "         [--json=file|-]\n";
+}
+
+static bool parseOptions(int argc, char** argv, Options& opt) {
+  for(int i = 1; i < argc; i++) {
+    string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if(arg.compare(0, 2, "--") != 0 || eq == string::npos)
+      return false;
+    string key = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+    if(key == "host") opt.host = value;
+    else if(key == "port") opt.port = atoi(value.c_str());
+    else if(key == "mode") opt.mode = value;
+    else if(key == "rate") opt.rate = atof(value.c_str());
+    else if(key == "conns") opt.conns = atoi(value.c_str());
+    else if(key == "inflight") opt.inflight = atoi(value.c_str());
+    else if(key == "duration") opt.duration = atof(value.c_str());
+    else if(key == "warmup") opt.warmup = atof(value.c_str());
+    else if(key == "trials") opt.trials = atoi(value.c_str());
+    else if(key == "sleep-us") opt.sleepUs = atoi(value.c_str());
+    else if(key == "timeout-ms") opt.timeoutMs = atoi(value.c_str());
+    else if(key == "json") opt.json = value;
+    else if(key == "mix") {
+      opt.mix.clear();
+      std::stringstream ss(value);
+      string item;
+      while(std::getline(ss, item, ',')) {
+        size_t colon = item.find(':');
+        int weight = colon == string::npos ? 1 : atoi(item.c_str() + colon + 1);
+        if(weight > 0)
+          opt.mix.push_back(std::make_pair(item.substr(0, colon), weight));
+      }
+    }
+    else if(key == "sizes") {
+      opt.sizes.clear();
+      std::stringstream ss(value);
+      string item;
+      while(std::getline(ss, item, ','))
+        opt.sizes.push_back(std::max(atoi(item.c_str()), 0));
+    }
+    else
+      return false;
+  }
+  return (opt.mode == "open" || opt.mode == "closed") && opt.conns > 0 && opt.inflight > 0 && opt.rate > 0 &&
+    opt.duration > 0 && opt.trials > 0 && !opt.mix.empty() && !opt.sizes.empty();
+}
+
+
+// latencies in microseconds of the recorded calls, per method
+class Recorder{
+public:
+  void add(const string& method, bool ok, uint64 us) {
+    std::lock_guard<std::mutex> lk(_lock);
+    Samples& s = _samples[method];
+    if(ok)
+      s.latencies.push_back(us);
+    else
+      s.failed++;
+  }
+
+  struct Samples{
+    vector<uint64> latencies;
+    uint64 failed;
+    Samples(): failed(0) { }
+  };
+
+  std::map<string, Samples> take() {
+    std::lock_guard<std::mutex> lk(_lock);
+    return _samples;
+  }
+
+private:
+  std::mutex _lock;
+  std::map<string, Samples> _samples;
+};
+
+// picks the method and payload of the next call
+class Workload{
+public:
+  Workload(const Options& opt, unsigned seed): _opt(opt), _rng(seed), _total(0) {
+    for(auto &m : opt.mix)
+      _total += m.second;
+  }
+
+  const string& next(vector<XmlElement>& params) {
+    int r = std::uniform_int_distribution<int>(0, _total - 1)(_rng);
+    size_t i = 0;
+    while(r >= _opt.mix[i].second)
+      r -= _opt.mix[i++].second;
+    const string& method = _opt.mix[i].first;
+    int size = _opt.sizes[std::uniform_int_distribution<size_t>(0, _opt.sizes.size() - 1)(_rng)];
+    params.clear();
+    if(method == "sleep")
+      params.push_back(XmlElement(_opt.sleepUs));
+    else if(method == "blob")
+      params.push_back(XmlElement(size));
+    else
+      params.push_back(XmlElement(string(size, 'x')));
+    return method;
+  }
+
+private:
+  const Options& _opt;
+  std::mt19937 _rng;
+  int _total;
+};
+
+static uint64 elapsedUs(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+
+// Fixed arrival rate over all connections. A call waits for a free slot of
+// some connection if all are busy, its latency counts from its scheduled
+// time all the same. Returns the allocations made while recording.
+static uint64 runOpen(const Options& opt, vector<std::unique_ptr<RPCClient> >& clients, Recorder& rec,
+                    Clock::time_point start, Clock::time_point recordFrom, Clock::time_point end) {
+  std::mutex lock;
+  std::condition_variable cv;
+  vector<int> busy(clients.size(), 0);
+  int outstanding = 0;
+  Workload work(opt, 1);
+  std::chrono::nanoseconds interval(int64(1e9 / opt.rate));
+  size_t rr = 0;
+  uint64 allocs = 0;
+  bool recording = false;
+
+  for(uint64 i = 0; ; i++) {
+    Clock::time_point due = start + interval * i;
+    if(due >= end)
+      break;
+    std::this_thread::sleep_until(due);
+    if(!recording && due >= recordFrom) {
+      recording = true;
+      allocs = bench::allocations().load();
+    }
+
+    size_t c;
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      while(1) {
+        size_t k = 0;
+        for(; k < clients.size() && busy[(rr + k) % clients.size()] >= opt.inflight; k++)
+          ;
+        if(k < clients.size()) {
+          c = (rr + k) % clients.size();
+          break;
+        }
+        cv.wait(lk);
+      }
+      rr = c + 1;
+      busy[c]++;
+      outstanding++;
+    }
+
+    vector<XmlElement> params;
+    string method = work.next(params);
+    bool record = due >= recordFrom;
+    clients[c]->executeAsync(method, params, [&, c, method, due, record](bool ok, vector<XmlElement>& ret) {
+      uint64 us = elapsedUs(due, Clock::now());
+      if(record)
+        rec.add(method, ok, us);
+      std::lock_guard<std::mutex> lk(lock);
+      busy[c]--;
+      outstanding--;
+      cv.notify_all();
+    }, opt.timeoutMs);
+  }
+  allocs = recording ? bench::allocations().load() - allocs : 0;
+
+  std::unique_lock<std::mutex> lk(lock);
+  while(outstanding > 0)
+    cv.wait(lk);
+  return allocs;
+}
+
+// every in-flight slot is a thread calling back to back
+static uint64 runClosed(const Options& opt, vector<std::unique_ptr<RPCClient> >& clients, Recorder& rec,
+                      Clock::time_point recordFrom, Clock::time_point end) {
+  vector<std::thread> threads;
+  for(size_t c = 0; c < clients.size(); c++) {
+    for(int k = 0; k < opt.inflight; k++) {
+      RPCClient* client = clients[c].get();
+      unsigned seed = unsigned(c * opt.inflight + k + 1);
+      threads.emplace_back([&opt, &rec, client, seed, recordFrom, end] {
+        Workload work(opt, seed);
+        vector<XmlElement> params, ret;
+        while(1) {
+          Clock::time_point t0 = Clock::now();
+          if(t0 >= end)
+            break;
+          const string& method = work.next(params);
+          ret.clear();
+          bool ok = client->execute(method, params, ret, opt.timeoutMs);
+          if(t0 >= recordFrom)
+            rec.add(method, ok, elapsedUs(t0, Clock::now()));
+        }
+      });
+    }
+  }
+  std::this_thread::sleep_until(recordFrom);
+  uint64 allocs = bench::allocations().load();
+  std::this_thread::sleep_until(end);
+  allocs = bench::allocations().load() - allocs;
+  for(auto &t : threads)
+    t.join();
+  return allocs;
+}
+
+
+struct Summary{
+  uint64 ok;
+  uint64 failed;
+  double mean, p50, p99, p999, max;
+};
+
+static Summary summarize(vector<uint64>& lat, uint64 failed) {
+  Summary s;
+  s.ok = lat.size();
+  s.failed = failed;
+  s.mean = s.p50 = s.p99 = s.p999 = s.max = 0;
+  if(lat.empty())
+    return s;
+  std::sort(lat.begin(), lat.end());
+  double sum = 0;
+  for(auto v : lat)
+    sum += v;
+  s.mean = sum / lat.size();
+  // nearest rank
+  auto rank = [&lat](double q) { return double(lat[std::min(lat.size() - 1, size_t(q * lat.size()))]); };
+  s.p50 = rank(0.5);
+  s.p99 = rank(0.99);
+  s.p999 = rank(0.999);
+  s.max = double(lat.back());
+  return s;
+}
+
+static BenchMetrics metrics(const Summary& s, double duration) {
+  BenchMetrics m;
+  m["ok"] = double(s.ok);
+  m["failed"] = double(s.failed);
+  m["calls_per_sec"] = s.ok / duration;
+  m["mean_us"] = s.mean;
+  m["p50_us"] = s.p50;
+  m["p99_us"] = s.p99;
+  m["p999_us"] = s.p999;
+  m["max_us"] = s.max;
+  return m;
+}
+
+static void printSummary(const string& name, const Summary& s) {
+  printf("%-8s %10lu %8lu %10.1f %10.0f %10.0f %10.0f %10.0f\n", name.c_str(), s.ok, s.failed, s.mean, s.p50,
+         s.p99, s.p999, s.max);
+}
+
+
+// one run on fresh connections, printed and returned as a report trial
+static BenchTrial runTrial(const Options& opt) {
+  // the client library logs every frame to std::cout, mute it while running
+  std::streambuf* out = std::cout.rdbuf(nullptr);
+  vector<std::unique_ptr<RPCClient> > clients;
+  for(int i = 0; i < opt.conns; i++)
+    clients.emplace_back(new RPCClient(opt.host.c_str(), opt.port));
+
+  Recorder rec;
+  Clock::time_point start = Clock::now();
+  Clock::time_point recordFrom = start + std::chrono::microseconds(int64(opt.warmup * 1e6));
+  Clock::time_point end = recordFrom + std::chrono::microseconds(int64(opt.duration * 1e6));
+  uint64 allocs;
+  if(opt.mode == "open")
+    allocs = runOpen(opt, clients, rec, start, recordFrom, end);
+  else
+    allocs = runClosed(opt, clients, rec, recordFrom, end);
+  clients.clear();
+  std::cout.rdbuf(out);
+  std::cout.clear();
+
+  std::map<string, Recorder::Samples> samples = rec.take();
+  vector<uint64> all;
+  uint64 failed = 0;
+  BenchTrial trial;
+  printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n", "method", "ok", "failed", "mean_us", "p50_us", "p99_us",
+         "p99.9_us", "max_us");
+  for(auto &m : samples) {
+    all.insert(all.end(), m.second.latencies.begin(), m.second.latencies.end());
+    failed += m.second.failed;
+    Summary s = summarize(m.second.latencies, m.second.failed);
+    printSummary(m.first, s);
+    trial[m.first] = metrics(s, opt.duration);
+  }
+  Summary total = summarize(all, failed);
+  printSummary("all", total);
+  trial["all"] = metrics(total, opt.duration);
+  // of the whole client process, allocations can not be told apart by method
+  uint64 calls = total.ok + total.failed;
+  trial["all"]["allocs_per_call"] = calls > 0 ? double(allocs) / calls : 0;
+  printf("throughput %.1f calls/s, %.1f client allocations per call\n", trial["all"]["calls_per_sec"],
+         trial["all"]["allocs_per_call"]);
+  return trial;
+}
+
+int main(int argc, char** argv) {
+  Options opt;
+  if(!parseOptions(argc, argv, opt)) {
+    usage();
+    return 1;
+  }
+
+  printf("mode %s, %d connections x %d in flight, %.1fs", opt.mode.c_str(), opt.conns, opt.inflight, opt.duration);
+  if(opt.mode == "open")
+    printf(", target %.0f calls/s", opt.rate);
+  printf("\n");
+
+  vector<BenchTrial> trials;
+  bool ok = true;
+  for(int t = 0; t < opt.trials; t++) {
+    printf("\ntrial %d of %d\n", t + 1, opt.trials);
+    trials.push_back(runTrial(opt));
+    ok = ok && trials.back()["all"]["ok"] > 0;
+  }
+
+  if(!opt.json.empty()) {
+    string mix, sizes;
+    for(auto &m : opt.mix)
+      mix += (mix.empty() ? "" : ",") + m.first + ":" + std::to_string(m.second);
+    for(auto size : opt.sizes)
+      sizes += (sizes.empty() ? "" : ",") + std::to_string(size);
+    vector<std::pair<string, string> > config;
+    config.push_back(std::make_pair(string("mode"), bench::quote(opt.mode)));
+    config.push_back(std::make_pair(string("rate"), bench::number(opt.mode == "open" ? opt.rate : 0)));
+    config.push_back(std::make_pair(string("conns"), bench::number(opt.conns)));
+    config.push_back(std::make_pair(string("inflight"), bench::number(opt.inflight)));
+    config.push_back(std::make_pair(string("duration_s"), bench::number(opt.duration)));
+    config.push_back(std::make_pair(string("warmup_s"), bench::number(opt.warmup)));
+    config.push_back(std::make_pair(string("mix"), bench::quote(mix)));
+    config.push_back(std::make_pair(string("sizes"), bench::quote(sizes)));
+    config.push_back(std::make_pair(string("trials"), bench::number(opt.trials)));
+    if(!bench::writeReport(opt.json, bench::report("rpc", config, trials))) {
+      std::cerr << "simprpc_bench: can not write " << opt.json << "\n";
+      return 1;
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,369 @@
+
+// Compares two benchmark reports (bench_report.h) of the same bench, e.g. a
+// stored baseline and a run of a change, metric by metric.
+//
+// A metric is flagged when the new mean is worse than the baseline mean by
+// more than --threshold percent and also by more than --sigma standard errors
+// of the difference, estimated from the spread of the trials on both sides.
+// Noisy metrics thus need a larger change to be flagged; with one trial per
+// side only the percent threshold applies.
+//
+//   simprpc_compare base.json new.json [--threshold=5] [--sigma=3] [--changed]
+//
+// Exits with 1 if anything regressed, 2 if a report can not be read.
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "bench_report.h"
+
+
+using namespace simprpc;
+using std::string;
+using std::vector;
+
+// just enough JSON for the reports
+struct Json{
+  enum Type { Null, Bool, Number, String, Array, Object };
+  Type type;
+  double number;
+  string str;
+  vector<Json> items;
+  std::map<string, Json> fields;
+
+  Json(): type(Null), number(0) { }
+
+  const Json* get(const string& key) const {
+    auto it = fields.find(key);
+    return it == fields.end() ? nullptr : &it->second;
+  }
+};
+
+class JsonParser{
+public:
+  explicit JsonParser(const string& text): _s(text), _pos(0) { }
+
+  bool parse(Json& out) {
+    if(!value(out))
+      return false;
+    space();
+    return _pos == _s.size();
+  }
+
+private:
+  void space() {
+    while(_pos < _s.size() && isspace(static_cast<unsigned char>(_s[_pos])))
+      _pos++;
+  }
+
+  bool literal(const char* word) {
+    size_t n = strlen(word);
+    if(_s.compare(_pos, n, word) != 0)
+      return false;
+    _pos += n;
+    return true;
+  }
+
+  bool quoted(string& out) {
+    if(_pos >= _s.size() || _s[_pos] != '"')
+      return false;
+    for(_pos++; _pos < _s.size(); _pos++) {
+      char c = _s[_pos];
+      if(c == '"') {
+        _pos++;
+        return true;
+      }
+      if(c == '\\') {
+        if(++_pos >= _s.size())
+          return false;
+        c = _s[_pos];
+        if(c == 'n') c = '\n';
+        else if(c == 't') c = '\t';
+        else if(c == 'u') {
+          // the reports never need it, keep the escape as it is
+          out += "\\u";
+          continue;
+        }
+      }
+      out += c;
+    }
+    return false;
+  }
+
+  bool value(Json& out) {
+    space();
+    if(_pos >= _s.size())
+      return false;
+    char c = _s[_pos];
+    if(c == '{') {
+      out.type = Json::Object;
+      _pos++;
+      space();
+      if(_pos < _s.size() && _s[_pos] == '}') {
+        _pos++;
+        return true;
+      }
+      while(1) {
+        string key;
+        space();
+        if(!quoted(key))
+          return false;
+        space();
+        if(_pos >= _s.size() || _s[_pos++] != ':')
+          return false;
+        if(!value(out.fields[key]))
+          return false;
+        space();
+        if(_pos >= _s.size())
+          return false;
+        c = _s[_pos++];
+        if(c == '}')
+          return true;
+        if(c != ',')
+          return false;
+      }
+    }
+    if(c == '[') {
+      out.type = Json::Array;
+      _pos++;
+      space();
+      if(_pos < _s.size() && _s[_pos] == ']') {
+        _pos++;
+        return true;
+      }
+      while(1) {
+        out.items.push_back(Json());
+        if(!value(out.items.back()))
+          return false;
+        space();
+        if(_pos >= _s.size())
+          return false;
+        c = _s[_pos++];
+        if(c == ']')
+          return true;
+        if(c != ',')
+          return false;
+      }
+    }
+    if(c == '"') {
+      out.type = Json::String;
+      return quoted(out.str);
+    }
+    if(literal("true")) {
+      out.type = Json::Bool;
+      out.number = 1;
+      return true;
+    }
+    if(literal("false")) {
+      out.type = Json::Bool;
+      return true;
+    }
+    if(literal("null"))
+      return true;
+    const char* start = _s.c_str() + _pos;
+    char* end;
+    out.number = strtod(start, &end);
+    if(end == start)
+      return false;
+    out.type = Json::Number;
+    _pos += end - start;
+    return true;
+  }
+
+  const string& _s;
+  size_t _pos;
+};
+
+
+struct Report{
+  string bench;
+  std::map<string, string> config;    // values as text
+  vector<BenchTrial> trials;
+};
+
+static bool load(const char* path, Report& r) {
+  FILE* f = fopen(path, "r");
+  if(f == nullptr) {
+    std::cerr << "simprpc_compare: can not open " << path << "\n";
+    return false;
+  }
+  string text;
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    text.append(buf, n);
+  fclose(f);
+
+  Json js;
+  if(!JsonParser(text).parse(js) || js.type != Json::Object) {
+    std::cerr << "simprpc_compare: " << path << " is not valid JSON\n";
+    return false;
+  }
+  const Json* schema = js.get("schema");
+  if(schema == nullptr || schema->str != BENCH_SCHEMA) {
+    std::cerr << "simprpc_compare: " << path << " is not a " << BENCH_SCHEMA << " report\n";
+    return false;
+  }
+  const Json* name = js.get("bench");
+  const Json* trials = js.get("trials");
+  if(name == nullptr || trials == nullptr || trials->type != Json::Array || trials->items.empty()) {
+    std::cerr << "simprpc_compare: " << path << " has no trials\n";
+    return false;
+  }
+  r.bench = name->str;
+  if(const Json* config = js.get("config")) {
+    for(auto &c : config->fields)
+      r.config[c.first] = c.second.type == Json::String ? c.second.str : bench::number(c.second.number);
+  }
+  for(auto &t : trials->items) {
+    BenchTrial trial;
+    for(auto &c : t.fields) {
+      for(auto &m : c.second.fields) {
+        if(m.second.type == Json::Number)
+          trial[c.first][m.first] = m.second.number;
+      }
+    }
+    r.trials.push_back(trial);
+  }
+  return true;
+}
+
+
+// +1 if higher is better, -1 if lower is, 0 if the metric is not judged
+static int direction(const string& metric) {
+  auto endsWith = [&metric](const char* suffix) {
+    size_t n = strlen(suffix);
+    return metric.size() >= n && metric.compare(metric.size() - n, n, suffix) == 0;
+  };
+  if(endsWith("_per_sec"))
+    return 1;
+  if(endsWith("_us") || endsWith("_ns") || metric.compare(0, 11, "allocs_per_") == 0)
+    return -1;
+  return 0;
+}
+
+struct Stats{
+  size_t n;
+  double mean, sd;
+};
+
+// over the trials that have the metric
+static Stats stats(const Report& r, const string& c, const string& metric) {
+  vector<double> v;
+  for(auto &t : r.trials) {
+    auto ci = t.find(c);
+    if(ci == t.end())
+      continue;
+    auto mi = ci->second.find(metric);
+    if(mi != ci->second.end())
+      v.push_back(mi->second);
+  }
+  Stats s;
+  s.n = v.size();
+  s.mean = s.sd = 0;
+  for(auto x : v)
+    s.mean += x;
+  if(s.n > 0)
+    s.mean /= s.n;
+  for(auto x : v)
+    s.sd += (x - s.mean) * (x - s.mean);
+  s.sd = s.n > 1 ? sqrt(s.sd / (s.n - 1)) : 0;
+  return s;
+}
+
+static void usage() {
+  std::cerr << "usage: simprpc_compare base.json new.json [--threshold=percent] [--sigma=n] [--changed]\n";
+}
+
+int main(int argc, char** argv) {
+  vector<const char*> files;
+  double threshold = 5, sigma = 3;
+  bool changedOnly = false;
+  for(int i = 1; i < argc; i++) {
+    string arg(argv[i]);
+    if(arg.compare(0, 12, "--threshold=") == 0) threshold = atof(arg.c_str() + 12);
+    else if(arg.compare(0, 8, "--sigma=") == 0) sigma = atof(arg.c_str() + 8);
+    else if(arg == "--changed") changedOnly = true;
+    else if(arg.compare(0, 2, "--") != 0) files.push_back(argv[i]);
+    else {
+      usage();
+      return 2;
+    }
+  }
+  if(files.size() != 2) {
+    usage();
+    return 2;
+  }
+
+  Report base, cur;
+  if(!load(files[0], base) || !load(files[1], cur))
+    return 2;
+  if(base.bench != cur.bench) {
+    std::cerr << "simprpc_compare: can not compare a " << base.bench << " bench to a " << cur.bench << " bench\n";
+    return 2;
+  }
+  // results of different settings are still compared, but say so
+  std::set<string> keys;
+  for(auto &c : base.config)
+    keys.insert(c.first);
+  for(auto &c : cur.config)
+    keys.insert(c.first);
+  for(auto &k : keys) {
+    if(k != "trials" && base.config[k] != cur.config[k])
+      printf("config %s differs: %s -> %s\n", k.c_str(), base.config[k].c_str(), cur.config[k].c_str());
+  }
+  printf("%s bench, %zu vs %zu trials, flagged beyond %.1f%% and %.1f sigma\n", base.bench.c_str(),
+         base.trials.size(), cur.trials.size(), threshold, sigma);
+  if(base.trials.size() < 2 || cur.trials.size() < 2)
+    printf("too few trials to estimate noise, only the percent threshold applies\n");
+  printf("\n%-20s %-16s %22s %22s %9s  %s\n", "case", "metric", "base", "new", "change", "verdict");
+
+  // cases and metrics of the first trials, the others have the same ones
+  int regressions = 0, improvements = 0;
+  for(auto &c : base.trials[0]) {
+    auto other = cur.trials[0].find(c.first);
+    if(other == cur.trials[0].end())
+      continue;
+    for(auto &m : c.second) {
+      int dir = direction(m.first);
+      if(dir == 0 || other->second.count(m.first) == 0)
+        continue;
+      Stats b = stats(base, c.first, m.first), n = stats(cur, c.first, m.first);
+      double noise = sqrt(b.sd * b.sd / b.n + n.sd * n.sd / n.n);
+      double limit = std::max(fabs(b.mean) * threshold / 100, sigma * noise);
+      double better = (n.mean - b.mean) * dir;
+      const char* verdict = "";
+      if(-better > limit) {
+        verdict = "REGRESSION";
+        regressions++;
+      }
+      else if(better > limit) {
+        verdict = "improved";
+        improvements++;
+      }
+      else if(changedOnly)
+        continue;
+
+      char bs[32], ns[32], change[16];
+      snprintf(bs, sizeof(bs), "%.6g +- %.2g", b.mean, b.sd);
+      snprintf(ns, sizeof(ns), "%.6g +- %.2g", n.mean, n.sd);
+      if(b.mean != 0)
+        snprintf(change, sizeof(change), "%+.1f%%", (n.mean - b.mean) / fabs(b.mean) * 100);
+      else
+        snprintf(change, sizeof(change), "n/a");
+      printf("%-20s %-16s %22s %22s %9s  %s\n", c.first.c_str(), m.first.c_str(), bs, ns, change, verdict);
+    }
+  }
+  printf("\n%d regressions, %d improvements\n", regressions, improvements);
+  return regressions > 0 ? 1 : 0;
+}
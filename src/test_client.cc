@@ -6,6 +6,8 @@
 #include <thread>
 #include <unistd.h>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include "rpc/rpcclient.h"
 
 
@@ -116,9 +118,172 @@ void medium_test() {
     cout << count << "passed, " << NUM_THDS - count << "failed.\n";
 }
 
+// temp is removed while calls of it are running: those still complete,
+// later ones fail until it is added again
+bool removal_test() {
+  RPCClient client("127.0.0.1", 12345);
+  const int CALLS = 6;
+  std::atomic<int> done(0), ok(0);
+  for(int i = 0; i < CALLS; i++) {
+    vector<XmlElement> params;
+    params.emplace_back(i);
+    client.executeAsync("temp", params, [&done, &ok, i](bool success, vector<XmlElement>& ret) {
+      if(success && ret.size() == 1 && *((int*)ret[0].getdata()) == i)
+        ok++;
+      done++;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  vector<XmlElement> cmd, ret;
+  cmd.emplace_back(string("remove"));
+  bool removed = client.execute("admin", cmd, ret) && *((int*)ret[0].getdata()) == 1;
+  int doneAtRemoval = done.load();
+  while(done.load() < CALLS)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  vector<XmlElement> params;
+  params.emplace_back(7);
+  ret.clear();
+  bool gone = !client.execute("temp", params, ret);
+
+  cmd[0] = XmlElement(string("add"));
+  ret.clear();
+  bool added = client.execute("admin", cmd, ret) && *((int*)ret[0].getdata()) == 1;
+  client.refreshMethods();
+  ret.clear();
+  bool back = client.execute("temp", params, ret) && *((int*)ret[0].getdata()) == 7;
+
+  bool passed = removed && doneAtRemoval == CALLS && ok == CALLS && gone && added && back;
+  cout << (passed ? "Removal OK!\n" : "Removal failed!\n");
+  return passed;
+}
+
+// count streams its chunks in order, sum answers each chunk written to it
+bool stream_test() {
+  RPCClient client("127.0.0.1", 12345);
+  const int N = 100;
+
+  vector<XmlElement> params;
+  params.emplace_back(N);
+  int next = 0;
+  bool inOrder = true;
+  bool streamed = client.executeStream("count", params, [&next, &inOrder](vector<XmlElement>& chunk) {
+    if(chunk.size() != 1 || *((int*)chunk[0].getdata()) != next)
+      inOrder = false;
+    next++;
+  }, 5000);
+  streamed = streamed && inOrder && next == N;
+  cout << (streamed ? "Stream OK!\n" : "Stream failed!\n");
+
+  bool echoed = false, total = false;
+  std::unique_ptr<ClientStream> s = client.openStream("sum", vector<XmlElement>(), 5000);
+  if(s) {
+    echoed = true;
+    int sum = 0;
+    for(int i = 1; i <= N && echoed; i++) {
+      vector<XmlElement> chunk, back;
+      chunk.emplace_back(i);
+      sum += i;
+      echoed = s->write(chunk) && s->read(back) && back.size() == 1 && *((int*)back[0].getdata()) == sum;
+    }
+    vector<XmlElement> ret;
+    total = s->finish(ret) && ret.size() == 1 && *((int*)ret[0].getdata()) == N * (N + 1) / 2;
+  }
+  bool bidi = echoed && total;
+  cout << (bidi ? "Bidi OK!\n" : "Bidi failed!\n");
+  return streamed && bidi;
+}
+
+// faulty entries of a batch do not fail the others
+bool batch_test() {
+  RPCClient client("127.0.0.1", 12345);
+  vector<RPCClient::BatchCall> calls(4);
+  calls[0].method = "echo";
+  calls[0].params.emplace_back(1);
+  calls[1].method = "nosuchmethod";
+  calls[2].method = "count";
+  calls[2].params.emplace_back(3);
+  calls[3].method = "echo";
+  calls[3].params.emplace_back(string("two"));
+
+  vector<RPCClient::BatchResult> results;
+  bool passed = client.executeBatch(calls, results, 5000) && results.size() == 4
+    && results[0].ok && results[0].values.size() == 1 && *((int*)results[0].values[0].getdata()) == 1
+    && !results[1].ok && results[1].fault == "method not found"
+    && !results[2].ok && results[2].fault == "method can not be batched"
+    && results[3].ok && results[3].values.size() == 1 && *((string*)results[3].values[0].getdata()) == "two";
+  cout << (passed ? "Batch OK!\n" : "Batch failed!\n");
+  return passed;
+}
+
+// a call fails once its timeout passed, the connection stays usable
+bool deadline_test() {
+  RPCClient client("127.0.0.1", 12345);
+  vector<XmlElement> params, ret;
+  params.emplace_back(300000);
+  auto start = std::chrono::steady_clock::now();
+  bool expired = !client.execute("sleep", params, ret, 50);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+  params[0] = XmlElement(1000);
+  ret.clear();
+  bool after = client.execute("sleep", params, ret, 1000);
+  bool passed = expired && ms < 250 && after;
+  cout << (passed ? "Deadline OK!\n" : "Deadline failed!\n");
+  return passed;
+}
+
+// calls over a shared memory channel, including results larger than its
+// rings and a request expired by the server while queued
+bool shm_test() {
+  RPCClient client("shm:/tmp/simprpc_test.sock", 0);
+  bool echoed = true;
+  for(int i = 0; i < 200 && echoed; i++) {
+    vector<XmlElement> params, ret;
+    params.emplace_back(i);
+    echoed = client.execute("echo", params, ret) && ret.size() == 1 && *((int*)ret[0].getdata()) == i;
+  }
+
+  vector<XmlElement> params, ret;
+  params.emplace_back(3 << 20);
+  bool large = client.execute("blob", params, ret) && ret.size() == 1 && ((XmlElement::BinaryData*)ret[0].getdata())->size() == size_t(3 << 20);
+
+  // the only worker sleeps, echo waits in the queue until it times out
+  std::atomic<bool> slept(false);
+  params[0] = XmlElement(300000);
+  client.executeAsync("sleep", params, [&slept](bool success, vector<XmlElement>& ret) {
+    slept = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  params[0] = XmlElement(1);
+  ret.clear();
+  auto start = std::chrono::steady_clock::now();
+  bool expired = !client.execute("echo", params, ret);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  while(!slept.load())
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  bool passed = echoed && large && expired && ms < 250;
+  cout << (passed ? "Shm OK!\n" : "Shm failed!\n");
+  return passed;
+}
+
 int main() {
   // simple_test();
   medium_test();
+
+  int failed = 0;
+  failed += !removal_test();
+  failed += !stream_test();
+  failed += !batch_test();
+  failed += !deadline_test();
+  failed += !shm_test();
+  if(failed == 0)
+    cout << "ALL PASSED!\n";
+  else
+    cout << failed << " test(s) failed.\n";
+  return failed;
 }
 
 
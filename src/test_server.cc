@@ -2,6 +2,9 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <thread>
+#include <chrono>
+#include <algorithm>
 
 #include "rpc/rpc.h"
 
@@ -32,15 +35,153 @@ void HelloMethod::execute(const std::vector<XmlElement> &params, std::vector<Xml
   results.push_back({3.1415926});
 }
 
+// Reference targets of simprpc_bench:
+//  echo(x...)      returns its parameters
+//  sleep(us)       returns after us microseconds, holding the worker
+//  blob(n)         returns a binary of n bytes
+class EchoMethod : public RPCMethod {
+public:
+  EchoMethod(): RPCMethod("echo") { }
+
+  void execute(const std::vector<XmlElement> &params, std::vector<XmlElement> &results) override {
+    for(auto &param : params)
+      results.push_back(param);
+  }
+};
+
+class SleepMethod : public RPCMethod {
+public:
+  SleepMethod(): RPCMethod("sleep") { }
+
+  void execute(const std::vector<XmlElement> &params, std::vector<XmlElement> &results) override {
+    if(!params.empty() && params[0].istype(TypeInt))
+      std::this_thread::sleep_for(std::chrono::microseconds(*((int*)params[0].getdata())));
+  }
+};
+
+class BlobMethod : public RPCMethod {
+public:
+  BlobMethod(): RPCMethod("blob") { }
+
+  void execute(const std::vector<XmlElement> &params, std::vector<XmlElement> &results) override {
+    int n = 0;
+    if(!params.empty() && params[0].istype(TypeInt))
+      n = std::max(*((int*)params[0].getdata()), 0);
+    std::string data(n, 'x');
+    results.push_back(XmlElement(data.data(), data.size()));
+  }
+};
+
+// Targets of test_client:
+//  temp(x)         returns x after 100 ms, in a pool of its own behind a
+//                  bulkhead, so that removing it frees both
+//  admin(cmd)      "remove" or "add" temp while it is being called
+//  count(n)        streams the chunks 0 .. n-1
+//  sum()           answers every chunk with the running sum, returns the total
+class TempMethod : public RPCMethod {
+public:
+  TempMethod(): RPCMethod("temp", RPCMethod::DEDICATED, 2) { }
+
+  void execute(const std::vector<XmlElement> &params, std::vector<XmlElement> &results) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    for(auto &param : params)
+      results.push_back(param);
+  }
+};
+
+class AdminMethod : public RPCMethod {
+public:
+  AdminMethod(RPCServer* server, TempMethod* temp): RPCMethod("admin"), _server(server), _temp(temp) { }
+
+  void execute(const std::vector<XmlElement> &params, std::vector<XmlElement> &results) override {
+    std::string cmd;
+    if(!params.empty() && params[0].istype(TypeString))
+      cmd = *((std::string*)params[0].getdata());
+    bool ok = false;
+    if(cmd == "remove")   // waits for the calls of temp already dispatched
+      ok = _server->removeMethod("temp");
+    else if(cmd == "add")
+      ok = _server->registMethod(_temp, 2, 8);
+    results.push_back(XmlElement(ok ? 1 : 0));
+  }
+
+private:
+  RPCServer* _server;
+  TempMethod* _temp;
+};
+
+class CountMethod : public StreamingRPCMethod {
+public:
+  CountMethod(): StreamingRPCMethod("count") { }
+
+  void stream(const std::vector<XmlElement> &params, StreamWriter &out) override {
+    int n = 0;
+    if(!params.empty() && params[0].istype(TypeInt))
+      n = *((int*)params[0].getdata());
+    for(int i = 0; i < n; i++)
+      if(!out.write({XmlElement(i)}))
+        return;
+  }
+};
+
+class SumMethod : public BidiRPCMethod {
+public:
+  SumMethod(): BidiRPCMethod("sum", RPCMethod::DEDICATED, 2) { }
+
+  void session(const std::vector<XmlElement> &params, StreamReader &in, StreamWriter &out,
+               std::vector<XmlElement> &result) override {
+    int sum = 0;
+    std::vector<XmlElement> chunk;
+    while(in.read(chunk)) {
+      for(auto &ele : chunk)
+        if(ele.istype(TypeInt))
+          sum += *((int*)ele.getdata());
+      chunk.clear();
+      out.write({XmlElement(sum)});
+    }
+    result.push_back(XmlElement(sum));
+  }
+};
+
 void start_server() {
   RPCServer server("127.0.0.1", 12345, 4);
   HelloMethod md("hello");
+  EchoMethod echo;
+  SleepMethod sleep;
+  BlobMethod blob;
+  TempMethod temp;
+  AdminMethod admin(&server, &temp);
+  CountMethod count;
+  SumMethod sum;
   server.registMethod(&md);
+  server.registMethod(&echo);
+  server.registMethod(&sleep);
+  server.registMethod(&blob);
+  server.registMethod(&temp, 2, 8);
+  server.registMethod(&admin);
+  server.registMethod(&count);
+  server.registMethod(&sum);
   server.start();
 
 }
 
+// local clients of test_client connect with "shm:" to this one, a single
+// worker and a short request timeout let it expire queued requests
+void start_local_server() {
+  RPCServer server("unix:/tmp/simprpc_test.sock", 0, 1);
+  EchoMethod echo;
+  SleepMethod sleep;
+  BlobMethod blob;
+  server.registMethod(&echo);
+  server.registMethod(&sleep);
+  server.registMethod(&blob);
+  server.setRequestTimeout(100);
+  server.start();
+}
+
 int main() {
+  std::thread local(start_local_server);
+  local.detach();
   start_server();
 }
 